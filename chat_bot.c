@@ -0,0 +1,212 @@
+/* --- chat_bot.c (客户端库示例：一个进程挂很多机器人) --- */
+// 用法: ./chat_bot [-h ip] [-p port] [-n sessions] [-C connect_rate] [-t seconds] [-r rate] [-u] [-z]
+// 用 chat_client 库在一个线程里登录 sessions 个机器人（每秒最多连 connect_rate 个），
+// 全部连上后每秒一共发 rate 个带编号的私聊（随机挑一个机器人发给自己），不等回复接着发，
+// 统计回复延迟、超时和断线数。别人私聊机器人 "ping" 时它回 "pong"。
+// -u：走 UDP 服务器。-z：登录时请求压缩，最后报告收到的字节数和解压后的字节数。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include "chat_client.h"
+
+chat_conn_t **bots;
+char *opened;
+int nopen, nclosed;
+long replies, timeouts, failed;
+long pushes; // 收到的推送（上线通知、私聊等）
+long long *lat;
+long nlat, max_lat;
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 进程的常驻内存（KB）
+static long rss_kb(void)
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+    long pages = 0, rss = 0;
+    if (fp != NULL) {
+        if (fscanf(fp, "%ld %ld", &pages, &rss) != 2) rss = 0;
+        fclose(fp);
+    }
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void on_open(chat_conn_t *c, void *ud)
+{
+    (void)c;
+    opened[(intptr_t)ud] = 1;
+    nopen++;
+}
+
+void on_close(chat_conn_t *c, int err, void *ud)
+{
+    if (nclosed == 0) {
+        printf("%s closed: %s\n", chat_conn_id(c), err ? strerror(err) : "by server");
+    }
+    bots[(intptr_t)ud] = NULL;
+    if (opened[(intptr_t)ud]) nopen--;
+    nclosed++;
+}
+
+// 有人私聊 "ping" 就回 "pong"
+void on_msg(chat_conn_t *c, const msg_t *msg, void *ud)
+{
+    (void)ud;
+    char from[32];
+    pushes++;
+    if (strcmp(msg->text, "ping") == 0 && sscanf(msg->id, "%31s (private)", from) == 1 &&
+        strstr(msg->id, "(private)") != NULL) {
+        chat_private(c, from, "pong", NULL, NULL);
+    }
+}
+
+// arg 里放的是发出时刻
+void on_reply(chat_conn_t *c, int status, const char *text, void *arg)
+{
+    (void)c; (void)text;
+    if (status == CHAT_OK) {
+        replies++;
+        if (nlat < max_lat) lat[nlat++] = now_us() - (intptr_t)arg;
+    } else if (status == CHAT_TIMEOUT) {
+        timeouts++;
+    } else {
+        failed++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *ip = "127.0.0.1";
+    int port = 8888;
+    int nsessions = 1000;
+    int connect_rate = 2000;
+    int seconds = 10;
+    double rate = 1000;
+    int proto = CHAT_TCP;
+    int zlib = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:n:C:t:r:uz")) != -1) {
+        switch (opt) {
+        case 'h': ip = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'n': nsessions = atoi(optarg); break;
+        case 'C': connect_rate = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'u': proto = CHAT_UDP; break;
+        case 'z': zlib = 1; break;
+        default:
+            printf("usage:./chat_bot [-h ip] [-p port] [-n sessions] [-C connect_rate] "
+                   "[-t seconds] [-r rate] [-u] [-z]\n");
+            return -1;
+        }
+    }
+
+    chat_loop_t *loop = chat_loop_new();
+    if (loop == NULL) {
+        return -1;
+    }
+    chat_loop_set_zlib(loop, zlib);
+    bots = calloc(nsessions, sizeof(chat_conn_t *));
+    opened = calloc(nsessions, 1);
+    max_lat = (long)(rate * seconds) + 16;
+    lat = malloc(sizeof(long long) * max_lat);
+    chat_handler_t h = { on_open, on_msg, on_close };
+    srand(time(NULL));
+
+    // 1. 按速率登录，等全部连上（最多 30 秒）
+    long long start = now_us(), deadline = start + 30000000LL;
+    int started = 0;
+    while (nopen < nsessions - nclosed && now_us() < deadline) {
+        long long due = (now_us() - start) * connect_rate / 1000000 + 1;
+        while (started < nsessions && started < due) {
+            char id[32];
+            snprintf(id, sizeof(id), "bot%d", started);
+            bots[started] = chat_connect(loop, proto, ip, port, id, &h, (void *)(intptr_t)started);
+            if (bots[started] == NULL) {
+                nclosed++;
+            }
+            started++;
+        }
+        chat_loop_run(loop, 10);
+    }
+    printf("%d of %d sessions open in %.2fs (%d failed), rss %ld KB\n", nopen, nsessions,
+           (now_us() - start) / 1e6, nclosed, rss_kb());
+    if (nopen == 0) {
+        return -1;
+    }
+
+    // 每个人上线服务器都要通知所有在线的人：等这批通知收完（1 秒没有新推送），别算进压测
+    long long quiet = now_us();
+    long last = -1;
+    while (now_us() - quiet < 1000000LL && now_us() - start < 120000000LL) {
+        if (pushes != last) {
+            last = pushes;
+            quiet = now_us();
+        }
+        chat_loop_run(loop, 100);
+    }
+    unsigned long long wire, frames;
+    chat_loop_rx_stats(loop, &wire, &frames);
+    printf("settled after %.2fs, %ld login notices received, %.1f KB on the wire for %.1f KB of frames\n",
+           (now_us() - start) / 1e6, pushes, wire / 1024.0, frames / 1024.0);
+
+    // 2. 按速率发带编号的私聊，不等回复
+    long sent = 0, due_count = 0;
+    long long t0 = now_us(), end = t0 + seconds * 1000000LL;
+    size_t max_pending = 0;
+    while (now_us() < end) {
+        long long due = (long long)((now_us() - t0) * rate / 1e6);
+        while (due_count < due) {
+            chat_conn_t *c = bots[rand() % nsessions];
+            if (c != NULL && chat_conn_open(c) &&
+                chat_private(c, chat_conn_id(c), "hi", on_reply, (void *)(intptr_t)now_us()) == 0) {
+                if (chat_conn_pending(c) > max_pending) max_pending = chat_conn_pending(c);
+                sent++;
+            }
+            due_count++;
+        }
+        chat_loop_run(loop, 1);
+    }
+    // 再等最后一批回复
+    long long drain = now_us() + 2000000LL;
+    while (replies + timeouts + failed < sent && now_us() < drain) {
+        chat_loop_run(loop, 10);
+    }
+
+    // 3. 报告
+    printf("sent %ld requests, %ld replies, %ld timeouts, %ld failed, max in flight per session %zu\n",
+           sent, replies, timeouts, failed, max_pending);
+    printf("throughput %.0f replies/s, sessions still open %d, rss %ld KB\n",
+           replies / (double)seconds, nopen, rss_kb());
+    if (nlat > 0) {
+        qsort(lat, nlat, sizeof(long long), cmp_ll);
+        printf("reply latency (us): p50=%lld p99=%lld max=%lld\n",
+               lat[nlat / 2], lat[(long)(nlat * 0.99)], lat[nlat - 1]);
+    }
+
+    for (int i = 0; i < nsessions; i++) {
+        if (bots[i] != NULL) chat_close(bots[i]);
+    }
+    chat_loop_run(loop, 0);
+    chat_loop_free(loop);
+    free(bots);
+    free(opened);
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,842 @@
+/* --- chat_client.c (客户端库) --- */
+// 一个 epoll 事件循环驱动所有连接：
+//   - 发送先追加到连接的发送缓冲区并登记为“脏”，每轮循环开头和结尾统一写出，
+//     连续发的很多帧一次 send 就出去了；写不完才关注 EPOLLOUT
+//   - TCP 按 sizeof(msg_t) 切帧，UDP 一个数据报一帧；请求了压缩的 TCP 连接还会收到变长的 'Z' 帧，
+//     压缩数据收到多少就解多少，解出来的帧和普通帧一样处理
+//   - 带编号的请求同时挂在两条链上：连接上（按编号匹配回复、断线时统一失败）
+//     和循环上（按发出顺序，也就是超时顺序，检查超时只看链头）
+//   - 回调里可以随便发送或关闭连接：关闭的连接先挂到 dead 链，本轮结束再释放
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "chat_client.h"
+#include "chat_zlib.h"
+
+#define IN_BUF_SIZE   2048
+#define OUT_BUF_INIT  1024
+#define READ_BUDGET   4   // 每次可读事件最多 recv 几次，别让一个连接饿死其它连接
+#define MAX_EVENTS    256
+
+// 连接状态
+#define ST_CONNECTING 0 // 等非阻塞 connect 完成
+#define ST_OPEN       1
+#define ST_CLOSING    2 // 用户调用了 chat_close，写完发送队列就关
+#define ST_DEAD       3 // 已关闭，等本轮结束释放
+
+// epoll 里挂的东西，data.ptr 指向它，kind 区分是哪一种
+#define W_CONN  1
+#define W_MCAST 2
+#define W_LINES 3
+
+typedef struct
+{
+    int kind;
+    void *owner;
+} watch_t;
+
+typedef struct req_t
+{
+    struct req_t *prev, *next; // 循环上的链（按发出顺序）
+    struct req_t *cnext;       // 连接上的链
+    chat_conn_t *conn;
+    unsigned int tag;
+    long long deadline;
+    chat_reply_cb cb;
+    void *arg;
+} req_t;
+
+struct chat_conn
+{
+    watch_t w;        // 必须是第一个成员
+    watch_t mw;       // 组播 socket
+    chat_loop_t *loop;
+    chat_conn_t *prev, *next;  // 循环上的所有连接
+    chat_conn_t *dirty_next;   // 发送缓冲区有新数据
+    chat_conn_t *dead_next;
+    int dirty;
+    int proto;
+    int fd;
+    int mfd;          // 组播 socket，-1 表示没有加入
+    int state;
+    int events;       // 当前在 epoll 里关注的事件
+    char id[32];
+    chat_handler_t h;
+    void *ud;
+    char in[IN_BUF_SIZE];
+    size_t in_len;
+    char *out;
+    size_t out_off, out_len, out_cap;
+    req_t *req_head, *req_tail;
+    size_t npending;
+    unsigned int next_tag;
+    zd_t *zd;         // 登录时请求了压缩才有
+    size_t z_left;    // 正在收的 'Z' 帧还剩多少字节压缩数据
+};
+
+typedef struct line_watch_t
+{
+    watch_t w;
+    struct line_watch_t *next;
+    int fd;
+    chat_line_cb cb;
+    void *arg;
+    char buf[1024];
+    size_t len;
+} line_watch_t;
+
+struct chat_loop
+{
+    int epfd;
+    int timeout_ms;
+    chat_conn_t *conns;
+    chat_conn_t *dirty_head;
+    chat_conn_t *dead_head;
+    req_t *req_head, *req_tail; // 按发出顺序
+    line_watch_t *lines;
+    int zlib;                   // 新连接登录时请求压缩
+    unsigned long long rx_wire, rx_frames; // TCP 收到的字节数，解压后的帧字节数
+};
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+chat_loop_t *chat_loop_new(void)
+{
+    chat_loop_t *loop = calloc(1, sizeof(chat_loop_t));
+    if (loop == NULL) {
+        perror("malloc loop error");
+        return NULL;
+    }
+    loop->epfd = epoll_create1(0);
+    if (loop->epfd < 0) {
+        perror("epoll_create error");
+        free(loop);
+        return NULL;
+    }
+    loop->timeout_ms = 10000;
+    return loop;
+}
+
+void chat_loop_set_timeout(chat_loop_t *loop, int ms)
+{
+    loop->timeout_ms = ms;
+}
+
+void chat_loop_set_zlib(chat_loop_t *loop, int on)
+{
+    loop->zlib = on;
+}
+
+void chat_loop_rx_stats(const chat_loop_t *loop, unsigned long long *wire, unsigned long long *frames)
+{
+    *wire = loop->rx_wire;
+    *frames = loop->rx_frames;
+}
+
+// 把一个请求从两条链上摘下来
+static void req_unlink_loop(chat_loop_t *loop, req_t *r)
+{
+    if (r->prev != NULL) r->prev->next = r->next; else loop->req_head = r->next;
+    if (r->next != NULL) r->next->prev = r->prev; else loop->req_tail = r->prev;
+}
+
+static void req_unlink_conn(chat_conn_t *c, req_t *r)
+{
+    req_t **pp = &c->req_head, *prev = NULL;
+    while (*pp != r) {
+        prev = *pp;
+        pp = &(*pp)->cnext;
+    }
+    *pp = r->cnext;
+    if (c->req_tail == r) {
+        c->req_tail = prev;
+    }
+    c->npending--;
+}
+
+static void set_events(chat_conn_t *c, int events)
+{
+    if (c->events == events || c->fd < 0) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &c->w;
+    if (epoll_ctl(c->loop->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("epoll_ctl error");
+    }
+    c->events = events;
+}
+
+// 关闭 socket，让没回复的请求失败，挂到 dead 链上。notify = 是否回调 on_close
+static void conn_kill(chat_conn_t *c, int err, int notify)
+{
+    if (c->state == ST_DEAD) {
+        return;
+    }
+    chat_loop_t *loop = c->loop;
+    c->state = ST_DEAD;
+    close(c->fd); // close 会把它从 epoll 里摘掉
+    c->fd = -1;
+    if (c->mfd >= 0) {
+        close(c->mfd);
+        c->mfd = -1;
+    }
+    c->dead_next = loop->dead_head;
+    loop->dead_head = c;
+
+    while (c->req_head != NULL) {
+        req_t *r = c->req_head;
+        c->req_head = r->cnext;
+        req_unlink_loop(loop, r);
+        if (r->cb != NULL) {
+            r->cb(c, CHAT_CLOSED, NULL, r->arg);
+        }
+        free(r);
+    }
+    c->req_tail = NULL;
+    c->npending = 0;
+    if (notify && c->h.on_close != NULL) {
+        c->h.on_close(c, err, c->ud);
+    }
+}
+
+// 把发送缓冲区尽量写出去
+static void conn_flush(chat_conn_t *c)
+{
+    if (c->state == ST_CONNECTING || c->state == ST_DEAD) {
+        return;
+    }
+    while (c->out_off < c->out_len) {
+        // UDP 一次只能发一帧（一个数据报）
+        size_t n = c->proto == CHAT_UDP ? sizeof(msg_t) : c->out_len - c->out_off;
+        ssize_t sent = send(c->fd, c->out + c->out_off, n, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            conn_kill(c, errno, c->state == ST_OPEN);
+            return;
+        }
+        c->out_off += sent;
+    }
+    if (c->out_off == c->out_len) {
+        c->out_off = c->out_len = 0;
+        if (c->state == ST_CLOSING) {
+            conn_kill(c, 0, 0);
+            return;
+        }
+    }
+    set_events(c, c->out_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+// 把一帧追加到发送缓冲区，登记为脏，本轮结束前写出
+static int conn_queue(chat_conn_t *c, const msg_t *msg)
+{
+    if (c->state == ST_DEAD || c->state == ST_CLOSING) {
+        return -1;
+    }
+    if (c->out_len + sizeof(msg_t) > c->out_cap) {
+        // 前面已经发掉的部分先挪走，还不够再扩容
+        if (c->out_off > 0) {
+            memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+            c->out_len -= c->out_off;
+            c->out_off = 0;
+        }
+        if (c->out_len + sizeof(msg_t) > c->out_cap) {
+            size_t cap = c->out_cap ? c->out_cap * 2 : OUT_BUF_INIT;
+            char *out = realloc(c->out, cap);
+            if (out == NULL) {
+                perror("malloc out error");
+                return -1;
+            }
+            c->out = out;
+            c->out_cap = cap;
+        }
+    }
+    memcpy(c->out + c->out_len, msg, sizeof(msg_t));
+    c->out_len += sizeof(msg_t);
+    if (!c->dirty) {
+        c->dirty = 1;
+        c->dirty_next = c->loop->dirty_head;
+        c->loop->dirty_head = c;
+    }
+    return 0;
+}
+
+static void loop_flush_dirty(chat_loop_t *loop)
+{
+    while (loop->dirty_head != NULL) {
+        chat_conn_t *c = loop->dirty_head;
+        loop->dirty_head = c->dirty_next;
+        c->dirty = 0;
+        conn_flush(c);
+    }
+}
+
+chat_conn_t *chat_connect(chat_loop_t *loop, int proto, const char *ip, int port,
+                          const char *id, const chat_handler_t *h, void *ud)
+{
+    struct sockaddr_in saddr;
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &saddr.sin_addr) != 1) {
+        printf("bad server address %s\n", ip);
+        return NULL;
+    }
+
+    chat_conn_t *c = calloc(1, sizeof(chat_conn_t));
+    if (c == NULL) {
+        perror("malloc conn error");
+        return NULL;
+    }
+    c->fd = socket(AF_INET, (proto == CHAT_UDP ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        perror("socket error");
+        free(c);
+        return NULL;
+    }
+    if (proto == CHAT_TCP) {
+        int opt = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    // TCP 一般是 EINPROGRESS；UDP 的 connect 只是记下对端地址，立即成功
+    if (connect(c->fd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0 && errno != EINPROGRESS) {
+        perror("connect error");
+        close(c->fd);
+        free(c);
+        return NULL;
+    }
+
+    c->w.kind = W_CONN;
+    c->w.owner = c;
+    c->mw.kind = W_MCAST;
+    c->mw.owner = c;
+    c->loop = loop;
+    c->proto = proto;
+    c->mfd = -1;
+    c->state = ST_CONNECTING;
+    c->next_tag = 1;
+    snprintf(c->id, sizeof(c->id), "%s", id);
+    if (h != NULL) {
+        c->h = *h;
+    }
+    c->ud = ud;
+
+    // 连上之前 epoll 等可写；可写了再回调 on_open（调用者这时已经拿到了 c）
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = &c->w;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl error");
+        close(c->fd);
+        free(c);
+        return NULL;
+    }
+    c->events = ev.events;
+    c->next = loop->conns;
+    if (loop->conns != NULL) loop->conns->prev = c;
+    loop->conns = c;
+
+    // 登录包先排队，连上后第一个发出去
+    msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 'L';
+    strcpy(msg.id, c->id);
+    if (loop->zlib && proto == CHAT_TCP && (c->zd = zd_new(sizeof(msg_t))) != NULL) {
+        snprintf(msg.text, sizeof(msg.text), "zlib %08x", zdict_id()); // 老服务器不看 text
+    }
+    conn_queue(c, &msg);
+    return c;
+}
+
+void chat_close(chat_conn_t *c)
+{
+    if (c->state == ST_DEAD || c->state == ST_CLOSING) {
+        return;
+    }
+    if (c->state == ST_CONNECTING) {
+        conn_kill(c, 0, 0);
+        return;
+    }
+    msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 'Q';
+    strcpy(msg.id, c->id);
+    conn_queue(c, &msg);
+    c->state = ST_CLOSING;
+    // 没回复的请求现在就结束，之后这个连接上不会再有回调
+    while (c->req_head != NULL) {
+        req_t *r = c->req_head;
+        c->req_head = r->cnext;
+        req_unlink_loop(c->loop, r);
+        if (r->cb != NULL) {
+            r->cb(c, CHAT_CLOSED, NULL, r->arg);
+        }
+        free(r);
+    }
+    c->req_tail = NULL;
+    c->npending = 0;
+}
+
+int chat_send_frame(chat_conn_t *c, const msg_t *msg)
+{
+    msg_t m = *msg;
+    if (m.id[0] == '\0') {
+        strcpy(m.id, c->id); // UDP 服务器按 id 字段认人
+    }
+    return conn_queue(c, &m);
+}
+
+int chat_send_chat(chat_conn_t *c, const char *text)
+{
+    msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 'C';
+    strcpy(msg.id, c->id);
+    snprintf(msg.text, sizeof(msg.text), "%s", text);
+    return conn_queue(c, &msg);
+}
+
+// 发一个带编号的请求：id 字段填 "#编号"，挂到两条链的末尾
+static int send_request(chat_conn_t *c, msg_t *msg, chat_reply_cb cb, void *arg)
+{
+    if (c->state == ST_DEAD || c->state == ST_CLOSING) {
+        return -1;
+    }
+    req_t *r = calloc(1, sizeof(req_t));
+    if (r == NULL) {
+        perror("malloc req error");
+        return -1;
+    }
+    r->conn = c;
+    r->tag = c->next_tag++;
+    if (c->next_tag == 0) {
+        c->next_tag = 1;
+    }
+    r->deadline = now_ms() + c->loop->timeout_ms;
+    r->cb = cb;
+    r->arg = arg;
+    snprintf(msg->id, sizeof(msg->id), "#%u", r->tag);
+    if (conn_queue(c, msg) < 0) {
+        free(r);
+        return -1;
+    }
+
+    chat_loop_t *loop = c->loop;
+    r->prev = loop->req_tail;
+    if (loop->req_tail != NULL) loop->req_tail->next = r; else loop->req_head = r;
+    loop->req_tail = r;
+    if (c->req_tail != NULL) c->req_tail->cnext = r; else c->req_head = r;
+    c->req_tail = r;
+    c->npending++;
+    return 0;
+}
+
+int chat_who(chat_conn_t *c, chat_reply_cb cb, void *arg)
+{
+    msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 'W';
+    return send_request(c, &msg, cb, arg);
+}
+
+int chat_private(chat_conn_t *c, const char *to, const char *text, chat_reply_cb cb, void *arg)
+{
+    msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 'P';
+    snprintf(msg.text, sizeof(msg.text), "%s %s", to, text);
+    return send_request(c, &msg, cb, arg);
+}
+
+// 加入服务器告诉我们的组播组（text 是 "组地址 端口"），成功后回 'M'
+static void conn_mcast_join(chat_conn_t *c, const char *text)
+{
+    char group[64];
+    int port;
+    if (c->mfd >= 0 || sscanf(text, "%63s %d", group, &port) != 2) {
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket error");
+        return;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)); // 同一台机器上可能有好几个客户端
+    struct sockaddr_in maddr;
+    memset(&maddr, 0, sizeof(maddr));
+    maddr.sin_family = AF_INET;
+    maddr.sin_addr.s_addr = inet_addr(group);
+    maddr.sin_port = htons(port);
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(group);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (getenv("CHAT_MCAST_IF") != NULL) {
+        mreq.imr_interface.s_addr = inet_addr(getenv("CHAT_MCAST_IF"));
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &c->mw;
+    if (bind(fd, (struct sockaddr *)&maddr, sizeof(maddr)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 ||
+        epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("join mcast error"); // 加不进去就继续收单播，不回 'M'
+        close(fd);
+        return;
+    }
+    c->mfd = fd;
+
+    msg_t ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.type = 'M';
+    strcpy(ack.id, c->id);
+    conn_queue(c, &ack);
+}
+
+// 处理收到的一帧
+static void conn_on_frame(chat_conn_t *c, msg_t *msg)
+{
+    if (c->state != ST_OPEN) {
+        return; // 正在关闭：不再回调
+    }
+    msg->id[sizeof(msg->id) - 1] = '\0';
+    msg->text[sizeof(msg->text) - 1] = '\0';
+
+    if (msg->type == 'R' && msg->id[0] == '#') {
+        // 按编号找请求；找不到说明已经超时了，丢掉
+        unsigned int tag = strtoul(msg->id + 1, NULL, 10);
+        for (req_t *r = c->req_head; r != NULL; r = r->cnext) {
+            if (r->tag == tag) {
+                req_unlink_conn(c, r);
+                req_unlink_loop(c->loop, r);
+                if (r->cb != NULL) {
+                    r->cb(c, CHAT_OK, msg->text, r->arg);
+                }
+                free(r);
+                break;
+            }
+        }
+        return;
+    }
+    if (msg->type == 'M' && c->proto == CHAT_UDP) {
+        conn_mcast_join(c, msg->text);
+        return;
+    }
+    if (c->h.on_msg != NULL) {
+        c->h.on_msg(c, msg, c->ud);
+    }
+}
+
+// 'Z' 帧里解出来的一帧
+static void conn_on_zframe(const void *frame, void *arg)
+{
+    chat_conn_t *c = (chat_conn_t *)arg;
+    msg_t msg;
+    memcpy(&msg, frame, sizeof(msg));
+    c->loop->rx_frames += sizeof(msg_t);
+    conn_on_frame(c, &msg);
+}
+
+static void conn_on_readable(chat_conn_t *c)
+{
+    msg_t msg;
+    for (int i = 0; i < READ_BUDGET && c->state != ST_DEAD; i++) {
+        ssize_t n;
+        if (c->proto == CHAT_UDP) {
+            memset(&msg, 0, sizeof(msg));
+            n = recv(c->fd, &msg, sizeof(msg), 0);
+            if (n > 0) {
+                conn_on_frame(c, &msg);
+                continue;
+            }
+        } else {
+            n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+            if (n > 0) {
+                // 切帧：剩下不够一帧的部分留到下次
+                c->in_len += n;
+                c->loop->rx_wire += n;
+                size_t off = 0;
+                while (off < c->in_len && c->state != ST_DEAD) {
+                    size_t avail = c->in_len - off;
+                    if (c->z_left > 0) {
+                        // 'Z' 帧的压缩数据不用攒齐，收到多少解多少
+                        size_t take = avail < c->z_left ? avail : c->z_left;
+                        if (zd_feed(c->zd, c->in + off, take, conn_on_zframe, c) < 0) {
+                            conn_kill(c, EPROTO, c->state == ST_OPEN);
+                            return;
+                        }
+                        off += take;
+                        c->z_left -= take;
+                        continue;
+                    }
+                    if (c->zd != NULL && c->in[off] == 'Z') {
+                        uint32_t be;
+                        if (avail < ZFRAME_HDR) break;
+                        memcpy(&be, c->in + off + 1, sizeof(be));
+                        c->z_left = ntohl(be);
+                        if (c->z_left == 0 || c->z_left > ZFRAME_MAX) {
+                            conn_kill(c, EPROTO, c->state == ST_OPEN);
+                            return;
+                        }
+                        off += ZFRAME_HDR;
+                        continue;
+                    }
+                    if (avail < sizeof(msg_t)) break;
+                    memcpy(&msg, c->in + off, sizeof(msg));
+                    off += sizeof(msg_t);
+                    c->loop->rx_frames += sizeof(msg_t);
+                    conn_on_frame(c, &msg);
+                }
+                memmove(c->in, c->in + off, c->in_len - off);
+                c->in_len -= off;
+                continue;
+            }
+            if (n == 0) {
+                conn_kill(c, 0, c->state == ST_OPEN);
+                return;
+            }
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        if (errno != EINTR) {
+            conn_kill(c, errno, c->state == ST_OPEN);
+            return;
+        }
+    }
+}
+
+// 组播：服务器群发的消息也会发回给自己，跳过自己发出去的
+static void conn_on_mcast(chat_conn_t *c)
+{
+    msg_t msg;
+    for (int i = 0; i < READ_BUDGET && c->state == ST_OPEN; i++) {
+        memset(&msg, 0, sizeof(msg));
+        if (recv(c->mfd, &msg, sizeof(msg), 0) <= 0) {
+            return;
+        }
+        msg.id[sizeof(msg.id) - 1] = '\0';
+        if (strcmp(msg.id, c->id) != 0) {
+            conn_on_frame(c, &msg);
+        }
+    }
+}
+
+static void conn_on_event(chat_conn_t *c, int events)
+{
+    if (c->state == ST_CONNECTING && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            conn_kill(c, err, 1);
+            return;
+        }
+        c->state = ST_OPEN;
+        if (c->h.on_open != NULL) {
+            c->h.on_open(c, c->ud);
+        }
+        conn_flush(c);
+    }
+    if (c->state != ST_DEAD && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        conn_on_readable(c);
+    }
+    if (c->state != ST_DEAD && (events & EPOLLOUT)) {
+        conn_flush(c);
+    }
+}
+
+int chat_loop_watch_lines(chat_loop_t *loop, int fd, chat_line_cb cb, void *arg)
+{
+    line_watch_t *lw = calloc(1, sizeof(line_watch_t));
+    if (lw == NULL) {
+        perror("malloc watch error");
+        return -1;
+    }
+    lw->w.kind = W_LINES;
+    lw->w.owner = lw;
+    lw->fd = fd;
+    lw->cb = cb;
+    lw->arg = arg;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &lw->w;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl error");
+        free(lw);
+        return -1;
+    }
+    lw->next = loop->lines;
+    loop->lines = lw;
+    return 0;
+}
+
+// 读到的数据按行交给回调；行太长时按缓冲区大小截断
+static void lines_on_readable(chat_loop_t *loop, line_watch_t *lw)
+{
+    ssize_t n = read(lw->fd, lw->buf + lw->len, sizeof(lw->buf) - 1 - lw->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, lw->fd, NULL);
+        if (lw->len > 0) {
+            lw->buf[lw->len] = '\0';
+            lw->len = 0;
+            lw->cb(lw->buf, lw->arg);
+        }
+        lw->cb(NULL, lw->arg);
+        return;
+    }
+    lw->len += n;
+    size_t start = 0;
+    for (size_t i = 0; i < lw->len; i++) {
+        if (lw->buf[i] == '\n') {
+            lw->buf[i] = '\0';
+            lw->cb(lw->buf + start, lw->arg);
+            start = i + 1;
+        }
+    }
+    if (start == 0 && lw->len == sizeof(lw->buf) - 1) {
+        lw->buf[lw->len] = '\0';
+        lw->cb(lw->buf, lw->arg);
+        start = lw->len;
+    }
+    memmove(lw->buf, lw->buf + start, lw->len - start);
+    lw->len -= start;
+}
+
+// 超时的请求：循环上的链是按发出顺序排的，只看链头
+static void loop_expire(chat_loop_t *loop, long long now)
+{
+    while (loop->req_head != NULL && loop->req_head->deadline <= now) {
+        req_t *r = loop->req_head;
+        req_unlink_loop(loop, r);
+        req_unlink_conn(r->conn, r);
+        if (r->cb != NULL) {
+            r->cb(r->conn, CHAT_TIMEOUT, NULL, r->arg);
+        }
+        free(r);
+    }
+}
+
+static void loop_reap(chat_loop_t *loop)
+{
+    while (loop->dead_head != NULL) {
+        chat_conn_t *c = loop->dead_head;
+        loop->dead_head = c->dead_next;
+        if (c->prev != NULL) c->prev->next = c->next; else loop->conns = c->next;
+        if (c->next != NULL) c->next->prev = c->prev;
+        if (c->dirty) {
+            // 还挂在脏链上（回调里发完又被关掉）：摘下来
+            chat_conn_t **pp = &loop->dirty_head;
+            while (*pp != c) pp = &(*pp)->dirty_next;
+            *pp = c->dirty_next;
+        }
+        free(c->out);
+        zd_free(c->zd);
+        free(c);
+    }
+}
+
+int chat_loop_run(chat_loop_t *loop, int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    // 1. 先把上一轮回调里排队的数据写出去
+    loop_flush_dirty(loop);
+    loop_reap(loop);
+
+    // 2. 最多等到最早的请求超时
+    if (loop->req_head != NULL) {
+        long long left = loop->req_head->deadline - now_ms();
+        if (left < 0) left = 0;
+        if (timeout_ms < 0 || left < timeout_ms) timeout_ms = left;
+    }
+    int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno != EINTR) {
+            perror("epoll_wait error");
+            return -1;
+        }
+        n = 0;
+    }
+
+    // 3. 处理事件
+    for (int i = 0; i < n; i++) {
+        watch_t *w = (watch_t *)events[i].data.ptr;
+        if (w->kind == W_CONN) {
+            conn_on_event((chat_conn_t *)w->owner, events[i].events);
+        } else if (w->kind == W_MCAST) {
+            conn_on_mcast((chat_conn_t *)w->owner);
+        } else {
+            lines_on_readable(loop, (line_watch_t *)w->owner);
+        }
+    }
+
+    // 4. 超时，然后把这一轮产生的数据写出去
+    loop_expire(loop, now_ms());
+    loop_flush_dirty(loop);
+    loop_reap(loop);
+    return n;
+}
+
+void chat_loop_free(chat_loop_t *loop)
+{
+    for (chat_conn_t *c = loop->conns; c != NULL; c = c->next) {
+        if (c->state != ST_DEAD) {
+            for (req_t *r = c->req_head; r != NULL; r = r->cnext) {
+                r->cb = NULL; // 不再回调
+            }
+            conn_kill(c, 0, 0);
+        }
+    }
+    loop_reap(loop);
+    while (loop->lines != NULL) {
+        line_watch_t *lw = loop->lines;
+        loop->lines = lw->next;
+        free(lw);
+    }
+    close(loop->epfd);
+    free(loop);
+}
+
+const char *chat_conn_id(const chat_conn_t *c)
+{
+    return c->id;
+}
+
+int chat_conn_open(const chat_conn_t *c)
+{
+    return c->state == ST_OPEN;
+}
+
+size_t chat_conn_pending(const chat_conn_t *c)
+{
+    return c->npending;
+}
+
+size_t chat_conn_queued(const chat_conn_t *c)
+{
+    return c->out_len - c->out_off;
+}
@@ -0,0 +1,75 @@
+/* --- chat_client.h (客户端库) --- */
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+// 单线程事件循环的客户端库，命令行客户端、机器人、网关、压测工具都用它：
+//   1. chat_loop_new 建一个事件循环（epoll），一个循环里可以挂上万个连接
+//   2. chat_connect 发起非阻塞连接并排队登录包，连上后回调 on_open
+//   3. 发送都先放进连接的发送队列，每轮循环统一写出，写不完等可写再写
+//   4. \who 和私聊可以带编号发出（chat_who / chat_private），不用等回复就能接着发；
+//      服务器用 'R' 帧带回同一个编号，库按编号找到对应请求回调结果
+//   5. 其它推送（群聊、私聊、上下线、文件通知）都交给 on_msg
+//   6. chat_loop_set_zlib 打开后，新的 TCP 连接登录时请求压缩，服务器发来的 'Z' 帧由库解压，
+//      回调看到的还是一个个 msg_t（见 chat_zlib.h）
+// 所有函数只能在运行循环的那个线程里调用。
+
+#include <stddef.h>
+
+typedef struct
+{
+    char type;      // 消息类型 L C Q W P F D M R S（'Z' 由库解压，不会交给回调）
+    char id[32];    // 用户id（带编号的请求/回复里是 "#编号"）
+    char text[128]; // 消息内容
+} msg_t;
+
+#define CHAT_TCP 1
+#define CHAT_UDP 2
+
+// 请求结果
+#define CHAT_OK       0  // 服务器回复了（text 是回复内容，私聊成功时是 "ok"）
+#define CHAT_TIMEOUT -1  // 超时没有回复（UDP 可能丢包）
+#define CHAT_CLOSED  -2  // 回复到达之前连接断了
+
+typedef struct chat_loop chat_loop_t;
+typedef struct chat_conn chat_conn_t;
+
+typedef struct
+{
+    void (*on_open)(chat_conn_t *c, void *ud);                   // 连接建立（登录包已排队）
+    void (*on_msg)(chat_conn_t *c, const msg_t *msg, void *ud);  // 服务器推送的消息
+    void (*on_close)(chat_conn_t *c, int err, void *ud);         // 连接断开，err 为 0 表示对方正常关闭
+} chat_handler_t;
+
+// 请求的回调：status 见上面的 CHAT_*，text 只在 CHAT_OK 时有效
+typedef void (*chat_reply_cb)(chat_conn_t *c, int status, const char *text, void *arg);
+
+// 按行读一个 fd（比如 stdin）的回调；line 为 NULL 表示 EOF
+typedef void (*chat_line_cb)(const char *line, void *arg);
+
+// 事件循环
+chat_loop_t *chat_loop_new(void);
+void chat_loop_free(chat_loop_t *loop);          // 关闭并释放所有连接（不调用回调）
+int chat_loop_run(chat_loop_t *loop, int timeout_ms); // 跑一轮，最多等 timeout_ms（-1 一直等）
+int chat_loop_watch_lines(chat_loop_t *loop, int fd, chat_line_cb cb, void *arg);
+void chat_loop_set_timeout(chat_loop_t *loop, int ms); // 请求超时，默认 10000ms
+void chat_loop_set_zlib(chat_loop_t *loop, int on);    // 之后新建的 TCP 连接请求压缩，默认关
+// 统计：所有 TCP 连接收到的字节数（压缩后），以及解出来的帧一共多少字节
+void chat_loop_rx_stats(const chat_loop_t *loop, unsigned long long *wire, unsigned long long *frames);
+
+// 连接。失败返回 NULL；连不上的情况（拒绝、超时）稍后通过 on_close 报告
+chat_conn_t *chat_connect(chat_loop_t *loop, int proto, const char *ip, int port,
+                          const char *id, const chat_handler_t *h, void *ud);
+void chat_close(chat_conn_t *c); // 发 'Q'，把发送队列写完后关闭，不再回调
+
+// 发送：返回 0 成功排队，-1 表示连接已经断了
+int chat_send_chat(chat_conn_t *c, const char *text);
+int chat_send_frame(chat_conn_t *c, const msg_t *msg); // 原样发一帧（比如文件请求 'F'）
+int chat_who(chat_conn_t *c, chat_reply_cb cb, void *arg);
+int chat_private(chat_conn_t *c, const char *to, const char *text, chat_reply_cb cb, void *arg);
+
+const char *chat_conn_id(const chat_conn_t *c);
+int chat_conn_open(const chat_conn_t *c);        // 1 = 已连上
+size_t chat_conn_pending(const chat_conn_t *c);  // 还在等回复的请求数
+size_t chat_conn_queued(const chat_conn_t *c);   // 发送队列里还没写出的字节数
+
+#endif
@@ -0,0 +1,1331 @@
+/* --- chat_history.c (聊天记录和全文检索) --- */
+// 目录里的文件：
+//   messages.log            每条消息一条记录：rec_hdr_t + from + to + text
+//   messages.off            第 i 条消息在 messages.log 里的偏移（uint64），消息编号就是下标
+//   seg-<first>-<end>.idx   编号 [first, end) 的索引段：文件头、倒排表、词的字符串池、词典（按词排序）
+// 线程：
+//   建索引线程：取队列 -> 写 log/off -> 加进内存段 -> 内存段满了写成磁盘段
+//   合并线程：  同一档大小（按 4 倍分档）的相邻 4 个段合成 1 个，写好后替换，旧文件删掉
+// 查询在调用者线程里做：先查内存段，再从新到旧查磁盘段（引用计数保证查询期间段不会被释放），
+// 凑够条数就停。
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "chat_history.h"
+
+#define LOG_NAME      "messages.log"
+#define OFF_NAME      "messages.off"
+#define SEG_MAGIC     0x58444948u // "HIDX"
+#define SEG_VERSION   1
+#define BLOCK         128         // 倒排表每块的编号个数
+#define MERGE_FACTOR  4
+#define MAX_TERMS     32          // 一次查询最多几个词
+#define TERM_MAX      96
+
+// 特殊词：以 \x01 开头，正文分词不会产生
+#define T_FROM "\x01" "f:"  // 发送者
+#define T_USER "\x01" "u:"  // 私聊的收发双方
+#define T_PRIV "\x01" "p"   // 私聊标记
+
+typedef struct __attribute__((packed))
+{
+    uint32_t ts;
+    uint8_t kind;
+    uint8_t from_len;
+    uint8_t to_len;
+    uint8_t text_len;
+} rec_hdr_t;
+
+// 队列里的一条消息
+typedef struct hist_item_t
+{
+    struct hist_item_t *next;
+    hist_msg_t msg;
+} hist_item_t;
+
+// --- 内存段：词 -> 未压缩的编号数组（开放寻址） ---
+typedef struct
+{
+    char *term;      // NULL 表示空槽
+    uint32_t len;
+    uint32_t hash;
+    uint32_t *docs;
+    uint32_t n, cap;
+} mterm_t;
+
+typedef struct
+{
+    mterm_t *slots;
+    size_t cap, count;
+    uint32_t first, end; // 收录的编号 [first, end)
+} memseg_t;
+
+// --- 磁盘段 ---
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t first, end;
+    uint32_t nterms;
+    uint32_t reserved;
+    uint64_t pool_off;
+    uint64_t dict_off;
+    uint64_t size;
+} seg_hdr_t;
+
+typedef struct
+{
+    uint64_t post_off;  // 倒排表在文件里的偏移
+    uint32_t term_off;  // 词在字符串池里的偏移
+    uint32_t term_len;
+    uint32_t count;     // 编号个数
+    uint32_t reserved;
+} seg_term_t;
+
+typedef struct
+{
+    uint32_t last;      // 这一块最大的编号
+    uint32_t off;       // 这一块相对数据区开头的偏移
+} blk_dir_t;
+
+typedef struct seg_t
+{
+    int refs;           // 受 seg_mutex 保护
+    uint32_t first, end;
+    uint8_t *map;
+    size_t size;
+    const seg_hdr_t *hdr;
+    const seg_term_t *dict;
+    const char *pool;
+    char path[512];
+} seg_t;
+
+// 一个词的倒排表，内存段和磁盘段统一成“按块访问”
+typedef struct
+{
+    uint32_t count;
+    uint32_t nblocks;
+    const uint32_t *arr;      // 内存段：直接是数组
+    const blk_dir_t *dir;     // 磁盘段：块目录（只有一块时为 NULL）
+    const uint8_t *data;      // 磁盘段：压缩数据
+    int blk;                  // buf 里现在是第几块，-1 表示没有
+    uint32_t blen;
+    const uint32_t *cur;      // 当前块的内容
+    uint32_t buf[BLOCK];
+} plist_t;
+
+int hist_on;
+static char hist_dir[256];
+static int log_fd = -1, off_fd = -1;
+static uint64_t log_end;
+static uint32_t ndocs;         // 已写进 log 的消息数（只有建索引线程写）
+static uint32_t flush_docs = 65536;
+
+static pthread_mutex_t q_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t q_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static hist_item_t *q_head, *q_tail;
+static int q_busy;             // 建索引线程正在处理一批
+static int flush_req;
+
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+static memseg_t *mem;          // 正在写的内存段
+static memseg_t *frozen;       // 正在写成磁盘段的内存段，写完之前查询也要查它
+
+static pthread_mutex_t seg_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merge_cond = PTHREAD_COND_INITIALIZER;
+static seg_t **segs;           // 按编号从旧到新
+static int nsegs, segs_cap;
+static int merge_busy;
+
+// ---------------- 编码 ----------------
+
+static size_t put_varint(uint8_t *p, uint32_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, uint32_t *v)
+{
+    uint32_t x = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        x |= (uint32_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *v = x | (uint32_t)*p++ << shift;
+    return p;
+}
+
+static int term_cmp(const char *a, uint32_t alen, const char *b, uint32_t blen)
+{
+    int r = memcmp(a, b, alen < blen ? alen : blen);
+    return r != 0 ? r : (alen > blen) - (alen < blen);
+}
+
+static uint32_t term_hash(const char *t, uint32_t len)
+{
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)t[i]) * 16777619u;
+    }
+    return h;
+}
+
+// ---------------- 分词 ----------------
+
+typedef void (*term_cb)(const char *t, uint32_t len, void *arg);
+
+static size_t utf8_len(unsigned char c)
+{
+    if (c >= 0xf0) return 4;
+    if (c >= 0xe0) return 3;
+    if (c >= 0xc0) return 2;
+    return 1; // 续字节单独出现：当成一个字
+}
+
+// ASCII 字母数字连成一个词（转小写）；非 ASCII 的连续字符出单字和二元组。
+// query = 1 时中文只出二元组（只有一个字时出单字），候选更少
+static void tokenize(const char *s, int query, term_cb emit, void *arg)
+{
+    size_t n = strlen(s), i = 0;
+    char word[TERM_MAX];
+    size_t starts[130];
+    while (i < n) {
+        unsigned char ch = s[i];
+        if (ch < 0x80) {
+            size_t len = 0;
+            while (i < n && (unsigned char)s[i] < 0x80 &&
+                   ((s[i] >= 'a' && s[i] <= 'z') || (s[i] >= 'A' && s[i] <= 'Z') ||
+                    (s[i] >= '0' && s[i] <= '9'))) {
+                if (len < sizeof(word)) {
+                    word[len++] = s[i] >= 'A' && s[i] <= 'Z' ? s[i] + 32 : s[i];
+                }
+                i++;
+            }
+            if (len > 0) {
+                emit(word, len, arg);
+            } else {
+                i++;
+            }
+            continue;
+        }
+        int nc = 0;
+        size_t j = i;
+        while (j < n && (unsigned char)s[j] >= 0x80 && nc < 128) {
+            starts[nc++] = j;
+            j += utf8_len(s[j]);
+            if (j > n) j = n;
+        }
+        starts[nc] = j;
+        if (!query || nc == 1) {
+            for (int c = 0; c < nc; c++) {
+                emit(s + starts[c], starts[c + 1] - starts[c], arg);
+            }
+        }
+        for (int c = 0; c + 1 < nc; c++) {
+            emit(s + starts[c], starts[c + 2] - starts[c], arg);
+        }
+        i = j;
+    }
+}
+
+// ---------------- 内存段 ----------------
+
+static memseg_t *memseg_new(uint32_t first)
+{
+    memseg_t *ms = calloc(1, sizeof(memseg_t));
+    ms->cap = 4096;
+    ms->slots = calloc(ms->cap, sizeof(mterm_t));
+    ms->first = ms->end = first;
+    return ms;
+}
+
+static void memseg_free(memseg_t *ms)
+{
+    if (ms == NULL) return;
+    for (size_t i = 0; i < ms->cap; i++) {
+        free(ms->slots[i].term);
+        free(ms->slots[i].docs);
+    }
+    free(ms->slots);
+    free(ms);
+}
+
+static mterm_t *memseg_slot(memseg_t *ms, const char *t, uint32_t len, uint32_t h)
+{
+    size_t i = h & (ms->cap - 1);
+    while (ms->slots[i].term != NULL &&
+           (ms->slots[i].hash != h || ms->slots[i].len != len || memcmp(ms->slots[i].term, t, len) != 0)) {
+        i = (i + 1) & (ms->cap - 1);
+    }
+    return &ms->slots[i];
+}
+
+static mterm_t *memseg_find(memseg_t *ms, const char *t, uint32_t len)
+{
+    mterm_t *m = memseg_slot(ms, t, len, term_hash(t, len));
+    return m->term != NULL ? m : NULL;
+}
+
+typedef struct
+{
+    memseg_t *ms;
+    uint32_t doc;
+} add_ctx_t;
+
+static void memseg_add(const char *t, uint32_t len, void *arg)
+{
+    add_ctx_t *ctx = (add_ctx_t *)arg;
+    memseg_t *ms = ctx->ms;
+    if (ms->count * 2 >= ms->cap) {
+        // 扩容并重新插入
+        mterm_t *old = ms->slots;
+        size_t old_cap = ms->cap;
+        ms->cap *= 2;
+        ms->slots = calloc(ms->cap, sizeof(mterm_t));
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].term != NULL) {
+                *memseg_slot(ms, old[i].term, old[i].len, old[i].hash) = old[i];
+            }
+        }
+        free(old);
+    }
+    uint32_t h = term_hash(t, len);
+    mterm_t *m = memseg_slot(ms, t, len, h);
+    if (m->term == NULL) {
+        m->term = malloc(len);
+        memcpy(m->term, t, len);
+        m->len = len;
+        m->hash = h;
+        ms->count++;
+    }
+    if (m->n > 0 && m->docs[m->n - 1] == ctx->doc) {
+        return; // 同一条消息里重复出现
+    }
+    if (m->n == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 4;
+        m->docs = realloc(m->docs, m->cap * sizeof(uint32_t));
+    }
+    m->docs[m->n++] = ctx->doc;
+}
+
+// 一条消息的所有词：正文 + 发送者 + （私聊）标记和双方
+static void index_msg(memseg_t *ms, uint32_t doc, const hist_msg_t *msg)
+{
+    add_ctx_t ctx = { ms, doc };
+    char t[TERM_MAX];
+    tokenize(msg->text, 0, memseg_add, &ctx);
+    memseg_add(t, snprintf(t, sizeof(t), T_FROM "%s", msg->from), &ctx);
+    if (msg->kind == HIST_PRIVATE) {
+        memseg_add(T_PRIV, strlen(T_PRIV), &ctx);
+        memseg_add(t, snprintf(t, sizeof(t), T_USER "%s", msg->from), &ctx);
+        memseg_add(t, snprintf(t, sizeof(t), T_USER "%s", msg->to), &ctx);
+    }
+    ms->end = doc + 1;
+}
+
+// ---------------- 倒排表读取 ----------------
+
+static void plist_from_array(plist_t *pl, const uint32_t *docs, uint32_t n)
+{
+    pl->count = n;
+    pl->nblocks = (n + BLOCK - 1) / BLOCK;
+    pl->arr = docs;
+    pl->dir = NULL;
+    pl->data = NULL;
+    pl->blk = -1;
+}
+
+static void plist_from_seg(plist_t *pl, const seg_t *s, const seg_term_t *e)
+{
+    const uint8_t *p = s->map + e->post_off;
+    pl->count = e->count;
+    pl->nblocks = (e->count + BLOCK - 1) / BLOCK;
+    pl->arr = NULL;
+    pl->dir = pl->nblocks > 1 ? (const blk_dir_t *)p : NULL;
+    pl->data = pl->nblocks > 1 ? p + pl->nblocks * sizeof(blk_dir_t) : p;
+    pl->blk = -1;
+}
+
+// 取第 b 块放到 pl->cur
+static void plist_load(plist_t *pl, uint32_t b)
+{
+    if (pl->blk == (int)b) return;
+    uint32_t start = b * BLOCK;
+    pl->blen = pl->count - start < BLOCK ? pl->count - start : BLOCK;
+    pl->blk = b;
+    if (pl->arr != NULL) {
+        pl->cur = pl->arr + start;
+        return;
+    }
+    const uint8_t *p = pl->data + (pl->dir != NULL && b > 0 ? pl->dir[b].off : 0);
+    uint32_t prev = pl->dir != NULL && b > 0 ? pl->dir[b - 1].last : 0, d;
+    for (uint32_t i = 0; i < pl->blen; i++) {
+        p = get_varint(p, &d);
+        prev += d;
+        pl->buf[i] = prev;
+    }
+    pl->cur = pl->buf;
+}
+
+static uint32_t plist_block_last(plist_t *pl, uint32_t b)
+{
+    if (pl->arr != NULL) {
+        uint32_t end = (b + 1) * BLOCK;
+        return pl->arr[(end < pl->count ? end : pl->count) - 1];
+    }
+    if (pl->dir != NULL) {
+        return pl->dir[b].last;
+    }
+    plist_load(pl, 0);
+    return pl->cur[pl->blen - 1];
+}
+
+// doc 在不在表里：先按块目录二分找块，再在块里二分
+static int plist_contains(plist_t *pl, uint32_t doc)
+{
+    if (pl->count == 0) return 0;
+    uint32_t lo = 0, hi = pl->nblocks;
+    if (pl->blk >= 0 && doc <= plist_block_last(pl, pl->blk) &&
+        (pl->blk == 0 || doc > plist_block_last(pl, pl->blk - 1))) {
+        lo = pl->blk; // 查询是按编号递减的，大多数时候还在同一块
+    } else {
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if (plist_block_last(pl, mid) < doc) lo = mid + 1; else hi = mid;
+        }
+        if (lo == pl->nblocks) return 0;
+    }
+    plist_load(pl, lo);
+    uint32_t l = 0, h = pl->blen;
+    while (l < h) {
+        uint32_t mid = (l + h) / 2;
+        if (pl->cur[mid] < doc) l = mid + 1; else h = mid;
+    }
+    return l < pl->blen && pl->cur[l] == doc;
+}
+
+// ---------------- 磁盘段 ----------------
+
+static const seg_term_t *seg_find(const seg_t *s, const char *t, uint32_t len)
+{
+    uint32_t lo = 0, hi = s->hdr->nterms;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        const seg_term_t *e = &s->dict[mid];
+        int r = term_cmp(s->pool + e->term_off, e->term_len, t, len);
+        if (r == 0) return e;
+        if (r < 0) lo = mid + 1; else hi = mid;
+    }
+    return NULL;
+}
+
+static seg_t *seg_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open segment error");
+        return NULL;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    void *map = st.st_size >= (off_t)sizeof(seg_hdr_t) ?
+                mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("bad segment %s\n", path);
+        return NULL;
+    }
+    const seg_hdr_t *hdr = map;
+    if (hdr->magic != SEG_MAGIC || hdr->version != SEG_VERSION || hdr->size != (uint64_t)st.st_size ||
+        hdr->dict_off + (uint64_t)hdr->nterms * sizeof(seg_term_t) > hdr->size) {
+        printf("bad segment %s\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    seg_t *s = calloc(1, sizeof(seg_t));
+    s->refs = 1;
+    s->first = hdr->first;
+    s->end = hdr->end;
+    s->map = map;
+    s->size = st.st_size;
+    s->hdr = hdr;
+    s->dict = (const seg_term_t *)(s->map + hdr->dict_off);
+    s->pool = (const char *)(s->map + hdr->pool_off);
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    return s;
+}
+
+// (持有 seg_mutex)
+static void seg_unref_locked(seg_t *s)
+{
+    if (--s->refs == 0) {
+        munmap(s->map, s->size);
+        free(s);
+    }
+}
+
+// 写段文件：先写到 .tmp，写完 fsync 再改名，崩溃时不会留下半个段
+typedef struct
+{
+    FILE *fp;
+    uint64_t off;
+    seg_term_t *dict;
+    size_t nterms, dict_cap;
+    char *pool;
+    size_t pool_len, pool_cap;
+    uint8_t *enc;
+    size_t enc_cap;
+} segw_t;
+
+static int segw_begin(segw_t *w, const char *tmp)
+{
+    memset(w, 0, sizeof(*w));
+    w->fp = fopen(tmp, "wb");
+    if (w->fp == NULL) {
+        perror("create segment error");
+        return -1;
+    }
+    seg_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    fwrite(&hdr, sizeof(hdr), 1, w->fp);
+    w->off = sizeof(hdr);
+    return 0;
+}
+
+// 加一个词（必须按词的顺序加）
+static void segw_term(segw_t *w, const char *t, uint32_t len, const uint32_t *docs, uint32_t n)
+{
+    uint32_t nblocks = (n + BLOCK - 1) / BLOCK;
+    size_t need = (size_t)nblocks * sizeof(blk_dir_t) + (size_t)n * 5;
+    if (need > w->enc_cap) {
+        w->enc_cap = need * 2;
+        w->enc = realloc(w->enc, w->enc_cap);
+    }
+    blk_dir_t *dir = nblocks > 1 ? (blk_dir_t *)w->enc : NULL;
+    if (dir != NULL && w->off % 4 != 0) {
+        static const char zeros[4];
+        fwrite(zeros, 1, 4 - w->off % 4, w->fp); // 块目录按 4 字节对齐，读的时候直接映射
+        w->off += 4 - w->off % 4;
+    }
+    uint8_t *data = w->enc + (dir != NULL ? nblocks * sizeof(blk_dir_t) : 0);
+    size_t len_data = 0;
+    uint32_t prev = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (i % BLOCK == 0 && dir != NULL) {
+            dir[i / BLOCK].off = len_data; // 每块的第一个编号相对上一块的最后一个
+        }
+        len_data += put_varint(data + len_data, docs[i] - prev);
+        prev = docs[i];
+        if (dir != NULL && (i % BLOCK == BLOCK - 1 || i == n - 1)) {
+            dir[i / BLOCK].last = docs[i];
+        }
+    }
+    size_t total = (data - w->enc) + len_data;
+    fwrite(w->enc, 1, total, w->fp);
+
+    if (w->nterms == w->dict_cap) {
+        w->dict_cap = w->dict_cap ? w->dict_cap * 2 : 4096;
+        w->dict = realloc(w->dict, w->dict_cap * sizeof(seg_term_t));
+    }
+    if (w->pool_len + len > w->pool_cap) {
+        w->pool_cap = (w->pool_len + len) * 2;
+        w->pool = realloc(w->pool, w->pool_cap);
+    }
+    seg_term_t *e = &w->dict[w->nterms++];
+    e->post_off = w->off;
+    e->term_off = w->pool_len;
+    e->term_len = len;
+    e->count = n;
+    e->reserved = 0;
+    memcpy(w->pool + w->pool_len, t, len);
+    w->pool_len += len;
+    w->off += total;
+}
+
+static int segw_end(segw_t *w, uint32_t first, uint32_t end, const char *tmp, const char *path)
+{
+    seg_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SEG_MAGIC;
+    hdr.version = SEG_VERSION;
+    hdr.first = first;
+    hdr.end = end;
+    hdr.nterms = w->nterms;
+    hdr.pool_off = w->off;
+    uint64_t pad = (8 - (w->off + w->pool_len) % 8) % 8; // 词典按 8 字节对齐
+    hdr.dict_off = w->off + w->pool_len + pad;
+    hdr.size = hdr.dict_off + w->nterms * sizeof(seg_term_t);
+    static const char zeros[8];
+    fwrite(w->pool, 1, w->pool_len, w->fp);
+    fwrite(zeros, 1, pad, w->fp);
+    fwrite(w->dict, sizeof(seg_term_t), w->nterms, w->fp);
+    fseek(w->fp, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, w->fp);
+    int ok = fflush(w->fp) == 0 && fsync(fileno(w->fp)) == 0;
+    fclose(w->fp);
+    free(w->dict);
+    free(w->pool);
+    free(w->enc);
+    if (!ok || rename(tmp, path) < 0) {
+        perror("write segment error");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void seg_paths(uint32_t first, uint32_t end, char *tmp, char *path, size_t size)
+{
+    snprintf(path, size, "%s/seg-%010u-%010u.idx", hist_dir, first, end);
+    snprintf(tmp, size, "%s/seg-%010u-%010u.tmp", hist_dir, first, end);
+}
+
+static int mterm_cmp(const void *a, const void *b)
+{
+    const mterm_t *x = *(const mterm_t *const *)a, *y = *(const mterm_t *const *)b;
+    return term_cmp(x->term, x->len, y->term, y->len);
+}
+
+static seg_t *seg_write_mem(const memseg_t *ms)
+{
+    char tmp[512], path[512];
+    seg_paths(ms->first, ms->end, tmp, path, sizeof(path));
+    mterm_t **order = malloc(sizeof(mterm_t *) * (ms->count + 1));
+    size_t n = 0;
+    for (size_t i = 0; i < ms->cap; i++) {
+        if (ms->slots[i].term != NULL) order[n++] = &ms->slots[i];
+    }
+    qsort(order, n, sizeof(mterm_t *), mterm_cmp);
+
+    segw_t w;
+    if (segw_begin(&w, tmp) < 0) {
+        free(order);
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        segw_term(&w, order[i]->term, order[i]->len, order[i]->docs, order[i]->n);
+    }
+    free(order);
+    if (segw_end(&w, ms->first, ms->end, tmp, path) < 0) {
+        return NULL;
+    }
+    return seg_load(path);
+}
+
+// 合并相邻的几个段：各段词典都是有序的，多路归并；编号区间不重叠，倒排表直接首尾相接
+static seg_t *seg_merge(seg_t **in, int k)
+{
+    char tmp[512], path[512];
+    uint32_t first = in[0]->first, end = in[k - 1]->end;
+    seg_paths(first, end, tmp, path, sizeof(path));
+    segw_t w;
+    if (segw_begin(&w, tmp) < 0) {
+        return NULL;
+    }
+    uint32_t pos[MERGE_FACTOR] = { 0 };
+    uint32_t *docs = NULL;
+    size_t docs_cap = 0;
+    plist_t *pl = malloc(sizeof(plist_t));
+    while (1) {
+        // 找最小的词
+        const char *t = NULL;
+        uint32_t len = 0;
+        for (int i = 0; i < k; i++) {
+            if (pos[i] < in[i]->hdr->nterms) {
+                const seg_term_t *e = &in[i]->dict[pos[i]];
+                if (t == NULL || term_cmp(in[i]->pool + e->term_off, e->term_len, t, len) < 0) {
+                    t = in[i]->pool + e->term_off;
+                    len = e->term_len;
+                }
+            }
+        }
+        if (t == NULL) break;
+        size_t n = 0;
+        for (int i = 0; i < k; i++) {
+            if (pos[i] >= in[i]->hdr->nterms) continue;
+            const seg_term_t *e = &in[i]->dict[pos[i]];
+            if (term_cmp(in[i]->pool + e->term_off, e->term_len, t, len) != 0) continue;
+            if (n + e->count > docs_cap) {
+                docs_cap = (n + e->count) * 2;
+                docs = realloc(docs, docs_cap * sizeof(uint32_t));
+            }
+            plist_from_seg(pl, in[i], e);
+            for (uint32_t b = 0; b < pl->nblocks; b++) {
+                plist_load(pl, b);
+                memcpy(docs + n, pl->cur, pl->blen * sizeof(uint32_t));
+                n += pl->blen;
+            }
+            pos[i]++;
+        }
+        // t 指向某个输入段的映射，segw_term 会复制
+        segw_term(&w, t, len, docs, n);
+    }
+    free(pl);
+    free(docs);
+    if (segw_end(&w, first, end, tmp, path) < 0) {
+        return NULL;
+    }
+    return seg_load(path);
+}
+
+// (持有 seg_mutex) 把段加到末尾
+static void segs_push_locked(seg_t *s)
+{
+    if (nsegs == segs_cap) {
+        segs_cap = segs_cap ? segs_cap * 2 : 16;
+        segs = realloc(segs, segs_cap * sizeof(seg_t *));
+    }
+    segs[nsegs++] = s;
+}
+
+// 段的档位：按 flush_docs 的 4 的幂分档
+static int seg_tier(const seg_t *s)
+{
+    uint64_t n = s->end - s->first;
+    int tier = 0;
+    for (uint64_t lim = (uint64_t)flush_docs * MERGE_FACTOR; n >= lim; lim *= MERGE_FACTOR) {
+        tier++;
+    }
+    return tier;
+}
+
+// (持有 seg_mutex) 找一组可以合并的相邻段，返回起点，没有返回 -1
+static int merge_pick_locked(void)
+{
+    for (int i = 0; i + MERGE_FACTOR <= nsegs; i++) {
+        int tier = seg_tier(segs[i]), j;
+        for (j = 1; j < MERGE_FACTOR && seg_tier(segs[i + j]) == tier; j++) {
+        }
+        if (j == MERGE_FACTOR) return i;
+    }
+    return -1;
+}
+
+static void *merge_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&seg_mutex);
+    while (1) {
+        int i = merge_pick_locked();
+        if (i < 0) {
+            merge_busy = 0;
+            pthread_cond_broadcast(&merge_cond);
+            pthread_cond_wait(&merge_cond, &seg_mutex);
+            continue;
+        }
+        merge_busy = 1;
+        seg_t *in[MERGE_FACTOR];
+        for (int j = 0; j < MERGE_FACTOR; j++) {
+            in[j] = segs[i + j];
+            in[j]->refs++;
+        }
+        pthread_mutex_unlock(&seg_mutex);
+
+        seg_t *out = seg_merge(in, MERGE_FACTOR);
+
+        pthread_mutex_lock(&seg_mutex);
+        if (out == NULL) {
+            // 合并失败（磁盘满等）：保留原来的段，过一会再试
+            for (int j = 0; j < MERGE_FACTOR; j++) seg_unref_locked(in[j]);
+            pthread_mutex_unlock(&seg_mutex);
+            sleep(5);
+            pthread_mutex_lock(&seg_mutex);
+            continue;
+        }
+        // 建索引线程只会在末尾追加，前面的下标不变
+        segs[i] = out;
+        memmove(&segs[i + 1], &segs[i + MERGE_FACTOR], (nsegs - i - MERGE_FACTOR) * sizeof(seg_t *));
+        nsegs -= MERGE_FACTOR - 1;
+        for (int j = 0; j < MERGE_FACTOR; j++) {
+            unlink(in[j]->path); // 正在查询的还映射着，不受影响
+            in[j]->refs--;       // 段列表的引用
+            seg_unref_locked(in[j]);
+        }
+    }
+    return NULL;
+}
+
+// ---------------- 写入 ----------------
+
+static void write_all(int fd, const void *buf, size_t len, uint64_t off)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n <= 0) {
+            perror("history write error");
+            return;
+        }
+        p += n;
+        len -= n;
+        off += n;
+    }
+}
+
+// (建索引线程) 内存段写成磁盘段
+static void mem_flush(void)
+{
+    pthread_mutex_lock(&mem_mutex);
+    if (mem->end == mem->first) {
+        pthread_mutex_unlock(&mem_mutex);
+        return;
+    }
+    frozen = mem;
+    mem = memseg_new(frozen->end);
+    pthread_mutex_unlock(&mem_mutex);
+
+    seg_t *s = seg_write_mem(frozen);
+    if (s == NULL) {
+        // 写不了段（磁盘满等）：换回原来的内存段，下次再试。
+        // 这段时间只有本线程会往内存段里加东西，新的那个一定是空的
+        pthread_mutex_lock(&mem_mutex);
+        memseg_free(mem);
+        mem = frozen;
+        frozen = NULL;
+        pthread_mutex_unlock(&mem_mutex);
+        return;
+    }
+    pthread_mutex_lock(&seg_mutex);
+    segs_push_locked(s);
+    pthread_cond_signal(&merge_cond);
+    pthread_mutex_unlock(&seg_mutex);
+
+    pthread_mutex_lock(&mem_mutex);
+    memseg_free(frozen);
+    frozen = NULL;
+    pthread_mutex_unlock(&mem_mutex);
+}
+
+static void *index_main(void *arg)
+{
+    (void)arg;
+    uint8_t *logbuf = NULL;
+    size_t logcap = 0;
+    uint64_t *offbuf = NULL;
+    size_t offcap = 0;
+    while (1) {
+        pthread_mutex_lock(&q_mutex);
+        while (q_head == NULL && !flush_req) {
+            pthread_cond_wait(&q_cond, &q_mutex);
+        }
+        hist_item_t *batch = q_head;
+        q_head = q_tail = NULL;
+        int do_flush = flush_req;
+        q_busy = 1;
+        pthread_mutex_unlock(&q_mutex);
+
+        // 1. 整批写进 log 和 off
+        size_t loglen = 0, n = 0;
+        for (hist_item_t *it = batch; it != NULL; it = it->next) {
+            size_t need = loglen + sizeof(rec_hdr_t) + 3 * 128;
+            if (need > logcap) {
+                logcap = need * 2;
+                logbuf = realloc(logbuf, logcap);
+            }
+            if (n == offcap) {
+                offcap = offcap ? offcap * 2 : 1024;
+                offbuf = realloc(offbuf, offcap * sizeof(uint64_t));
+            }
+            hist_msg_t *m = &it->msg;
+            rec_hdr_t h;
+            h.ts = m->ts;
+            h.kind = m->kind;
+            h.from_len = strlen(m->from);
+            h.to_len = strlen(m->to);
+            h.text_len = strlen(m->text);
+            offbuf[n++] = log_end + loglen;
+            memcpy(logbuf + loglen, &h, sizeof(h));
+            loglen += sizeof(h);
+            memcpy(logbuf + loglen, m->from, h.from_len);
+            loglen += h.from_len;
+            memcpy(logbuf + loglen, m->to, h.to_len);
+            loglen += h.to_len;
+            memcpy(logbuf + loglen, m->text, h.text_len);
+            loglen += h.text_len;
+        }
+        if (n > 0) {
+            write_all(log_fd, logbuf, loglen, log_end); // 先写内容再写下标，下标在就说明内容完整
+            write_all(off_fd, offbuf, n * sizeof(uint64_t), (uint64_t)ndocs * sizeof(uint64_t));
+            log_end += loglen;
+        }
+
+        // 2. 加进内存段，满了写盘
+        pthread_mutex_lock(&mem_mutex);
+        for (hist_item_t *it = batch; it != NULL; it = it->next) {
+            index_msg(mem, ndocs++, &it->msg);
+        }
+        int full = mem->end - mem->first >= flush_docs;
+        pthread_mutex_unlock(&mem_mutex);
+        while (batch != NULL) {
+            hist_item_t *next = batch->next;
+            free(batch);
+            batch = next;
+        }
+        if (full || do_flush) {
+            mem_flush();
+        }
+
+        pthread_mutex_lock(&q_mutex);
+        q_busy = 0;
+        if (do_flush) flush_req = 0;
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&q_mutex);
+    }
+    return NULL;
+}
+
+void hist_append(int kind, const char *from, const char *to, const char *text)
+{
+    if (!hist_on) return;
+    hist_item_t *it = malloc(sizeof(hist_item_t));
+    if (it == NULL) {
+        perror("malloc history error");
+        return;
+    }
+    memset(&it->msg, 0, sizeof(it->msg));
+    it->next = NULL;
+    it->msg.ts = time(NULL);
+    it->msg.kind = kind;
+    snprintf(it->msg.from, sizeof(it->msg.from), "%s", from);
+    snprintf(it->msg.to, sizeof(it->msg.to), "%s", to != NULL ? to : "");
+    snprintf(it->msg.text, sizeof(it->msg.text), "%s", text);
+
+    pthread_mutex_lock(&q_mutex);
+    if (q_tail != NULL) q_tail->next = it; else q_head = it;
+    q_tail = it;
+    pthread_cond_signal(&q_cond);
+    pthread_mutex_unlock(&q_mutex);
+}
+
+void hist_sync(int flush)
+{
+    if (!hist_on) return;
+    pthread_mutex_lock(&q_mutex);
+    if (flush) {
+        flush_req = 1;
+        pthread_cond_signal(&q_cond);
+    }
+    while (q_head != NULL || q_busy || flush_req) {
+        pthread_cond_wait(&idle_cond, &q_mutex);
+    }
+    pthread_mutex_unlock(&q_mutex);
+    if (flush) {
+        pthread_mutex_lock(&seg_mutex);
+        while (merge_busy || merge_pick_locked() >= 0) {
+            pthread_cond_signal(&merge_cond);
+            pthread_cond_wait(&merge_cond, &seg_mutex);
+        }
+        pthread_mutex_unlock(&seg_mutex);
+    }
+}
+
+void hist_stats(uint32_t *docs, int *n, uint64_t *index_bytes)
+{
+    uint64_t bytes = 0;
+    pthread_mutex_lock(&seg_mutex);
+    for (int i = 0; i < nsegs; i++) bytes += segs[i]->size;
+    if (n != NULL) *n = nsegs;
+    pthread_mutex_unlock(&seg_mutex);
+    if (index_bytes != NULL) *index_bytes = bytes;
+    if (docs != NULL) {
+        pthread_mutex_lock(&mem_mutex);
+        *docs = mem != NULL ? mem->end : 0;
+        pthread_mutex_unlock(&mem_mutex);
+    }
+}
+
+// ---------------- 读取 ----------------
+
+// 按编号读一条消息
+static int fetch(uint32_t id, hist_msg_t *m)
+{
+    uint64_t off;
+    uint8_t buf[sizeof(rec_hdr_t) + 3 * 128];
+    if (pread(off_fd, &off, sizeof(off), (uint64_t)id * sizeof(off)) != sizeof(off)) {
+        return -1;
+    }
+    ssize_t n = pread(log_fd, buf, sizeof(buf), off);
+    rec_hdr_t h;
+    if (n < (ssize_t)sizeof(h)) return -1;
+    memcpy(&h, buf, sizeof(h));
+    if ((size_t)n < sizeof(h) + h.from_len + h.to_len + h.text_len ||
+        h.from_len > 31 || h.to_len > 31 || h.text_len > 127) {
+        return -1;
+    }
+    memset(m, 0, sizeof(*m));
+    m->id = id;
+    m->ts = h.ts;
+    m->kind = h.kind;
+    memcpy(m->from, buf + sizeof(h), h.from_len);
+    memcpy(m->to, buf + sizeof(h) + h.from_len, h.to_len);
+    memcpy(m->text, buf + sizeof(h) + h.from_len + h.to_len, h.text_len);
+    return 0;
+}
+
+// 解析好的查询
+typedef struct
+{
+    char terms[MAX_TERMS][TERM_MAX];
+    uint32_t lens[MAX_TERMS];
+    int nterms;
+    char words[MAX_TERMS][128];   // 原文核对用（ASCII 已转小写）
+    int nwords;
+    char priv[TERM_MAX], mine[TERM_MAX];
+    uint32_t priv_len, mine_len;  // mine_len = 0 表示不过滤
+} query_t;
+
+static void query_add_term(const char *t, uint32_t len, void *arg)
+{
+    query_t *q = (query_t *)arg;
+    for (int i = 0; i < q->nterms; i++) {
+        if (q->lens[i] == len && memcmp(q->terms[i], t, len) == 0) return;
+    }
+    if (q->nterms < MAX_TERMS) {
+        memcpy(q->terms[q->nterms], t, len);
+        q->lens[q->nterms++] = len;
+    }
+}
+
+static void lower_ascii(char *s)
+{
+    for (; *s; s++) {
+        if (*s >= 'A' && *s <= 'Z') *s += 32;
+    }
+}
+
+// 原文核对用的片段：和分词一样切成 ASCII 单词和非 ASCII 连续段，标点不参与比较
+static void query_add_words(query_t *q, const char *w)
+{
+    while (*w != '\0' && q->nwords < MAX_TERMS) {
+        unsigned char ch = *w;
+        int alnum = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9');
+        if (!alnum && ch < 0x80) {
+            w++;
+            continue;
+        }
+        size_t len = 0;
+        char *dst = q->words[q->nwords];
+        while (w[len] != '\0' && len < sizeof(q->words[0]) - 1) {
+            unsigned char c = w[len];
+            int same = ch >= 0x80 ? c >= 0x80 :
+                       (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+            if (!same) break;
+            dst[len] = c;
+            len++;
+        }
+        dst[len] = '\0';
+        lower_ascii(dst);
+        q->nwords++;
+        w += len;
+    }
+}
+
+// 原文里是否每个片段都出现（ASCII 不分大小写）
+static int verify(const query_t *q, const hist_msg_t *m)
+{
+    char text[128];
+    snprintf(text, sizeof(text), "%s", m->text);
+    lower_ascii(text);
+    for (int i = 0; i < q->nwords; i++) {
+        if (strstr(text, q->words[i]) == NULL) return 0;
+    }
+    return 1;
+}
+
+// 在一个段里按编号从大到小找，最多补到 max 条。lists 已按长度从短到长排好
+static int query_lists(const query_t *q, plist_t *lists, int nlists, plist_t *priv, plist_t *mine,
+                       uint32_t below, hist_msg_t *out, int nout, int max)
+{
+    plist_t *pivot = &lists[0];
+    for (int b = (int)pivot->nblocks - 1; b >= 0 && nout < max; b--) {
+        plist_load(pivot, b);
+        for (int i = (int)pivot->blen - 1; i >= 0 && nout < max; i--) {
+            uint32_t doc = pivot->cur[i];
+            if (doc >= below) continue;
+            int ok = 1;
+            for (int j = 1; j < nlists && ok; j++) {
+                ok = plist_contains(&lists[j], doc);
+            }
+            // 私聊只给收发双方看
+            if (ok && priv != NULL && plist_contains(priv, doc)) {
+                ok = mine != NULL && plist_contains(mine, doc);
+            }
+            if (ok && fetch(doc, &out[nout]) == 0 && verify(q, &out[nout])) {
+                nout++;
+            }
+        }
+    }
+    return nout;
+}
+
+static int plist_count_cmp(const void *a, const void *b)
+{
+    const plist_t *x = a, *y = b;
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+int hist_search(const char *user, const char *query, hist_msg_t *out, int max)
+{
+    if (!hist_on || max <= 0) return 0;
+    query_t *q = calloc(1, sizeof(query_t));
+    char buf[256], *save = NULL;
+    snprintf(buf, sizeof(buf), "%s", query);
+    for (char *w = strtok_r(buf, " \t", &save); w != NULL; w = strtok_r(NULL, " \t", &save)) {
+        if (strncmp(w, "from:", 5) == 0 && w[5] != '\0') {
+            char t[TERM_MAX];
+            query_add_term(t, snprintf(t, sizeof(t), T_FROM "%s", w + 5), q);
+            continue;
+        }
+        tokenize(w, 1, query_add_term, q);
+        query_add_words(q, w);
+    }
+    if (q->nterms == 0) {
+        free(q);
+        return -1;
+    }
+    if (user != NULL) {
+        q->priv_len = snprintf(q->priv, sizeof(q->priv), T_PRIV);
+        q->mine_len = snprintf(q->mine, sizeof(q->mine), T_USER "%s", user);
+    }
+
+    plist_t *lists = malloc(sizeof(plist_t) * (MAX_TERMS + 2));
+    plist_t *priv = &lists[MAX_TERMS], *mine = &lists[MAX_TERMS + 1];
+    int nout = 0;
+    uint32_t below = UINT32_MAX;
+
+    // 1. 内存段（最新的消息），持锁期间建索引线程不会改它
+    pthread_mutex_lock(&mem_mutex);
+    memseg_t *mems[2] = { mem, frozen };
+    for (int k = 0; k < 2 && nout < max; k++) {
+        memseg_t *ms = mems[k];
+        if (ms == NULL) continue;
+        int ok = 1;
+        for (int i = 0; i < q->nterms && ok; i++) {
+            mterm_t *m = memseg_find(ms, q->terms[i], q->lens[i]);
+            ok = m != NULL;
+            if (ok) plist_from_array(&lists[i], m->docs, m->n);
+        }
+        if (!ok) continue;
+        qsort(lists, q->nterms, sizeof(plist_t), plist_count_cmp);
+        mterm_t *pm = user != NULL ? memseg_find(ms, q->priv, q->priv_len) : NULL;
+        mterm_t *mm = user != NULL ? memseg_find(ms, q->mine, q->mine_len) : NULL;
+        if (pm != NULL) plist_from_array(priv, pm->docs, pm->n);
+        if (mm != NULL) plist_from_array(mine, mm->docs, mm->n);
+        nout = query_lists(q, lists, q->nterms, pm ? priv : NULL, mm ? mine : NULL,
+                           UINT32_MAX, out, nout, max);
+    }
+    below = frozen != NULL ? frozen->first : mem->first;
+    pthread_mutex_unlock(&mem_mutex);
+
+    // 2. 磁盘段，从新到旧。刚从内存段写出来的段可能和上面查过的重叠，用 below 去掉
+    pthread_mutex_lock(&seg_mutex);
+    int n = nsegs;
+    seg_t **snap = malloc(sizeof(seg_t *) * (n + 1));
+    for (int i = 0; i < n; i++) {
+        snap[i] = segs[i];
+        snap[i]->refs++;
+    }
+    pthread_mutex_unlock(&seg_mutex);
+
+    for (int s = n - 1; s >= 0 && nout < max; s--) {
+        if (snap[s]->first >= below) continue;
+        int ok = 1;
+        for (int i = 0; i < q->nterms && ok; i++) {
+            const seg_term_t *e = seg_find(snap[s], q->terms[i], q->lens[i]);
+            ok = e != NULL;
+            if (ok) plist_from_seg(&lists[i], snap[s], e);
+        }
+        if (!ok) continue;
+        qsort(lists, q->nterms, sizeof(plist_t), plist_count_cmp);
+        const seg_term_t *pe = user != NULL ? seg_find(snap[s], q->priv, q->priv_len) : NULL;
+        const seg_term_t *me = user != NULL ? seg_find(snap[s], q->mine, q->mine_len) : NULL;
+        if (pe != NULL) plist_from_seg(priv, snap[s], pe);
+        if (me != NULL) plist_from_seg(mine, snap[s], me);
+        nout = query_lists(q, lists, q->nterms, pe ? priv : NULL, me ? mine : NULL,
+                           below, out, nout, max);
+    }
+
+    pthread_mutex_lock(&seg_mutex);
+    for (int i = 0; i < n; i++) seg_unref_locked(snap[i]);
+    pthread_mutex_unlock(&seg_mutex);
+    free(snap);
+    free(lists);
+    free(q);
+    return nout;
+}
+
+int hist_recent(const char *user, hist_msg_t *out, int max)
+{
+    if (!hist_on || max <= 0) return 0;
+    // mem->end 之前的消息都已经写进 log 了
+    pthread_mutex_lock(&mem_mutex);
+    uint32_t end = mem->end;
+    pthread_mutex_unlock(&mem_mutex);
+
+    int nout = 0;
+    uint32_t limit = (uint32_t)max * 32;
+    for (uint32_t id = end; id > 0 && nout < max && end - id < limit; id--) {
+        hist_msg_t *m = &out[nout];
+        if (fetch(id - 1, m) < 0) continue;
+        if (m->kind == HIST_PRIVATE && user != NULL &&
+            strcmp(m->from, user) != 0 && strcmp(m->to, user) != 0) {
+            continue;
+        }
+        nout++;
+    }
+    return nout;
+}
+
+void hist_format(const hist_msg_t *m, char *out, size_t size)
+{
+    char line[320];
+    time_t ts = m->ts;
+    struct tm tm;
+    localtime_r(&ts, &tm);
+    int len = strftime(line, sizeof(line), "[%m-%d %H:%M] ", &tm);
+    if (m->kind == HIST_PRIVATE) {
+        snprintf(line + len, sizeof(line) - len, "%s->%s: %s", m->from, m->to, m->text);
+    } else {
+        snprintf(line + len, sizeof(line) - len, "%s: %s", m->from, m->text);
+    }
+    size_t cut = strlen(line);
+    if (cut >= size) { // 别把一个汉字切成两半
+        cut = size - 1;
+        while (cut > 0 && (line[cut] & 0xC0) == 0x80) cut--;
+    }
+    memset(out + cut, 0, size - cut); // 后面补 0：整帧发出去时不带上一行的残留
+    memcpy(out, line, cut);
+}
+
+// ---------------- 启动 ----------------
+
+static int seg_sort_cmp(const void *a, const void *b)
+{
+    const seg_t *x = *(seg_t *const *)a, *y = *(seg_t *const *)b;
+    if (x->first != y->first) return x->first < y->first ? -1 : 1;
+    return x->end > y->end ? -1 : x->end < y->end; // 起点相同时大的在前
+}
+
+// 读目录里的段。合并写完、旧段还没删时会有重叠：保留覆盖范围大的
+static void load_segments(void)
+{
+    DIR *d = opendir(hist_dir);
+    struct dirent *de;
+    char path[512];
+    seg_t **all = NULL;
+    int n = 0, cap = 0;
+    while (d != NULL && (de = readdir(d)) != NULL) {
+        unsigned first, end;
+        size_t len = strlen(de->d_name);
+        if (sscanf(de->d_name, "seg-%u-%u", &first, &end) != 2 || len < 4) continue;
+        snprintf(path, sizeof(path), "%s/%s", hist_dir, de->d_name);
+        if (strcmp(de->d_name + len - 4, ".tmp") == 0) {
+            unlink(path); // 没写完的段
+            continue;
+        }
+        seg_t *s = seg_load(path);
+        if (s == NULL) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            all = realloc(all, cap * sizeof(seg_t *));
+        }
+        all[n++] = s;
+    }
+    if (d != NULL) closedir(d);
+    if (n > 0) qsort(all, n, sizeof(seg_t *), seg_sort_cmp);
+    uint32_t covered = 0;
+    for (int i = 0; i < n; i++) {
+        if (all[i]->first == covered && all[i]->end <= ndocs) {
+            segs_push_locked(all[i]);
+            covered = all[i]->end;
+            continue;
+        }
+        // 被更大的段覆盖了、超出了 log（log 被截断过）、或者前面缺了一段：删掉，从 log 重建
+        unlink(all[i]->path);
+        seg_unref_locked(all[i]);
+    }
+    free(all);
+}
+
+int hist_open(const char *dir)
+{
+    if (dir == NULL || dir[0] == '\0') {
+        return 0;
+    }
+    snprintf(hist_dir, sizeof(hist_dir), "%s", dir);
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror("mkdir history error");
+        return -1;
+    }
+    if (getenv("CHAT_HIST_FLUSH") != NULL && atoi(getenv("CHAT_HIST_FLUSH")) > 0) {
+        flush_docs = atoi(getenv("CHAT_HIST_FLUSH"));
+    }
+    char path[512];
+    snprintf(path, sizeof(path), "%s/" LOG_NAME, dir);
+    log_fd = open(path, O_RDWR | O_CREAT, 0600);
+    snprintf(path, sizeof(path), "%s/" OFF_NAME, dir);
+    off_fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (log_fd < 0 || off_fd < 0) {
+        perror("open history error");
+        return -1;
+    }
+
+    // 1. 以下标文件为准：没写完的下标和它后面的内容都截掉
+    struct stat st;
+    fstat(off_fd, &st);
+    ndocs = st.st_size / sizeof(uint64_t);
+    log_end = 0;
+    hist_msg_t m;
+    while (ndocs > 0) {
+        uint64_t off;
+        rec_hdr_t h;
+        if (pread(off_fd, &off, sizeof(off), (uint64_t)(ndocs - 1) * sizeof(off)) == sizeof(off) &&
+            pread(log_fd, &h, sizeof(h), off) == sizeof(h) && fetch(ndocs - 1, &m) == 0) {
+            log_end = off + sizeof(h) + h.from_len + h.to_len + h.text_len;
+            break;
+        }
+        ndocs--;
+    }
+    if (ftruncate(off_fd, (off_t)ndocs * sizeof(uint64_t)) < 0 || ftruncate(log_fd, log_end) < 0) {
+        perror("truncate history error");
+    }
+
+    // 2. 磁盘段；段没覆盖到的消息（上次内存段里的）从 log 重新建索引
+    load_segments();
+    uint32_t indexed = nsegs > 0 ? segs[nsegs - 1]->end : 0;
+    mem = memseg_new(indexed);
+    for (uint32_t id = indexed; id < ndocs; id++) {
+        if (fetch(id, &m) == 0) {
+            index_msg(mem, id, &m);
+        }
+        mem->end = id + 1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, index_main, NULL) != 0 ||
+        (pthread_detach(tid), pthread_create(&tid, NULL, merge_main, NULL)) != 0) {
+        perror("pthread_create (history) error");
+        return -1;
+    }
+    pthread_detach(tid);
+    hist_on = 1;
+    printf("chat history in %s: %u messages, %d segments\n", dir, ndocs, nsegs);
+    return 0;
+}
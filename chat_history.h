@@ -0,0 +1,55 @@
+/* --- chat_history.h (聊天记录和全文检索) --- */
+#ifndef CHAT_HISTORY_H
+#define CHAT_HISTORY_H
+
+// 群聊和私聊都追加写进 messages.log（下标文件 messages.off），同时建倒排索引：
+//   1. 服务器线程只把消息放进队列（hist_append），落盘和建索引在后台线程里做，不卡聊天
+//   2. 新消息先进内存段，攒够 CHAT_HIST_FLUSH 条（默认 65536）写成一个只读的磁盘段
+//   3. 后台线程把大小相近的相邻段合并（每 4 个合成 1 个），段数保持在对数级别
+//   4. 分词：ASCII 字母数字按单词（转小写）；中文等非 ASCII 字符按单字和相邻两字（二元组），
+//      查询时中文按二元组找候选，再用原文核对子串，去掉二元组都在但不挨着的误命中
+//   5. 私聊只对收发双方可见：私聊消息额外索引“私聊”标记和双方的名字，查询时一起过滤
+// 倒排表按 128 个编号一块做差值 varint 压缩，块目录记录每块的最大编号，可以跳着查。
+
+#include <stdint.h>
+
+#define HIST_PUBLIC  0
+#define HIST_PRIVATE 1
+
+typedef struct
+{
+    uint32_t id;      // 消息编号（从 0 开始）
+    uint32_t ts;      // 发送时间（秒）
+    int kind;         // HIST_PUBLIC / HIST_PRIVATE
+    char from[32];
+    char to[32];      // 私聊的接收方，群聊为空
+    char text[128];
+} hist_msg_t;
+
+// dir 为 NULL 或空时不启用，其余函数都是空操作
+int hist_open(const char *dir);
+extern int hist_on;
+
+// 任何线程都可以调用：放进队列就返回
+void hist_append(int kind, const char *from, const char *to, const char *text);
+
+// 查询：query 是空格分开的词（全部都要出现），可以带 from:用户 只看某人发的。
+// user 是查询者，只能看到群聊和自己收发的私聊；user 为 NULL 时不过滤（管理工具用）。
+// 结果按时间从新到旧，最多 max 条，返回条数；查询为空返回 -1
+int hist_search(const char *user, const char *query, hist_msg_t *out, int max);
+
+// 最近的消息（登录时补发用）：同样只给 user 看得到的，按时间从新到旧，最多 max 条，返回条数。
+// 往回最多翻 max * 32 条，私聊很多的时候可能凑不满
+int hist_recent(const char *user, hist_msg_t *out, int max);
+
+// 显示成一行："[月-日 时:分] 发送者: 正文"，私聊是 "发送者->接收者: 正文"。
+// 放不下时截断在 UTF-8 字符边界上
+void hist_format(const hist_msg_t *m, char *out, size_t size);
+
+// 等队列里的消息都写完、建好索引。flush = 1 时把内存段也写成磁盘段，并等合并完成
+void hist_sync(int flush);
+
+// 统计：已写入的消息数、磁盘段数、索引文件总字节数
+void hist_stats(uint32_t *docs, int *nsegs, uint64_t *index_bytes);
+
+#endif
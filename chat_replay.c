@@ -0,0 +1,430 @@
+/* --- chat_replay.c (流量回放工具) --- */
+// 用法: ./chat_replay [-h ip] [-p port] [-s speed] [-d pct] [-q] [-v] <trace>
+// 读取服务器用 CHAT_TRACE=<trace> 录下的流量，按原来的连接和时间间隔重新发给服务器：
+//   -s 1    按原速回放（默认）
+//   -s N    N 倍速
+//   -s 0    不等待，尽可能快
+// 回放时收集每个连接收到的帧，和录制时服务器发出的帧（哈希）逐个连接比对，
+// 报告匹配 / 缺失 / 多出的帧数，以及回放耗时、吞吐和响应延迟分位数。
+// -q 不列出有差异的连接，-v 打印每个多出来的帧，方便查是哪里变了。
+// 输出完全一致时退出码为 0，否则为 1，可以直接用在回归测试脚本里；
+// -d pct 允许不超过 pct% 的帧不一致（多个连接同一毫秒内登录/下线时，
+// 广播给谁本来就有先后之分）。
+// 注意：文件数据连接（第一帧是 'D'）不回放；随机 token、\who 列表这类
+// 和时间有关的输出在倍速回放时本来就可能不同，服务器最好关掉限流再比。
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <getopt.h>
+#include "chat_trace.h"
+
+typedef struct
+{
+    char type;      // 消息类型 L C Q W P
+    char id[32];    // 用户id
+    char text[128]; // 消息内容
+} msg_t;
+
+// 录制时服务器发给某个连接的一帧
+typedef struct
+{
+    uint64_t hash;
+    long cause;     // 录制中在它之前最近的一条入方向记录（用来算响应延迟）
+    int matched;
+} expect_t;
+
+// 一个回放连接
+typedef struct
+{
+    int fd;         // -1 = 还没建立或已结束
+    int skip;       // 1 = 文件数据连接，不回放
+    int eof;        // TCP：对端已关闭
+    char inbuf[sizeof(msg_t)];
+    size_t inlen;
+    expect_t *expect;
+    long nexpect, cap, cursor; // cursor 之前的都已匹配
+    long unexpected;
+} replay_conn_t;
+
+// 需要回放的一条记录（OPEN / IN / CLOSE）
+typedef struct
+{
+    uint64_t ts_ns;
+    uint32_t conn_id;
+    uint8_t kind;
+    const uint8_t *data;
+    uint16_t len;
+} event_t;
+
+static replay_conn_t *conns;
+static uint32_t nconns;
+static event_t *events;
+static long nevents;
+static long long *sent_at;  // 每个事件实际发出的时间
+static long long *lat;      // 匹配上的输出的响应延迟
+static long nlat;
+static long long start_ns;
+static int proto;
+static int epfd;
+static int verbose;
+static struct sockaddr_in saddr;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 读整个录制文件，拆成按时间排好的事件和每个连接的期望输出
+static int load_trace(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open trace error"); return -1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    uint8_t *buf = malloc(st.st_size);
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+        ssize_t n = read(fd, buf + got, st.st_size - got);
+        if (n <= 0) {
+            perror("read trace error"); close(fd); return -1;
+        }
+        got += n;
+    }
+    close(fd);
+
+    trace_hdr_t hdr;
+    if (got < sizeof(hdr)) {
+        printf("trace too short\n"); return -1;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+        printf("not a chat trace (or wrong version)\n"); return -1;
+    }
+    proto = hdr.proto;
+
+    // 第一遍：数记录、找最大连接编号
+    size_t pos = sizeof(hdr);
+    long nrec = 0;
+    while (pos + sizeof(trace_rec_t) <= got) {
+        trace_rec_t rec;
+        memcpy(&rec, buf + pos, sizeof(rec));
+        if (pos + sizeof(rec) + rec.len > got) {
+            break; // 录制被杀掉时最后一条可能不完整
+        }
+        if (rec.conn_id + 1 > nconns) nconns = rec.conn_id + 1;
+        pos += sizeof(rec) + rec.len;
+        nrec++;
+    }
+    conns = calloc(nconns, sizeof(replay_conn_t));
+    events = malloc(nrec * sizeof(event_t));
+    for (uint32_t i = 0; i < nconns; i++) {
+        conns[i].fd = -1;
+        conns[i].skip = -1; // 还没见到第一帧
+    }
+
+    // 第二遍：入方向做成事件，出方向挂到连接的期望列表上
+    pos = sizeof(hdr);
+    for (long i = 0; i < nrec; i++) {
+        trace_rec_t rec;
+        memcpy(&rec, buf + pos, sizeof(rec));
+        const uint8_t *data = buf + pos + sizeof(rec);
+        pos += sizeof(rec) + rec.len;
+        replay_conn_t *c = &conns[rec.conn_id];
+
+        if (rec.kind == TR_OUT) {
+            if (rec.len != sizeof(uint64_t)) continue;
+            if (c->nexpect == c->cap) {
+                c->cap = c->cap ? c->cap * 2 : 64;
+                c->expect = realloc(c->expect, c->cap * sizeof(expect_t));
+            }
+            expect_t *e = &c->expect[c->nexpect++];
+            memcpy(&e->hash, data, sizeof(e->hash));
+            e->cause = nevents - 1;
+            e->matched = 0;
+            continue;
+        }
+        if (rec.kind == TR_IN && c->skip < 0) {
+            // 第一帧是 'D' 的是文件数据连接
+            c->skip = rec.len >= 2 && data[0] == 'M' && data[1] == 'D';
+        }
+        event_t *ev = &events[nevents++];
+        ev->ts_ns = rec.ts_ns;
+        ev->conn_id = rec.conn_id;
+        ev->kind = rec.kind;
+        ev->data = data;
+        ev->len = rec.len;
+    }
+    return 0;
+}
+
+// 比对收到的一帧
+static void on_output(replay_conn_t *c, const void *frame, size_t len)
+{
+    uint64_t h = trace_hash(frame, len);
+    // 大多数情况下顺序不变，从第一个未匹配的开始找
+    for (long i = c->cursor; i < c->nexpect; i++) {
+        expect_t *e = &c->expect[i];
+        if (e->matched || e->hash != h) continue;
+        e->matched = 1;
+        if (e->cause >= 0 && sent_at[e->cause] > 0) {
+            lat[nlat++] = now_ns() - sent_at[e->cause];
+        }
+        while (c->cursor < c->nexpect && c->expect[c->cursor].matched) {
+            c->cursor++;
+        }
+        return;
+    }
+    c->unexpected++;
+    if (verbose && len == sizeof(msg_t)) {
+        const msg_t *m = (const msg_t *)frame;
+        printf("  unexpected on conn %ld: %c [%.32s] %.128s\n",
+               (long)(c - conns), m->type, m->id, m->text);
+    }
+}
+
+static void on_readable(replay_conn_t *c)
+{
+    char buf[16384];
+    while (1) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n == 0) {
+            c->eof = 1;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+            return;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                c->eof = 1;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+            }
+            return;
+        }
+        if (proto == TRACE_UDP) { // 一个数据报就是一帧
+            on_output(c, buf, n);
+            continue;
+        }
+        // TCP 字节流：按 msg_t 切帧
+        size_t pos = 0;
+        while (pos < (size_t)n) {
+            size_t take = sizeof(msg_t) - c->inlen;
+            if (take > (size_t)n - pos) take = n - pos;
+            memcpy(c->inbuf + c->inlen, buf + pos, take);
+            c->inlen += take;
+            pos += take;
+            if (c->inlen == sizeof(msg_t)) {
+                on_output(c, c->inbuf, sizeof(msg_t));
+                c->inlen = 0;
+            }
+        }
+    }
+}
+
+// 处理收到的数据，最多等 timeout_ms 毫秒，返回处理的事件数
+static int pump(int timeout_ms)
+{
+    struct epoll_event evs[256];
+    int n = epoll_wait(epfd, evs, 256, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        on_readable(&conns[evs[i].data.u32]);
+    }
+    return n < 0 ? 0 : n;
+}
+
+static void replay_open(uint32_t id)
+{
+    replay_conn_t *c = &conns[id];
+    int fd = socket(AF_INET, proto == TRACE_UDP ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket error"); return;
+    }
+    // UDP 也 connect，这样每个连接有自己的端口，服务器看到的是不同的客户端
+    if (connect(fd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+        perror("connect error"); close(fd); return;
+    }
+    c->fd = fd;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = id;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void replay_event(long i)
+{
+    event_t *ev = &events[i];
+    replay_conn_t *c = &conns[ev->conn_id];
+    if (c->skip == 1) {
+        return;
+    }
+    if (ev->kind == TR_OPEN) {
+        replay_open(ev->conn_id);
+    } else if (ev->kind == TR_IN) {
+        if (c->fd < 0) {
+            // UDP 录制时没有 OPEN 之前的 IN，这里只是防御
+            replay_open(ev->conn_id);
+            if (c->fd < 0) return;
+        }
+        msg_t msg;
+        size_t len = trace_unpack(ev->data, ev->len, &msg);
+        if (msg.type == 'L') {
+            // 不请求压缩：服务器录的是压缩前的帧，回放时也要收原样的帧才能比对
+            memset(msg.text, 0, sizeof(msg.text));
+        }
+        sent_at[i] = now_ns();
+        if (send(c->fd, &msg, len, MSG_NOSIGNAL) < 0) {
+            perror("send error");
+        }
+    } else if (ev->kind == TR_CLOSE && c->fd >= 0 && proto == TRACE_TCP) {
+        // 只关写方向，剩下的输出还要收完
+        shutdown(c->fd, SHUT_WR);
+    }
+}
+
+static void print_latency(void)
+{
+    if (nlat == 0) {
+        printf("latency: no samples\n");
+        return;
+    }
+    qsort(lat, nlat, sizeof(long long), cmp_ll);
+    double ps[] = {50, 90, 99, 99.9};
+    printf("response latency (%ld samples):", nlat);
+    for (int i = 0; i < 4; i++) {
+        long idx = (long)(ps[i] / 100.0 * (nlat - 1));
+        printf(" p%g=%.0fus", ps[i], lat[idx] / 1e3);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *ip = "127.0.0.1";
+    int port = 8888;
+    double speed = 1;
+    const char *speed_str = "1";
+    double max_diff = 0;
+    int quiet = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:s:d:qv")) != -1) {
+        switch (opt) {
+        case 'h': ip = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 's': speed = atof(optarg); speed_str = optarg; break;
+        case 'd': max_diff = atof(optarg); break;
+        case 'q': quiet = 1; break;
+        case 'v': verbose = 1; break;
+        default:
+            printf("usage:./chat_replay [-h ip] [-p port] [-s speed] [-d pct] [-q] [-v] <trace>\n");
+            return -1;
+        }
+    }
+    if (optind >= argc) {
+        printf("usage:./chat_replay [-h ip] [-p port] [-s speed] [-d pct] [-q] [-v] <trace>\n");
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // 1. 读录制文件
+    if (load_trace(argv[optind]) < 0) return -1;
+    long nin = 0, nout = 0;
+    uint32_t nreplay = 0;
+    for (long i = 0; i < nevents; i++) {
+        if (events[i].kind == TR_IN && conns[events[i].conn_id].skip != 1) nin++;
+    }
+    for (uint32_t i = 0; i < nconns; i++) {
+        if (conns[i].skip == 1) continue;
+        if (conns[i].nexpect > 0 || conns[i].skip == 0) nreplay++;
+        nout += conns[i].nexpect;
+    }
+    double recorded = nevents > 0 ? events[nevents - 1].ts_ns / 1e9 : 0;
+    printf("trace: %s, %u connections, %ld frames in, %ld frames out, %.2fs recorded\n",
+           proto == TRACE_UDP ? "udp" : "tcp", nreplay, nin, nout, recorded);
+
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &saddr.sin_addr);
+    epfd = epoll_create1(0);
+    sent_at = calloc(nevents > 0 ? nevents : 1, sizeof(long long));
+    lat = malloc((nout > 0 ? nout : 1) * sizeof(long long));
+
+    // 2. 按录制时的间隔（除以 speed）回放
+    start_ns = now_ns();
+    for (long i = 0; i < nevents; i++) {
+        if (speed > 0) {
+            long long due = start_ns + (long long)(events[i].ts_ns / speed);
+            long long now;
+            while ((now = now_ns()) < due) {
+                int ms = (due - now) / 1000000;
+                pump(ms > 0 ? ms : 0);
+                if (ms == 0) break; // 不到 1ms 就不等了
+            }
+        }
+        replay_event(i);
+        pump(0);
+    }
+    long long sent_done = now_ns();
+
+    // 3. 收完剩下的输出：所有期望都匹配上、或者 3 秒内什么都没收到就结束
+    //    （连接数超过服务器 listen 队列时，SYN 重传要等 1 秒以上）
+    while (1) {
+        int pending = 0;
+        for (uint32_t i = 0; i < nconns; i++) {
+            if (conns[i].skip != 1 && conns[i].cursor < conns[i].nexpect) pending = 1;
+        }
+        if (!pending || pump(3000) == 0) break;
+    }
+    long long end_ns = now_ns();
+
+    // 4. 报告
+    double took = (sent_done - start_ns) / 1e9;
+    printf("replay: speed %sx, sent in %.2fs (%.2fx recorded), %.0f frames/s, drained in %.2fs\n",
+           speed > 0 ? speed_str : "max", took,
+           took > 0 ? recorded / took : 0, took > 0 ? nin / took : 0,
+           (end_ns - sent_done) / 1e9);
+
+    long matched = 0, missing = 0, unexpected = 0;
+    int shown = 0;
+    for (uint32_t i = 0; i < nconns; i++) {
+        replay_conn_t *c = &conns[i];
+        if (c->skip == 1) continue;
+        long m = 0;
+        for (long j = 0; j < c->nexpect; j++) m += c->expect[j].matched;
+        matched += m;
+        missing += c->nexpect - m;
+        unexpected += c->unexpected;
+        if ((c->nexpect != m || c->unexpected > 0) && !quiet && shown < 10) {
+            printf("  conn %u: %ld expected, %ld missing, %ld unexpected\n",
+                   i, c->nexpect, c->nexpect - m, c->unexpected);
+            shown++;
+        }
+        if (c->fd >= 0) close(c->fd);
+    }
+    double diff = nout > 0 ? 100.0 * (missing + unexpected) / nout : 0;
+    int ok = missing + unexpected == 0 || diff <= max_diff;
+    printf("outputs: %ld matched, %ld missing, %ld unexpected (%.2f%%) -> %s\n",
+           matched, missing, unexpected, diff,
+           missing + unexpected == 0 ? "IDENTICAL" : ok ? "WITHIN TOLERANCE" : "DIVERGED");
+    print_latency();
+    return ok ? 0 : 1;
+}
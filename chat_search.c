@@ -0,0 +1,216 @@
+/* --- chat_search.c (聊天记录检索工具) --- */
+// 用法: ./chat_search -d dir [-u user] [-n max] 查询词...   查询（-u：按这个用户能看到的范围）
+//       ./chat_search -d dir -g count [-U users]            生成 count 条测试消息，建索引
+//       ./chat_search -d dir -b queries [-U users]          随机查询 queries 次，统计延迟
+// dir 就是服务器的 CHAT_HISTORY 目录（服务器停着的时候用，两边不能同时写）。
+// 测试消息：users 个用户，10% 是私聊；正文从一个固定的词表里按 Zipf 分布挑词，
+// 30% 带一段中文，词表由固定的种子生成，所以 -b 查的词和 -g 写的词是同一批。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include "chat_history.h"
+
+#define N_WORDS   20000
+#define N_PHRASES 2000
+
+static const char *hanzi =
+    "的一是在不了有和人这中大为上个国我以要他时来用们生到作地于出就分对成会可主发年动同工也能下过子说"
+    "产种面而方后多定行学法所民得经十三之进着等部度家电力里如水化高自二理起小物现实加量都两体制机当使点"
+    "从业本去把性好应开它合还因由其些然前外天政四日那社义事平形相全表间样与关各重新线内数正心反你明看原"
+    "又么利比或但质气第向道命此变条只没结解问意建月公无系军很情者最立代想已通并提直题党程展五果料象员革";
+
+char words[N_WORDS][12];
+char phrases[N_PHRASES][40];
+double *cdf_words, *cdf_phrases;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Zipf 分布的累积概率表
+static double *zipf_cdf(int n, double s)
+{
+    double *cdf = malloc(sizeof(double) * n), sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        cdf[i] = sum;
+    }
+    for (int i = 0; i < n; i++) {
+        cdf[i] /= sum;
+    }
+    return cdf;
+}
+
+static int zipf_pick(const double *cdf, int n)
+{
+    double r = rand() / (RAND_MAX + 1.0);
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < r) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// 固定种子生成词表
+static void build_vocab(void)
+{
+    srand(1);
+    int nhanzi = strlen(hanzi) / 3; // 都是 3 字节的 UTF-8
+    for (int i = 0; i < N_WORDS; i++) {
+        int len = 3 + rand() % 6;
+        for (int j = 0; j < len; j++) words[i][j] = 'a' + rand() % 26;
+        words[i][len] = '\0';
+    }
+    for (int i = 0; i < N_PHRASES; i++) {
+        int len = 2 + rand() % 5, off = 0;
+        for (int j = 0; j < len; j++) {
+            memcpy(phrases[i] + off, hanzi + 3 * (rand() % nhanzi), 3);
+            off += 3;
+        }
+        phrases[i][off] = '\0';
+    }
+    cdf_words = zipf_cdf(N_WORDS, 1.0);
+    cdf_phrases = zipf_cdf(N_PHRASES, 1.0);
+    srand(time(NULL));
+}
+
+static void generate(long count, int users)
+{
+    char text[128], from[32], to[32];
+    long long start = now_ns();
+    for (long i = 0; i < count; i++) {
+        int len = 0, nwords = 4 + rand() % 10;
+        for (int j = 0; j < nwords && len < 100; j++) {
+            len += snprintf(text + len, sizeof(text) - len, "%s%s", j ? " " : "",
+                            words[zipf_pick(cdf_words, N_WORDS)]);
+        }
+        if (rand() % 10 < 3 && len < 80) {
+            snprintf(text + len, sizeof(text) - len, " %s", phrases[zipf_pick(cdf_phrases, N_PHRASES)]);
+        }
+        snprintf(from, sizeof(from), "u%d", rand() % users);
+        snprintf(to, sizeof(to), "u%d", rand() % users);
+        hist_append(rand() % 10 == 0 ? HIST_PRIVATE : HIST_PUBLIC, from, to, text);
+        if (i % 100000 == 99999) {
+            hist_sync(0); // 别让队列无限变长
+            printf("\r%ld messages", i + 1);
+            fflush(stdout);
+        }
+    }
+    hist_sync(1);
+    double sec = (now_ns() - start) / 1e9;
+    uint32_t docs;
+    int nsegs;
+    uint64_t bytes;
+    hist_stats(&docs, &nsegs, &bytes);
+    printf("\r%ld messages indexed in %.1fs (%.0f/s); total %u messages, %d segments, index %.1f MB\n",
+           count, sec, count / sec, docs, nsegs, bytes / 1048576.0);
+}
+
+static void bench(int nqueries, int users)
+{
+    long long *lat = malloc(sizeof(long long) * nqueries);
+    hist_msg_t hits[10];
+    long total_hits = 0;
+    for (int i = 0; i < nqueries; i++) {
+        char q[128], user[32];
+        int kind = rand() % 10;
+        if (kind < 4) {
+            snprintf(q, sizeof(q), "%s", words[zipf_pick(cdf_words, N_WORDS)]);
+        } else if (kind < 7) {
+            snprintf(q, sizeof(q), "%s %s", words[zipf_pick(cdf_words, N_WORDS)],
+                     words[zipf_pick(cdf_words, N_WORDS)]);
+        } else if (kind < 9) {
+            snprintf(q, sizeof(q), "%s", phrases[zipf_pick(cdf_phrases, N_PHRASES)]);
+        } else {
+            snprintf(q, sizeof(q), "from:u%d %s", rand() % users, words[zipf_pick(cdf_words, N_WORDS)]);
+        }
+        snprintf(user, sizeof(user), "u%d", rand() % users);
+        long long t0 = now_ns();
+        int n = hist_search(user, q, hits, 10);
+        lat[i] = now_ns() - t0;
+        total_hits += n > 0 ? n : 0;
+    }
+    qsort(lat, nqueries, sizeof(long long), cmp_ll);
+    printf("%d queries, %.1f hits/query, latency (ms): p50=%.3f p90=%.3f p99=%.3f max=%.3f\n",
+           nqueries, (double)total_hits / nqueries, lat[nqueries / 2] / 1e6,
+           lat[(int)(nqueries * 0.9)] / 1e6, lat[(int)(nqueries * 0.99)] / 1e6, lat[nqueries - 1] / 1e6);
+    free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = NULL, *user = NULL;
+    long gen = 0;
+    int nbench = 0, users = 1000, max = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:u:n:g:b:U:")) != -1) {
+        switch (opt) {
+        case 'd': dir = optarg; break;
+        case 'u': user = optarg; break;
+        case 'n': max = atoi(optarg); break;
+        case 'g': gen = atol(optarg); break;
+        case 'b': nbench = atoi(optarg); break;
+        case 'U': users = atoi(optarg); break;
+        default: dir = NULL; break;
+        }
+    }
+    if (dir == NULL || (gen == 0 && nbench == 0 && optind >= argc) || max <= 0 || users <= 0) {
+        printf("usage:./chat_search -d dir [-u user] [-n max] words...\n"
+               "      ./chat_search -d dir -g count [-U users]\n"
+               "      ./chat_search -d dir -b queries [-U users]\n");
+        return -1;
+    }
+    if (hist_open(dir) < 0) {
+        return -1;
+    }
+    build_vocab();
+    if (gen > 0) {
+        generate(gen, users);
+    }
+    if (nbench > 0) {
+        bench(nbench, users);
+    }
+    if (optind < argc) {
+        char q[256] = "";
+        for (int i = optind; i < argc; i++) {
+            strncat(q, argv[i], sizeof(q) - strlen(q) - 2);
+            strcat(q, " ");
+        }
+        hist_msg_t *hits = malloc(sizeof(hist_msg_t) * max);
+        if (hits == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        long long t0 = now_ns();
+        int n = hist_search(user, q, hits, max);
+        double ms = (now_ns() - t0) / 1e6;
+        for (int i = 0; i < n; i++) {
+            time_t ts = hits[i].ts;
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&ts));
+            if (hits[i].kind == HIST_PRIVATE) {
+                printf("#%u [%s] %s -> %s: %s\n", hits[i].id, when, hits[i].from, hits[i].to, hits[i].text);
+            } else {
+                printf("#%u [%s] %s: %s\n", hits[i].id, when, hits[i].from, hits[i].text);
+            }
+        }
+        printf("%d results in %.3f ms\n", n < 0 ? 0 : n, ms);
+        free(hits);
+    }
+    hist_sync(0);
+    return 0;
+}
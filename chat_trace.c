@@ -0,0 +1,248 @@
+/* --- chat_trace.c (流量录制) --- */
+// 所有线程把记录追加到同一块内存缓冲区（加锁），缓冲区满了或每隔 100ms
+// 由后台线程写进文件。进程被杀时最多丢最后 100ms 的记录。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "chat_trace.h"
+
+#define TRACE_BUF_SIZE (256 * 1024)
+#define MSG_SIZE 161 // sizeof(msg_t)：type(1) + id(32) + text(128)
+
+int trace_on;
+static int trace_fd = -1;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t trace_buf[TRACE_BUF_SIZE];
+static size_t trace_len;
+static uint64_t trace_start; // 单调时钟起点
+
+// UDP 地址 -> 编号（开放寻址）
+typedef struct
+{
+    uint64_t key; // ip << 16 | port，0 表示空
+    uint32_t id;
+} udp_slot_t;
+static udp_slot_t *udp_slots;
+static size_t udp_cap, udp_count;
+static uint32_t next_id;
+
+static uint64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// (持有 trace_mutex) 把缓冲区写进文件
+static void trace_flush_locked(void)
+{
+    size_t off = 0;
+    while (off < trace_len) {
+        ssize_t n = write(trace_fd, trace_buf + off, trace_len - off);
+        if (n <= 0) {
+            perror("trace write error");
+            break;
+        }
+        off += n;
+    }
+    trace_len = 0;
+}
+
+static void *trace_flusher(void *arg)
+{
+    (void)arg;
+    while (1) {
+        usleep(100 * 1000);
+        pthread_mutex_lock(&trace_mutex);
+        trace_flush_locked();
+        pthread_mutex_unlock(&trace_mutex);
+    }
+    return NULL;
+}
+
+int trace_open(const char *path, int proto)
+{
+    if (path == NULL || path[0] == '\0') {
+        return 0;
+    }
+    trace_fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (trace_fd < 0) {
+        perror("open trace error");
+        return -1;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    trace_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    hdr.version = TRACE_VERSION;
+    hdr.proto = proto;
+    hdr.start_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        perror("write trace error");
+        return -1;
+    }
+    trace_start = mono_ns();
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, trace_flusher, NULL) != 0) {
+        perror("pthread_create (trace) error");
+        return -1;
+    }
+    pthread_detach(tid);
+    trace_on = 1;
+    printf("recording traffic to %s\n", path);
+    return 0;
+}
+
+// (持有 trace_mutex) 追加一条记录
+static void trace_append(uint32_t conn_id, uint8_t kind, const void *data, size_t len)
+{
+    trace_rec_t rec;
+    rec.ts_ns = mono_ns() - trace_start;
+    rec.conn_id = conn_id;
+    rec.kind = kind;
+    rec.len = len;
+    if (trace_len + sizeof(rec) + len > TRACE_BUF_SIZE) {
+        trace_flush_locked();
+    }
+    memcpy(trace_buf + trace_len, &rec, sizeof(rec));
+    memcpy(trace_buf + trace_len + sizeof(rec), data, len);
+    trace_len += sizeof(rec) + len;
+}
+
+void trace_conn_open(uint32_t conn_id)
+{
+    if (!trace_on) return;
+    pthread_mutex_lock(&trace_mutex);
+    trace_append(conn_id, TR_OPEN, NULL, 0);
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void trace_conn_close(uint32_t conn_id)
+{
+    if (!trace_on) return;
+    pthread_mutex_lock(&trace_mutex);
+    trace_append(conn_id, TR_CLOSE, NULL, 0);
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void trace_in(uint32_t conn_id, const void *frame, size_t len)
+{
+    if (!trace_on) return;
+    uint8_t packed[MSG_SIZE + 4];
+    if (len > MSG_SIZE) len = MSG_SIZE; // 入方向只录 msg_t
+    size_t n = trace_pack(frame, len, packed);
+    pthread_mutex_lock(&trace_mutex);
+    trace_append(conn_id, TR_IN, packed, n);
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void trace_out(uint32_t conn_id, const void *frame, size_t len)
+{
+    if (!trace_on) return;
+    uint64_t h = trace_hash(frame, len);
+    pthread_mutex_lock(&trace_mutex);
+    trace_append(conn_id, TR_OUT, &h, sizeof(h));
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+uint32_t trace_udp_id(const struct sockaddr_in *addr)
+{
+    if (!trace_on) return 0;
+    uint64_t key = (uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port;
+    key |= 1ull << 63; // 保证不为 0
+
+    pthread_mutex_lock(&trace_mutex);
+    if (udp_count * 2 >= udp_cap) {
+        // 扩容并重新插入
+        size_t cap = udp_cap ? udp_cap * 2 : 1024;
+        udp_slot_t *slots = calloc(cap, sizeof(udp_slot_t));
+        for (size_t i = 0; i < udp_cap; i++) {
+            if (udp_slots[i].key == 0) continue;
+            size_t j = udp_slots[i].key % cap;
+            while (slots[j].key != 0) j = (j + 1) % cap;
+            slots[j] = udp_slots[i];
+        }
+        free(udp_slots);
+        udp_slots = slots;
+        udp_cap = cap;
+    }
+    size_t i = key % udp_cap;
+    while (udp_slots[i].key != 0 && udp_slots[i].key != key) {
+        i = (i + 1) % udp_cap;
+    }
+    if (udp_slots[i].key == 0) {
+        udp_slots[i].key = key;
+        udp_slots[i].id = ++next_id;
+        udp_count++;
+        trace_append(udp_slots[i].id, TR_OPEN, NULL, 0);
+    }
+    uint32_t id = udp_slots[i].id;
+    pthread_mutex_unlock(&trace_mutex);
+    return id;
+}
+
+// msg_t 帧：'M' type idlen id textlen text；其它长度的帧原样存放：'R' 内容
+size_t trace_pack(const void *frame, size_t len, uint8_t *out)
+{
+    const uint8_t *p = (const uint8_t *)frame;
+    if (len != MSG_SIZE) {
+        out[0] = 'R';
+        memcpy(out + 1, p, len);
+        return len + 1;
+    }
+    size_t idlen = strnlen((const char *)p + 1, 32);
+    size_t textlen = strnlen((const char *)p + 33, 128);
+    size_t n = 0;
+    out[n++] = 'M';
+    out[n++] = p[0];
+    out[n++] = idlen;
+    memcpy(out + n, p + 1, idlen);
+    n += idlen;
+    out[n++] = textlen;
+    memcpy(out + n, p + 33, textlen);
+    n += textlen;
+    return n;
+}
+
+size_t trace_unpack(const uint8_t *in, size_t len, void *frame)
+{
+    uint8_t *p = (uint8_t *)frame;
+    if (len == 0) {
+        return 0;
+    }
+    if (in[0] == 'R') {
+        memcpy(p, in + 1, len - 1);
+        return len - 1;
+    }
+    memset(p, 0, MSG_SIZE);
+    p[0] = in[1];
+    size_t idlen = in[2];
+    memcpy(p + 1, in + 3, idlen);
+    size_t textlen = in[3 + idlen];
+    memcpy(p + 33, in + 4 + idlen, textlen);
+    return MSG_SIZE;
+}
+
+// FNV-1a，msg_t 帧先压缩再算，这样 '\0' 之后的填充内容不影响比对
+uint64_t trace_hash(const void *frame, size_t len)
+{
+    uint8_t packed[MSG_SIZE + 4];
+    const uint8_t *p = (const uint8_t *)frame;
+    if (len == MSG_SIZE) {
+        len = trace_pack(frame, len, packed);
+        p = packed;
+    }
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
@@ -0,0 +1,61 @@
+/* --- chat_trace.h (流量录制格式) --- */
+#ifndef CHAT_TRACE_H
+#define CHAT_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+// 文件格式：一个文件头，后面是一条条记录
+//   文件头  trace_hdr_t
+//   记录    trace_rec_t + len 字节内容
+// 入方向的帧压缩存放：type(1) idlen(1) id textlen(1) text，'\0' 之后的填充不存；
+// 出方向只存 8 字节哈希，回放时用来比对输出是否一致。
+
+#define TRACE_MAGIC   0x52544843u // "CHTR"
+#define TRACE_VERSION 1
+
+#define TRACE_TCP 1
+#define TRACE_UDP 2
+
+// 记录类型
+#define TR_OPEN  1 // 新连接（UDP：第一次见到这个地址）
+#define TR_IN    2 // 收到一帧
+#define TR_OUT   3 // 发出一帧（只有哈希）
+#define TR_CLOSE 4 // 连接关闭
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint8_t proto;      // TRACE_TCP / TRACE_UDP
+    uint8_t reserved;
+    uint64_t start_ns;  // 开始录制的墙上时间，只用于显示
+} trace_hdr_t;
+
+typedef struct __attribute__((packed))
+{
+    uint64_t ts_ns;     // 距开始录制的纳秒数
+    uint32_t conn_id;
+    uint8_t kind;       // TR_OPEN / TR_IN / TR_OUT / TR_CLOSE
+    uint16_t len;       // 后面内容的字节数
+} trace_rec_t;
+
+// 录制（服务器用）。path 为 NULL 时不录制，其余函数都是空操作
+int trace_open(const char *path, int proto);
+extern int trace_on;
+
+void trace_conn_open(uint32_t conn_id);
+void trace_conn_close(uint32_t conn_id);
+void trace_in(uint32_t conn_id, const void *frame, size_t len);
+void trace_out(uint32_t conn_id, const void *frame, size_t len);
+
+// UDP 没有连接：按客户端地址分配一个稳定的编号，第一次见到时记一条 TR_OPEN
+uint32_t trace_udp_id(const struct sockaddr_in *addr);
+
+// 编解码（回放工具也用）
+size_t trace_pack(const void *frame, size_t len, uint8_t *out);   // 返回压缩后的长度
+size_t trace_unpack(const uint8_t *in, size_t len, void *frame);  // 还原成完整的帧
+uint64_t trace_hash(const void *frame, size_t len);
+
+#endif
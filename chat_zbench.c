@@ -0,0 +1,435 @@
+/* --- chat_zbench.c (压缩评估工具) --- */
+// 用法: ./chat_zbench (-r trace | -d dir) [-n max] [-b burst] [-l level] [-B kbps,...] [-s] [-o dict]
+// 拿录下来的聊天（-r：CHAT_TRACE 录的流量；-d：CHAT_HISTORY 目录，最多读最近 max 条）
+// 排成服务器真正会发的帧，评估压缩的效果：
+//   补发记录：每 burst 条（默认 50）做成一批 "History" 帧，和登录时补发的一样
+//   在线名单：语料里出现过的所有人做成一份完整的 \who 回复
+// 每种数据分别用这几种方式压一遍，解压回来逐字节核对：
+//   nodict  每批一个新的流，不带字典
+//   dict    每批一个新的流，带字典（连接上的第一批，服务器就是这样开始的）
+//   stream  所有批次共用一个流（同一个连接后面的批次能引用前面的内容）
+// 报告压缩率、每 MB 原始数据的压缩/解压 CPU 时间，以及在几种带宽下一批从开始压缩到
+// 解压完要多久（传输时间 + 两边的 CPU）。
+// -s：只用语料的后一半评估；-o 文件：用前一半训练一个字典写到文件里（配合 -s 和 CHAT_ZDICT 对比）。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "chat_trace.h"
+#include "chat_history.h"
+#include "chat_zlib.h"
+
+typedef struct
+{
+    char type;
+    char id[32];
+    char text[128];
+} msg_t;
+
+hist_msg_t *corpus;
+long ncorpus;
+int level = 6;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void corpus_add(uint32_t ts, int kind, const char *from, const char *to, const char *text)
+{
+    static long cap;
+    if (ncorpus == cap) {
+        cap = cap ? cap * 2 : 4096;
+        corpus = realloc(corpus, sizeof(hist_msg_t) * cap);
+    }
+    hist_msg_t *m = &corpus[ncorpus];
+    memset(m, 0, sizeof(*m));
+    m->id = ncorpus++;
+    m->ts = ts;
+    m->kind = kind;
+    snprintf(m->from, sizeof(m->from), "%s", from);
+    snprintf(m->to, sizeof(m->to), "%s", to);
+    snprintf(m->text, sizeof(m->text), "%s", text);
+}
+
+// 录下的流量：入方向的群聊和私聊，发送者按连接的登录包对上
+static int load_trace(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror("open trace error"); return -1;
+    }
+    trace_hdr_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+        printf("not a chat trace (or wrong version)\n");
+        fclose(fp);
+        return -1;
+    }
+    char (*names)[32] = NULL;
+    uint32_t nnames = 0;
+    trace_rec_t rec;
+    uint8_t data[65536];
+    while (fread(&rec, sizeof(rec), 1, fp) == 1 && fread(data, 1, rec.len, fp) == rec.len) {
+        if (rec.kind != TR_IN) continue;
+        msg_t msg;
+        if (trace_unpack(data, rec.len, &msg) != sizeof(msg)) continue;
+        msg.id[sizeof(msg.id) - 1] = '\0';
+        msg.text[sizeof(msg.text) - 1] = '\0';
+        if (rec.conn_id >= nnames) {
+            uint32_t n = rec.conn_id * 2 + 16;
+            names = realloc(names, sizeof(*names) * n);
+            memset(names + nnames, 0, sizeof(*names) * (n - nnames));
+            nnames = n;
+        }
+        uint32_t ts = (hdr.start_ns + rec.ts_ns) / 1000000000ULL;
+        char to[32], text[128];
+        if (msg.type == 'L') {
+            snprintf(names[rec.conn_id], sizeof(names[0]), "%s", msg.id);
+        } else if (msg.type == 'C' && names[rec.conn_id][0] != '\0') {
+            corpus_add(ts, HIST_PUBLIC, names[rec.conn_id], "", msg.text);
+        } else if (msg.type == 'P' && names[rec.conn_id][0] != '\0' &&
+                   sscanf(msg.text, "%31s %127[^\n]", to, text) == 2) {
+            corpus_add(ts, HIST_PRIVATE, names[rec.conn_id], to, text);
+        }
+    }
+    free(names);
+    fclose(fp);
+    return 0;
+}
+
+// 聊天记录目录：最近 max 条，按时间从旧到新
+static int load_history(const char *dir, long max)
+{
+    if (hist_open(dir) < 0) {
+        return -1;
+    }
+    hist_msg_t *recent = malloc(sizeof(hist_msg_t) * max);
+    if (recent == NULL) {
+        perror("malloc"); return -1;
+    }
+    int n = hist_recent(NULL, recent, max);
+    for (int i = n - 1; i >= 0; i--) {
+        hist_msg_t *m = &recent[i];
+        corpus_add(m->ts, m->kind, m->from, m->to, m->text);
+    }
+    free(recent);
+    return 0;
+}
+
+// ---------------- 做成帧 ----------------
+
+static void replay_frame(const hist_msg_t *m, msg_t *f)
+{
+    memset(f, 0, sizeof(*f));
+    f->type = 'C';
+    strcpy(f->id, "History");
+    hist_format(m, f->text, sizeof(f->text));
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+    return strcmp((const char *)a, (const char *)b);
+}
+
+// 和服务器 do_who 一样拼：第一帧带标题，一帧放不下就换下一帧
+static msg_t *roster_frames(const hist_msg_t *msgs, long n, int *nframes)
+{
+    char (*names)[32] = malloc(sizeof(*names) * (n + 1));
+    for (long i = 0; i < n; i++) {
+        memcpy(names[i], msgs[i].from, sizeof(names[0]));
+    }
+    qsort(names, n, sizeof(names[0]), cmp_name);
+    msg_t *frames = calloc(n + 1, sizeof(msg_t));
+    int k = 0;
+    frames[0].type = 'C';
+    strcpy(frames[0].id, "Server");
+    strcpy(frames[0].text, "--- Online Users ---\n");
+    size_t len = strlen(frames[0].text);
+    for (long i = 0; i < n; i++) {
+        if (i > 0 && strcmp(names[i], names[i - 1]) == 0) continue;
+        size_t idlen = strlen(names[i]);
+        if (len + idlen + 2 > sizeof(frames[k].text)) {
+            k++;
+            frames[k].type = 'C';
+            strcpy(frames[k].id, "Server");
+            len = 0;
+        }
+        memcpy(frames[k].text + len, names[i], idlen);
+        frames[k].text[len + idlen] = '\n';
+        len += idlen + 1;
+    }
+    free(names);
+    *nframes = k + 1;
+    return frames;
+}
+
+// ---------------- 压缩 ----------------
+
+#define M_NODICT 0
+#define M_DICT   1
+#define M_STREAM 2
+static const char *mode_names[] = { "nodict", "dict", "stream" };
+
+static zc_t *zc_new_nodict(void)
+{
+    zc_t *z = calloc(1, sizeof(zc_t));
+    if (deflateInit2(&z->s, level, Z_DEFLATED, ZWINDOW_BITS, ZMEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+typedef struct
+{
+    unsigned char *buf;
+    size_t len;
+} sink_t;
+
+static void on_frame(const void *frame, void *arg)
+{
+    sink_t *s = (sink_t *)arg;
+    memcpy(s->buf + s->len, frame, sizeof(msg_t));
+    s->len += sizeof(msg_t);
+}
+
+static double kbps[8] = { 256, 1000, 10000 };
+static int nkbps = 3;
+
+// 一种数据：nb 批，第 i 批是 bursts[i] 开始的 counts[i] 帧
+static void bench(const char *what, msg_t **bursts, int *counts, int nb)
+{
+    size_t raw = 0, maxlen = 0;
+    for (int i = 0; i < nb; i++) {
+        raw += counts[i] * sizeof(msg_t);
+        if (counts[i] * sizeof(msg_t) > maxlen) maxlen = counts[i] * sizeof(msg_t);
+    }
+    printf("\n%s: %d burst(s), %.0f frames / %.0f bytes each on average\n", what, nb,
+           (double)raw / sizeof(msg_t) / nb, (double)raw / nb);
+    printf("%-8s %7s %11s %11s %11s", "mode", "ratio", "bytes/burst", "comp ms/MB", "dec ms/MB");
+    for (int k = 0; k < nkbps; k++) {
+        char col[32];
+        snprintf(col, sizeof(col), "@%gkbit/s", kbps[k]);
+        printf(" %12s", col);
+    }
+    printf("\n");
+    printf("%-8s %7.2f %11.0f %11s %11s", "raw", 1.0, (double)raw / nb, "-", "-");
+    for (int k = 0; k < nkbps; k++) {
+        printf(" %10.1fms", raw * 8.0 / kbps[k] / nb);
+    }
+    printf("\n");
+
+    unsigned char *out = malloc(maxlen * 2 + 1024);
+    sink_t sink = { malloc(maxlen + sizeof(msg_t)), 0 };
+    for (int mode = 0; mode < 3; mode++) {
+        zc_t *zs = NULL;
+        zd_t *zds = NULL;
+        long long comp_ns = 0, dec_ns = 0;
+        size_t wire = 0;
+        int bad = 0;
+        for (int i = 0; i < nb; i++) {
+            size_t len = counts[i] * sizeof(msg_t);
+            long long t0 = now_ns();
+            zc_t *z = zs;
+            if (z == NULL) {
+                z = mode == M_NODICT ? zc_new_nodict() : zc_new(level);
+            }
+            size_t n = zc_frame(z, bursts[i], len, out);
+            long long t1 = now_ns();
+            zd_t *d = zds != NULL ? zds : zd_new(sizeof(msg_t));
+            sink.len = 0;
+            if (n == 0 || zd_feed(d, out + ZFRAME_HDR, n - ZFRAME_HDR, on_frame, &sink) < 0 ||
+                sink.len != len || memcmp(sink.buf, bursts[i], len) != 0) {
+                bad++;
+            }
+            long long t2 = now_ns();
+            comp_ns += t1 - t0;
+            dec_ns += t2 - t1;
+            wire += n;
+            if (mode == M_STREAM) {
+                zs = z;
+                zds = d;
+            } else {
+                zc_free(z);
+                zd_free(d);
+            }
+        }
+        zc_free(zs);
+        zd_free(zds);
+        double mb = raw / 1048576.0;
+        printf("%-8s %7.2f %11.0f %11.2f %11.2f", mode_names[mode], (double)raw / wire, (double)wire / nb,
+               comp_ns / 1e6 / mb, dec_ns / 1e6 / mb);
+        for (int k = 0; k < nkbps; k++) {
+            printf(" %10.1fms", (wire * 8.0 / kbps[k] + (comp_ns + dec_ns) / 1e6) / nb);
+        }
+        printf(bad ? "  %d MISMATCH\n" : "\n", bad);
+    }
+    free(out);
+    free(sink.buf);
+}
+
+// ---------------- 训练字典 ----------------
+
+// 从语料的正文里数“词 + 后面的空格”和“发送者: ”出现的次数，按 次数 × 长度 挑，
+// 排在字典前面，内置的帧模板排在最后（最常用，离得最近）
+typedef struct
+{
+    char s[48];
+    int len;
+    long count;
+} tok_t;
+
+static tok_t *toks;
+static size_t tok_cap = 1 << 20, ntoks;
+
+static void tok_add(const char *s, int len)
+{
+    if (len < 3 || len >= (int)sizeof(toks[0].s)) return;
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) h = (h ^ (uint8_t)s[i]) * 16777619u;
+    size_t i = h & (tok_cap - 1);
+    while (toks[i].len != 0 && (toks[i].len != len || memcmp(toks[i].s, s, len) != 0)) {
+        i = (i + 1) & (tok_cap - 1);
+    }
+    if (toks[i].len == 0) {
+        if (ntoks * 2 > tok_cap) return; // 满了：后面的新词不要了
+        memcpy(toks[i].s, s, len);
+        toks[i].len = len;
+        ntoks++;
+    }
+    toks[i].count++;
+}
+
+static int tok_score_cmp(const void *a, const void *b)
+{
+    const tok_t *x = (const tok_t *)a, *y = (const tok_t *)b;
+    long sx = x->count * x->len, sy = y->count * y->len;
+    return sx < sy ? 1 : sx > sy ? -1 : 0;
+}
+
+static int train(const hist_msg_t *msgs, long n, const char *path)
+{
+    toks = calloc(tok_cap, sizeof(tok_t));
+    for (long i = 0; i < n; i++) {
+        msg_t f;
+        replay_frame(&msgs[i], &f);
+        const char *t = f.text;
+        const char *colon = strstr(t, "] ");
+        if (colon != NULL) {
+            const char *end = strstr(colon, ": ");
+            if (end != NULL) tok_add(colon + 2, end + 2 - (colon + 2)); // "发送者: "
+        }
+        const char *body = colon != NULL && strstr(colon, ": ") ? strstr(colon, ": ") + 2 : t;
+        while (*body) {
+            const char *sp = strchr(body, ' ');
+            int len = sp != NULL ? sp + 1 - body : (int)strlen(body);
+            tok_add(body, len);
+            body += len;
+        }
+    }
+    qsort(toks, tok_cap, sizeof(tok_t), tok_score_cmp);
+
+    size_t tlen;
+    const unsigned char *tmpl = zdict_get(&tlen);
+    size_t budget = ZDICT_MAX - tlen, used = 0;
+    int k = 0;
+    while (k < (int)tok_cap && toks[k].count >= 2 && used + toks[k].len <= budget) {
+        used += toks[k++].len;
+    }
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror("open dict error");
+        return -1;
+    }
+    for (int i = k - 1; i >= 0; i--) { // 分数高的放后面
+        fwrite(toks[i].s, 1, toks[i].len, fp);
+    }
+    fwrite(tmpl, 1, tlen, fp);
+    fclose(fp);
+    printf("dictionary %s: %d tokens (%zu bytes) + %zu bytes of frame templates, trained on %ld messages\n",
+           path, k, used, tlen, n);
+    free(toks);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *trace = NULL, *dir = NULL, *dict_out = NULL;
+    long max = 200000;
+    int burst = 50, second_half = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:n:b:l:B:so:")) != -1) {
+        switch (opt) {
+        case 'r': trace = optarg; break;
+        case 'd': dir = optarg; break;
+        case 'n': max = atol(optarg); break;
+        case 'b': burst = atoi(optarg); break;
+        case 'l': level = atoi(optarg); break;
+        case 'B':
+            nkbps = 0;
+            for (char *p = strtok(optarg, ","); p != NULL && nkbps < 8; p = strtok(NULL, ",")) {
+                kbps[nkbps++] = atof(p);
+            }
+            break;
+        case 's': second_half = 1; break;
+        case 'o': dict_out = optarg; break;
+        default: trace = dir = NULL; break;
+        }
+    }
+    if ((trace == NULL) == (dir == NULL) || max <= 0 || burst <= 0 || nkbps == 0) {
+        printf("usage:./chat_zbench (-r trace | -d dir) [-n max] [-b burst] [-l level] [-B kbps,...] [-s] [-o dict]\n");
+        return -1;
+    }
+    if ((trace != NULL ? load_trace(trace) : load_history(dir, max)) < 0) {
+        return -1;
+    }
+    if (ncorpus < 2) {
+        printf("no chat messages in the corpus\n");
+        return -1;
+    }
+    if (dict_out != NULL) {
+        return train(corpus, ncorpus / 2, dict_out) < 0 ? -1 : 0;
+    }
+
+    hist_msg_t *msgs = corpus;
+    long n = ncorpus;
+    if (second_half) {
+        msgs += ncorpus / 2;
+        n -= ncorpus / 2;
+    }
+    size_t dlen;
+    zdict_get(&dlen);
+    printf("%ld messages, level %d, %d-bit window, dictionary %08x (%zu bytes%s)\n", n, level,
+           ZWINDOW_BITS, zdict_id(), dlen, getenv("CHAT_ZDICT") != NULL ? ", CHAT_ZDICT" : ", built-in");
+
+    // 补发记录：每 burst 条一批
+    int nb = (n + burst - 1) / burst;
+    msg_t *frames = malloc(sizeof(msg_t) * n);
+    msg_t **bursts = malloc(sizeof(msg_t *) * nb);
+    int *counts = malloc(sizeof(int) * nb);
+    for (long i = 0; i < n; i++) {
+        replay_frame(&msgs[i], &frames[i]);
+    }
+    for (int i = 0; i < nb; i++) {
+        bursts[i] = &frames[(long)i * burst];
+        counts[i] = (long)(i + 1) * burst <= n ? burst : n - (long)i * burst;
+    }
+    bench("history replay", bursts, counts, nb);
+
+    // 在线名单：一整份
+    int nr;
+    msg_t *roster = roster_frames(msgs, n, &nr);
+    bench("roster (\\who)", &roster, &nr, 1);
+
+    free(roster);
+    free(frames);
+    free(bursts);
+    free(counts);
+    return 0;
+}
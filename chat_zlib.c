@@ -0,0 +1,186 @@
+/* --- chat_zlib.c (压缩帧) --- */
+// 服务器、客户端库、chat_zbench 共用。字典、'Z' 帧的格式见 chat_zlib.h。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "chat_zlib.h"
+
+// 内置字典里的帧模板：和真实的帧一样是 type + id[32] + text[128]，后面补 0。
+// 越常见的越往后放，离得近的匹配编码更短
+static const struct { char type; const char *id, *text; } ztemplates[] = {
+    { 'F', "Server", "UP " },
+    { 'C', "Server", "服务器没有开启聊天记录" },
+    { 'C', "Server", "发送过快，消息已被丢弃" },
+    { 'C', "Server", "User '' not found." },
+    { 'R', "#1", "ok" },
+    { 'C', "Search", " result(s) for '" },
+    { 'C', "Server", " 已下线" },
+    { 'C', "Server", " 已上线" },
+    { 'C', "Server", "--- Online Users ---\n" },
+    { 'C', "History", "[01-01 00:00] " },
+    { 'C', " (private)", "" },
+};
+
+#define TEMPLATE_SIZE 161 // sizeof(msg_t)
+
+static unsigned char zdict[ZDICT_MAX];
+static size_t zdict_len;
+static uint32_t zdict_adler;
+static pthread_once_t zdict_once = PTHREAD_ONCE_INIT;
+
+static void zdict_load(void)
+{
+    const char *path = getenv("CHAT_ZDICT");
+    if (path != NULL && path[0] != '\0') {
+        FILE *fp = fopen(path, "rb");
+        if (fp != NULL) {
+            zdict_len = fread(zdict, 1, sizeof(zdict), fp);
+            fclose(fp);
+        } else {
+            perror("open CHAT_ZDICT error"); // 用内置字典，对方也是内置的就还能压缩
+        }
+    }
+    if (zdict_len == 0) {
+        for (size_t i = 0; i < sizeof(ztemplates) / sizeof(ztemplates[0]); i++) {
+            unsigned char *f = zdict + zdict_len;
+            memset(f, 0, TEMPLATE_SIZE);
+            f[0] = ztemplates[i].type;
+            strncpy((char *)f + 1, ztemplates[i].id, 31);
+            strncpy((char *)f + 33, ztemplates[i].text, 127);
+            zdict_len += TEMPLATE_SIZE;
+        }
+    }
+    zdict_adler = adler32(adler32(0, NULL, 0), zdict, zdict_len);
+}
+
+const unsigned char *zdict_get(size_t *len)
+{
+    pthread_once(&zdict_once, zdict_load);
+    *len = zdict_len;
+    return zdict;
+}
+
+uint32_t zdict_id(void)
+{
+    pthread_once(&zdict_once, zdict_load);
+    return zdict_adler;
+}
+
+zc_t *zc_new(int level)
+{
+    size_t dlen;
+    const unsigned char *dict = zdict_get(&dlen);
+    zc_t *z = calloc(1, sizeof(zc_t));
+    if (z == NULL) {
+        return NULL;
+    }
+    if (deflateInit2(&z->s, level, Z_DEFLATED, ZWINDOW_BITS, ZMEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(z);
+        return NULL;
+    }
+    if (deflateSetDictionary(&z->s, dict, dlen) != Z_OK) {
+        deflateEnd(&z->s);
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+void zc_free(zc_t *z)
+{
+    if (z == NULL) return;
+    deflateEnd(&z->s);
+    free(z);
+}
+
+size_t zc_bound(const zc_t *z, size_t len)
+{
+    // deflateBound 不算 Z_SYNC_FLUSH 的空块和第一帧的 zlib 头，多留一点
+    return ZFRAME_HDR + deflateBound((z_streamp)&z->s, len) + 16;
+}
+
+size_t zc_frame(zc_t *z, const void *data, size_t len, unsigned char *out)
+{
+    size_t cap = zc_bound(z, len) - ZFRAME_HDR;
+    z->s.next_in = (unsigned char *)data;
+    z->s.avail_in = len;
+    z->s.next_out = out + ZFRAME_HDR;
+    z->s.avail_out = cap;
+    if (deflate(&z->s, Z_SYNC_FLUSH) != Z_OK || z->s.avail_in != 0 || z->s.avail_out == 0) {
+        return 0; // avail_out 用完说明可能还有没吐出来的数据
+    }
+    size_t n = cap - z->s.avail_out;
+    uint32_t be = htonl(n);
+    out[0] = 'Z';
+    memcpy(out + 1, &be, 4);
+    z->raw += len;
+    z->wire += ZFRAME_HDR + n;
+    return ZFRAME_HDR + n;
+}
+
+zd_t *zd_new(size_t frame_size)
+{
+    zd_t *z = calloc(1, sizeof(zd_t));
+    if (z == NULL || frame_size > sizeof(z->part)) {
+        free(z);
+        return NULL;
+    }
+    if (inflateInit2(&z->s, ZWINDOW_BITS) != Z_OK) {
+        free(z);
+        return NULL;
+    }
+    z->frame_size = frame_size;
+    return z;
+}
+
+void zd_free(zd_t *z)
+{
+    if (z == NULL) return;
+    inflateEnd(&z->s);
+    free(z);
+}
+
+int zd_feed(zd_t *z, const void *data, size_t len, zd_frame_cb cb, void *arg)
+{
+    unsigned char out[4096];
+    z->s.next_in = (unsigned char *)data;
+    z->s.avail_in = len;
+    for (;;) {
+        z->s.next_out = out;
+        z->s.avail_out = sizeof(out);
+        int ret = inflate(&z->s, Z_SYNC_FLUSH);
+        if (ret == Z_NEED_DICT) {
+            size_t dlen;
+            const unsigned char *dict = zdict_get(&dlen);
+            if (inflateSetDictionary(&z->s, dict, dlen) != Z_OK) {
+                return -1; // 字典对不上
+            }
+            ret = inflate(&z->s, Z_SYNC_FLUSH);
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return -1;
+        }
+        size_t n = sizeof(out) - z->s.avail_out;
+        if (n == 0 && ret == Z_BUF_ERROR) {
+            break; // 输入都吃进去了，还不够吐出新数据
+        }
+        // 切帧：跨两次输出的帧先攒在 part 里
+        for (size_t off = 0; off < n;) {
+            size_t take = z->frame_size - z->have;
+            if (take > n - off) take = n - off;
+            memcpy(z->part + z->have, out + off, take);
+            z->have += take;
+            off += take;
+            if (z->have == z->frame_size) {
+                z->have = 0;
+                cb(z->part, arg);
+            }
+        }
+        if (z->s.avail_in == 0 && z->s.avail_out > 0) {
+            break; // 输出没写满说明里面也没有剩的了
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+/* --- chat_zlib.h (压缩帧) --- */
+#ifndef CHAT_ZLIB_H
+#define CHAT_ZLIB_H
+
+// 服务器一次发给一个人的一大批帧（登录时补发的聊天记录、完整的在线名单、搜索结果）可以压缩：
+//   1. 客户端登录包 'L' 的 text 填 "zlib <字典编号>"；服务器开了压缩、字典也对得上，
+//      之后就可能收到 'Z' 帧。老客户端 text 是空的，永远收不到
+//   2. 'Z' 帧 = 'Z' + 4 字节长度（网络字节序）+ 压缩数据，解压出来是若干个完整的 msg_t 帧
+//   3. 每个连接一个 deflate 流（zlib 格式），后面的批次可以引用前面的内容；
+//      每批末尾 Z_SYNC_FLUSH，收到一个 'Z' 帧就能把这一批全部解出来
+//   4. 两边预先装同一份字典（帧模板、服务器的提示语），第一批就有东西可以引用。
+//      默认用内置字典；CHAT_ZDICT=文件 换成 chat_zbench -o 从录下的聊天里训练出的字典，两边要用同一份
+// 只用于 TCP：UDP 会丢包乱序，没法共用一个流。
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#define ZFRAME_HDR   5         // 'Z' + 长度
+#define ZFRAME_MAX   (1 << 20) // 一个 'Z' 帧压缩后最大
+#define ZWINDOW_BITS 13        // 8KB 窗口：每个连接压缩端约 64KB 内存，解压端约 10KB
+#define ZMEM_LEVEL   6
+#define ZDICT_MAX    ((1 << ZWINDOW_BITS) - 262) // 字典再长也用不上
+
+// 字典：第一次调用时加载（CHAT_ZDICT 或内置），之后只读，哪个线程都可以用
+const unsigned char *zdict_get(size_t *len);
+uint32_t zdict_id(void); // 字典的 adler32，登录时核对
+
+// 压缩端（一个连接一个，不能同时在两个线程里用）
+typedef struct
+{
+    z_stream s;
+    unsigned long long raw, wire; // 累计压缩前 / 后的字节数
+} zc_t;
+
+zc_t *zc_new(int level);
+void zc_free(zc_t *z);
+size_t zc_bound(const zc_t *z, size_t len); // zc_frame 需要的缓冲区大小
+// 把 len 字节压成一个完整的 'Z' 帧（含帧头）写进 out，返回帧长；出错返回 0，之后这个流不能再用
+size_t zc_frame(zc_t *z, const void *data, size_t len, unsigned char *out);
+
+// 解压端：压缩数据可以分成任意几段喂进来，每解出一个完整的 frame_size 字节的帧回调一次
+typedef void (*zd_frame_cb)(const void *frame, void *arg);
+typedef struct
+{
+    z_stream s;
+    size_t frame_size;
+    size_t have;           // part 里凑了多少字节
+    unsigned char part[256];
+} zd_t;
+
+zd_t *zd_new(size_t frame_size);
+void zd_free(zd_t *z);
+int zd_feed(zd_t *z, const void *data, size_t len, zd_frame_cb cb, void *arg); // 出错返回 -1
+
+#endif
@@ -6,17 +6,107 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
 #include <unistd.h>
-#include <signal.h>
- 
-typedef struct
+#include "chat_client.h"
+
+// 收发都交给客户端库的事件循环：键盘输入一行处理一行，服务器的消息在回调里打印。
+// 服务器启用组播时，库会自动加入组播组并回 'M'
+chat_loop_t *loop;
+chat_conn_t *conn; //输入 id 之后才创建
+const char *server_ip;
+int server_port;
+int done;
+
+// \who 和 \msg 的回复
+void on_reply(chat_conn_t *c, int status, const char *text, void *arg)
 {
-    char type;      //消息类型 L C Q
-    char id[32];    //用户id
-    char text[128]; //消息内容
-} msg_t;
- 
+    (void)c;
+    (void)arg;
+    if (status == CHAT_TIMEOUT)
+    {
+        printf("请求超时（UDP 可能丢包）\n");
+    }
+    else if (status == CHAT_OK && strcmp(text, "ok") != 0) //私聊成功不用提示
+    {
+        printf("Server:%s\n", text);
+    }
+}
+
+void on_msg(chat_conn_t *c, const msg_t *msg, void *ud)
+{
+    (void)c;
+    (void)ud;
+    printf("%s:%s\n", msg->id, msg->text);
+}
+
+void on_close(chat_conn_t *c, int err, void *ud)
+{
+    (void)c;
+    (void)ud;
+    printf("connection error: %s\n", strerror(err));
+    conn = NULL;
+    done = 1;
+}
+
+//键盘输入的一行；line 为 NULL 表示 stdin 结束，按 quit 处理
+void on_line(const char *line, void *arg)
+{
+    (void)arg;
+    if (done)
+    {
+        return;
+    }
+    if (line == NULL || strncmp(line, "quit", 4) == 0)
+    {
+        if (conn != NULL)
+        {
+            chat_close(conn); //发 'Q'
+        }
+        done = 1;
+        return;
+    }
+
+    //第一行是登录 id
+    if (conn == NULL)
+    {
+        static const chat_handler_t h = { NULL, on_msg, on_close };
+        conn = chat_connect(loop, CHAT_UDP, server_ip, server_port, line, &h, NULL);
+        if (conn == NULL)
+        {
+            done = 1;
+        }
+        return;
+    }
+
+    if (strncmp(line, "\\who", 4) == 0)
+    {
+        chat_who(conn, on_reply, NULL);
+    }
+    else if (strncmp(line, "\\msg ", 5) == 0)
+    {
+        char target[32];
+        int skip = 0;
+        if (sscanf(line + 5, "%31s %n", target, &skip) < 1 || skip == 0)
+        {
+            printf("usage: \\msg <user> <text>\n");
+            return;
+        }
+        chat_private(conn, target, line + 5 + skip, on_reply, NULL);
+    }
+    else if (strncmp(line, "\\search ", 8) == 0)  // 搜聊天记录
+    {
+        msg_t msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = 'S';
+        snprintf(msg.text, sizeof(msg.text), "%s", line + 8);
+        chat_send_frame(conn, &msg);
+    }
+    else
+    {
+        chat_send_chat(conn, line);
+    }
+}
+
 int main(int argc, char const *argv[])
 {
     if (argc != 3)
@@ -24,89 +114,28 @@ int main(int argc, char const *argv[])
         printf("usage:./a.out <ip> <port> \n");
         return -1;
     }
- 
-    int sockfd;
-    msg_t msg;
-    struct sockaddr_in caddr;
-    socklen_t len = sizeof(caddr);
-    char buf[128];
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0)
+    server_ip = argv[1];
+    server_port = atoi(argv[2]);
+
+    loop = chat_loop_new();
+    if (loop == NULL)
     {
-        perror("sock err.\n");
         return -1;
     }
-    caddr.sin_family = AF_INET;
-    caddr.sin_addr.s_addr = inet_addr(argv[1]);
-    caddr.sin_port = htons(atoi(argv[2]));
- 
-    msg.type = 'L';
-    printf("please imput your id\n");
-    scanf("%[^\n]", msg.id);
-    getchar();
- 
-    sendto(sockfd, &msg, sizeof(msg), 0, (struct sockaddr *)&caddr, len);
- 
-    pid_t pid = fork();
-    if (pid < 0)
+    if (chat_loop_watch_lines(loop, STDIN_FILENO, on_line, NULL) < 0)
     {
-        perror("fork err.\n");
         return -1;
     }
-    else if (pid == 0) //子进程循环发送消息
-    {
-        char input_buf[sizeof(msg.text)+sizeof(msg.id)];
-        while (1)
-        {
-            memset(input_buf,0,sizeof(input_buf));
-            scanf("%[^\n]", input_buf);
-            getchar();
-            //printf("%s\n", msg.text);
- 
-            if (strncmp(input_buf, "quit", 4) == 0)
-            {
-                msg.type = 'Q';
-                sendto(sockfd, &msg, sizeof(msg), 0, (struct sockaddr *)&caddr, len);
-                kill(getppid(), SIGKILL);
-                wait(NULL);
-                exit(-1);
-            }
-            else if(strncmp(input_buf, "\\who",4)==0)
-            {
-                msg.type='W';
-                sendto(sockfd,&msg,sizeof(msg),0,(struct sockaddr *) &caddr,len);
-            }
-            else if(strncmp(input_buf, "\\msg ",5)==0){
-                msg.type='P';
-                strcpy(msg.text,input_buf+5);
-                sendto(sockfd,&msg,sizeof(msg),0,(struct sockaddr *) &caddr,len);
-                
-            }
-            else
-            {
-                msg.type = 'C';
-                sendto(sockfd, &msg, sizeof(msg), 0, (struct sockaddr *)&caddr, len);
-            }
-            //printf("sssssshu\n");
-            
-        }
-    }
- 
-    else //父进程循环接受消息
+    printf("please imput your id\n");
+
+    while (!done)
     {
-        int recvbyte;
-        while (1)
+        if (chat_loop_run(loop, -1) < 0)
         {
-            recvbyte = recvfrom(sockfd, &msg, sizeof(msg), 0, NULL, NULL);
-            if (recvbyte < 0)
-            {
-                perror("recvfrom err.\n");
-                return -1;
-            }
-            printf("%s:%s\n", msg.id, msg.text);
+            break;
         }
-        wait(NULL);
     }
-    close(sockfd);
+    chat_loop_run(loop, 0); //把 'Q' 发出去
+    chat_loop_free(loop);
     return 0;
 }
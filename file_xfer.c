@@ -0,0 +1,446 @@
+/* --- file_xfer.c (文件传输：splice/sendfile 零拷贝) --- */
+// 每条数据连接一个传输线程（文件传输不频繁，线程数不是问题），阻塞读写，
+// 这样大文件不会占用聊天的 I/O 线程和线程池。
+//   直传： 发送方 socket --splice--> pipe --splice--> 接收方 socket
+//   暂存： 发送方 socket --splice--> pipe --splice--> 暂存文件
+//          暂存文件 --sendfile--> 接收方 socket（可以边传边取，也可以之后再取）
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include "file_xfer.h"
+
+typedef struct
+{
+    char type;      // 消息类型 L C Q W P F D
+    char id[32];    // 用户id
+    char text[128]; // 消息内容
+} msg_t;
+
+#define XFER_CHUNK (1 << 20) // 每次 splice 的最大字节数
+
+// 一次文件传输
+typedef struct xfer_t
+{
+    unsigned long long token;
+    char from[32];
+    char to[32];         // 接收方 id，"*" 表示所有人
+    char name[128];
+    long long size;
+    int direct;          // 1 = 直传，0 = 暂存
+    int up_started;      // 发送方的数据连接已经到了
+    int down_fd;         // 直传：已经到达的接收方 fd
+    char path[300];      // 暂存文件路径
+    long long uploaded;  // 已写入暂存文件的字节数
+    int done;            // 上传结束（成功或失败）
+    int failed;
+    int readers;         // 正在读暂存文件的接收方个数
+    time_t created;
+    struct xfer_t *next;
+} xfer_t;
+
+static xfer_t *xfers;
+static pthread_mutex_t xfer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t xfer_cond = PTHREAD_COND_INITIALIZER;
+static char spool_dir[256];   // 空字符串表示不暂存
+static int wait_sec = 30;     // 直传时等对方数据连接的秒数
+static int spool_ttl = 86400; // 暂存文件保留秒数
+
+// 传给传输线程的参数
+typedef struct
+{
+    int fd;
+    char cmd[128];
+} xfer_args_t;
+
+int xfer_init(const char *dir)
+{
+    const char *val = getenv("CHAT_XFER_WAIT");
+    if (val != NULL) wait_sec = atoi(val);
+    val = getenv("CHAT_SPOOL_TTL");
+    if (val != NULL) spool_ttl = atoi(val);
+
+    if (dir == NULL || dir[0] == '\0') {
+        spool_dir[0] = '\0';
+        return 0;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror("mkdir spool error");
+        return -1;
+    }
+    snprintf(spool_dir, sizeof(spool_dir), "%s", dir);
+    printf("file spool directory: %s\n", spool_dir);
+    return 0;
+}
+
+int xfer_spool_enabled(void)
+{
+    return spool_dir[0] != '\0';
+}
+
+// (持有 xfer_mutex) 按 token 查找
+static xfer_t *xfer_find(unsigned long long token)
+{
+    for (xfer_t *x = xfers; x != NULL; x = x->next) {
+        if (x->token == token) {
+            return x;
+        }
+    }
+    return NULL;
+}
+
+// (持有 xfer_mutex) 从表中删除并释放，暂存文件一起删掉
+static void xfer_remove(xfer_t *x)
+{
+    xfer_t **pp = &xfers;
+    while (*pp != NULL && *pp != x) {
+        pp = &(*pp)->next;
+    }
+    if (*pp == x) {
+        *pp = x->next;
+    }
+    if (x->path[0] != '\0') {
+        unlink(x->path);
+    }
+    free(x);
+}
+
+// (持有 xfer_mutex) 清理过期的暂存文件和一直没人上传的登记
+static void xfer_sweep(time_t now)
+{
+    xfer_t *x = xfers;
+    while (x != NULL) {
+        xfer_t *next = x->next;
+        int idle = x->readers == 0 && x->down_fd < 0;
+        int stale = now - x->created > spool_ttl;
+        int never_started = !x->up_started && now - x->created > wait_sec * 2;
+        if (idle && ((x->done && stale) || (x->direct && never_started) || (!x->up_started && stale))) {
+            xfer_remove(x);
+        }
+        x = next;
+    }
+}
+
+unsigned long long xfer_offer(const char *from, const char *to, const char *name,
+                              long long size, int direct)
+{
+    if (!direct && !xfer_spool_enabled()) {
+        return 0;
+    }
+
+    xfer_t *x = calloc(1, sizeof(xfer_t));
+    if (x == NULL) {
+        perror("malloc xfer error");
+        return 0;
+    }
+    while (x->token == 0) {
+        if (getrandom(&x->token, sizeof(x->token), 0) != sizeof(x->token)) {
+            perror("getrandom error");
+            free(x);
+            return 0;
+        }
+    }
+    snprintf(x->from, sizeof(x->from), "%s", from);
+    snprintf(x->to, sizeof(x->to), "%s", to);
+    snprintf(x->name, sizeof(x->name), "%s", name);
+    x->size = size;
+    x->direct = direct;
+    x->down_fd = -1;
+    x->created = time(NULL);
+
+    pthread_mutex_lock(&xfer_mutex);
+    xfer_sweep(x->created);
+    x->next = xfers;
+    xfers = x;
+    pthread_mutex_unlock(&xfer_mutex);
+    return x->token;
+}
+
+void xfer_pending(const char *user,
+                  void (*cb)(void *arg, unsigned long long token, const char *from,
+                             long long size, const char *name),
+                  void *arg)
+{
+    pthread_mutex_lock(&xfer_mutex);
+    for (xfer_t *x = xfers; x != NULL; x = x->next) {
+        if (!x->direct && !x->failed && strcmp(x->to, user) == 0) {
+            cb(arg, x->token, x->from, x->size, x->name);
+        }
+    }
+    pthread_mutex_unlock(&xfer_mutex);
+}
+
+// 把 size 字节从 in 搬到 out，全程在内核里：in -> pipe -> out。
+// x 不为 NULL 时（暂存模式）每搬完一块就更新进度，叫醒正在跟读的接收方
+static long long pump(int in, int out, long long size, xfer_t *x)
+{
+    int p[2];
+    if (pipe(p) < 0) {
+        perror("pipe error");
+        return -1;
+    }
+    fcntl(p[1], F_SETPIPE_SZ, XFER_CHUNK); // 大一点的 pipe，减少 splice 次数
+
+    long long moved = 0;
+    while (moved < size) {
+        size_t want = size - moved < XFER_CHUNK ? (size_t)(size - moved) : XFER_CHUNK;
+        ssize_t n = splice(in, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break; // 对方断开或超时
+        }
+        ssize_t left = n;
+        while (left > 0) {
+            ssize_t m = splice(p[0], NULL, out, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m <= 0) {
+                if (m < 0 && errno == EINTR) continue;
+                goto out;
+            }
+            left -= m;
+        }
+        moved += n;
+
+        if (x != NULL) {
+            pthread_mutex_lock(&xfer_mutex);
+            x->uploaded = moved;
+            pthread_cond_broadcast(&xfer_cond);
+            pthread_mutex_unlock(&xfer_mutex);
+        }
+    }
+out:
+    close(p[0]);
+    close(p[1]);
+    return moved;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// (持有 xfer_mutex) 带超时地等 xfer_cond
+static int wait_until(struct timespec *deadline)
+{
+    return pthread_cond_timedwait(&xfer_cond, &xfer_mutex, deadline);
+}
+
+static void deadline_after(struct timespec *ts, int sec)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += sec;
+}
+
+// 发送方的数据连接
+static void do_upload(int fd, unsigned long long token)
+{
+    pthread_mutex_lock(&xfer_mutex);
+    xfer_t *x = xfer_find(token);
+    if (x == NULL || x->up_started) {
+        pthread_mutex_unlock(&xfer_mutex);
+        return;
+    }
+    x->up_started = 1;
+    pthread_cond_broadcast(&xfer_cond);
+
+    // 1. 直传：等接收方的数据连接
+    if (x->direct) {
+        struct timespec deadline;
+        deadline_after(&deadline, wait_sec);
+        while (x->down_fd < 0 && wait_until(&deadline) == 0) {
+        }
+        if (x->down_fd >= 0) {
+            int down_fd = x->down_fd;
+            long long size = x->size;
+            pthread_mutex_unlock(&xfer_mutex);
+
+            double start = now_sec();
+            long long moved = pump(fd, down_fd, size, NULL);
+            double secs = now_sec() - start;
+            printf("file %016llx relayed %lld/%lld bytes, %.1f MB/s\n",
+                   token, moved, size, secs > 0 ? moved / secs / 1e6 : 0.0);
+
+            pthread_mutex_lock(&xfer_mutex);
+            x->failed = moved != size;
+            x->done = 1; // 接收方线程看到 done 后负责释放 x
+            pthread_cond_broadcast(&xfer_cond);
+            pthread_mutex_unlock(&xfer_mutex);
+            return;
+        }
+        if (!xfer_spool_enabled()) {
+            printf("file %016llx: receiver did not come, dropped\n", token);
+            xfer_remove(x);
+            pthread_mutex_unlock(&xfer_mutex);
+            return;
+        }
+        x->direct = 0; // 对方迟迟不来取：改为暂存，之后登录或输入 /get 时再取
+    }
+
+    // 2. 暂存：写进暂存目录
+    snprintf(x->path, sizeof(x->path), "%s/%016llx", spool_dir, token);
+    long long size = x->size;
+    int spool_fd = open(x->path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (spool_fd < 0) {
+        perror("open spool error");
+        x->failed = 1;
+        x->done = 1;
+        pthread_cond_broadcast(&xfer_cond);
+        pthread_mutex_unlock(&xfer_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&xfer_mutex);
+
+    double start = now_sec();
+    long long moved = pump(fd, spool_fd, size, x);
+    double secs = now_sec() - start;
+    close(spool_fd);
+    printf("file %016llx spooled %lld/%lld bytes, %.1f MB/s\n",
+           token, moved, size, secs > 0 ? moved / secs / 1e6 : 0.0);
+
+    pthread_mutex_lock(&xfer_mutex);
+    x->failed = moved != size;
+    x->done = 1;
+    pthread_cond_broadcast(&xfer_cond);
+    if (x->failed && x->readers == 0) {
+        xfer_remove(x);
+    }
+    pthread_mutex_unlock(&xfer_mutex);
+}
+
+// 接收方的数据连接
+static void do_download(int fd, unsigned long long token)
+{
+    pthread_mutex_lock(&xfer_mutex);
+    xfer_t *x = xfer_find(token);
+    if (x == NULL || x->failed || (x->direct && x->down_fd >= 0)) {
+        pthread_mutex_unlock(&xfer_mutex);
+        return;
+    }
+
+    // 1. 先回一个头：文件大小和名字（新连接的发送缓冲区是空的，不会阻塞）
+    msg_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = 'F';
+    strcpy(hdr.id, "Server");
+    snprintf(hdr.text, sizeof(hdr.text), "%lld %.100s", x->size, x->name);
+    if (send(fd, &hdr, sizeof(hdr), MSG_NOSIGNAL) != sizeof(hdr)) {
+        pthread_mutex_unlock(&xfer_mutex);
+        return;
+    }
+
+    // 2. 直传：把 fd 交给发送方线程，等它搬完
+    if (x->direct) {
+        x->down_fd = fd;
+        pthread_cond_broadcast(&xfer_cond);
+        struct timespec deadline;
+        deadline_after(&deadline, wait_sec);
+        while (!x->up_started && wait_until(&deadline) == 0) {
+        }
+        if (!x->up_started) {
+            x->down_fd = -1; // 发送方一直没来
+            pthread_mutex_unlock(&xfer_mutex);
+            return;
+        }
+        while (!x->done && x->direct) {
+            pthread_cond_wait(&xfer_cond, &xfer_mutex);
+        }
+        if (x->done) {
+            xfer_remove(x);
+            pthread_mutex_unlock(&xfer_mutex);
+            return;
+        }
+        // 发送方等超时后改成了暂存（理论上不会发生：我们已经到了）
+        x->down_fd = -1;
+    }
+
+    // 3. 暂存：从暂存文件 sendfile，追着上传进度读
+    x->readers++;
+    while (x->path[0] == '\0' && !x->done) {
+        pthread_cond_wait(&xfer_cond, &xfer_mutex); // 发送方还没开始写
+    }
+    int rfd = x->path[0] != '\0' ? open(x->path, O_RDONLY) : -1;
+    off_t off = 0;
+    while (rfd >= 0 && off < x->size) {
+        while (off == x->uploaded && !x->done) {
+            pthread_cond_wait(&xfer_cond, &xfer_mutex);
+        }
+        long long avail = x->uploaded - off;
+        if (avail <= 0) {
+            break; // 上传失败
+        }
+        pthread_mutex_unlock(&xfer_mutex);
+        ssize_t n = sendfile(fd, rfd, &off, avail);
+        pthread_mutex_lock(&xfer_mutex);
+        if (n <= 0) {
+            break;
+        }
+    }
+    if (rfd >= 0) {
+        close(rfd);
+    }
+
+    x->readers--;
+    // 单独发给某人的文件：他取完了就删掉；群发的文件留到过期
+    if (off == x->size && x->done && x->readers == 0 && strcmp(x->to, "*") != 0) {
+        xfer_remove(x);
+    } else if (x->failed && x->done && x->readers == 0) {
+        xfer_remove(x);
+    }
+    pthread_mutex_unlock(&xfer_mutex);
+}
+
+static void *xfer_thread(void *arg)
+{
+    xfer_args_t *args = (xfer_args_t *)arg;
+    int fd = args->fd;
+    unsigned long long token = 0;
+
+    // 传输线程是阻塞读写：给 socket 加超时，对方卡住时线程不会永远挂着
+    struct timeval tv = { 60, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (sscanf(args->cmd, "UP %llx", &token) == 1) {
+        do_upload(fd, token);
+    } else if (sscanf(args->cmd, "GET %llx", &token) == 1) {
+        do_download(fd, token);
+    }
+
+    close(fd);
+    free(args);
+    return NULL;
+}
+
+void xfer_attach(int fd, const char *cmd)
+{
+    xfer_args_t *args = malloc(sizeof(xfer_args_t));
+    if (args == NULL) {
+        perror("malloc xfer args error");
+        close(fd);
+        return;
+    }
+    args->fd = fd;
+    snprintf(args->cmd, sizeof(args->cmd), "%s", cmd);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, xfer_thread, args) != 0) {
+        perror("pthread_create (xfer) error");
+        close(fd);
+        free(args);
+        return;
+    }
+    pthread_detach(tid);
+}
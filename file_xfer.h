@@ -0,0 +1,33 @@
+/* --- file_xfer.h (文件传输：splice/sendfile 零拷贝) --- */
+#ifndef FILE_XFER_H
+#define FILE_XFER_H
+
+// 文件走单独的“数据连接”，不占用聊天连接：
+//   1. 发送方在聊天连接上发 'F' "<对方id|*> <大小> <路径>"
+//   2. 服务器回 'F' "UP <token> <路径>"，通知接收方 'F' "<token> <大小> <文件名>"
+//   3. 发送方新开一个 TCP 连接，第一帧发 'D' "UP <token>"，随后是文件内容
+//   4. 接收方新开一个 TCP 连接，第一帧发 'D' "GET <token>"，
+//      服务器先回一帧 'F' "<大小> <文件名>"，随后是文件内容
+// 服务器端数据只在内核里搬运（socket -> pipe -> socket/暂存文件，暂存文件 -> socket）。
+
+// 初始化。spool_dir 为 NULL 表示不启用暂存目录，只能在线直传
+int xfer_init(const char *spool_dir);
+
+// 是否启用了暂存目录
+int xfer_spool_enabled(void);
+
+// 登记一次传输，返回 token（0 表示失败）。
+// direct = 1：对方在线，优先直传；对方迟迟不来取时（有暂存目录的话）改为暂存
+unsigned long long xfer_offer(const char *from, const char *to, const char *name,
+                              long long size, int direct);
+
+// I/O 线程收到 'D' 帧后把 fd 交给这里，之后 fd 归传输线程所有
+void xfer_attach(int fd, const char *cmd);
+
+// 对每个发给 user、还在暂存区的文件调用一次 cb（登录时补发通知用）
+void xfer_pending(const char *user,
+                  void (*cb)(void *arg, unsigned long long token, const char *from,
+                             long long size, const char *name),
+                  void *arg);
+
+#endif
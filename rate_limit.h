@@ -0,0 +1,125 @@
+/* --- rate_limit.h (令牌桶限流) --- */
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// 超限后的处理动作
+#define RL_THROTTLE   0 // 丢弃这条消息，并提醒一次发送者
+#define RL_DISCONNECT 1 // 连续超限 strikes 次后直接断开
+
+// 一类消息的限流配置
+typedef struct
+{
+    double rate;  // 每秒补充的令牌数
+    double burst; // 桶容量（允许的突发条数）
+    int action;   // RL_THROTTLE / RL_DISCONNECT
+    int strikes;  // RL_DISCONNECT 时，连续超限多少次才断开
+} rl_conf_t;
+
+// 令牌桶本身：只归一个连接（一个线程）所有，所以不需要加锁
+typedef struct
+{
+    double tokens;
+    double last; // 上次补充令牌的时间（秒）
+    int strikes; // 当前连续超限次数
+} bucket_t;
+
+// 三类消息各自的限流配置 + 全局登录准入
+typedef struct
+{
+    rl_conf_t chat;  // 'C' 群聊
+    rl_conf_t pm;    // 'P' 私聊 /msg
+    rl_conf_t who;   // 'W' \who
+    rl_conf_t login; // 'L' 全服每秒新登录数
+} rl_table_t;
+
+// rl_take() 的返回值
+#define RL_PASS 0 // 放行
+#define RL_DROP 1 // 丢弃
+#define RL_KICK 2 // 丢弃并断开
+
+static inline double rl_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void rl_bucket_init(bucket_t *b, const rl_conf_t *conf)
+{
+    b->tokens = conf->burst;
+    b->last = rl_now();
+    b->strikes = 0;
+}
+
+// 取一个令牌。rate <= 0 表示这类消息不限流
+static inline int rl_take(bucket_t *b, const rl_conf_t *conf, double now)
+{
+    if (conf->rate <= 0) {
+        return RL_PASS;
+    }
+
+    b->tokens += (now - b->last) * conf->rate;
+    if (b->tokens > conf->burst) {
+        b->tokens = conf->burst;
+    }
+    b->last = now;
+
+    if (b->tokens >= 1.0) {
+        b->tokens -= 1.0;
+        b->strikes = 0;
+        return RL_PASS;
+    }
+
+    b->strikes++;
+    if (conf->action == RL_DISCONNECT && b->strikes >= conf->strikes) {
+        return RL_KICK;
+    }
+    return RL_DROP;
+}
+
+// 从环境变量读一条配置，格式 "rate,burst[,throttle|disconnect[,strikes]]"
+// 例如 CHAT_RL_CHAT=10,20,disconnect,50
+static inline void rl_conf_from_env(rl_conf_t *conf, const char *name)
+{
+    const char *val = getenv(name);
+    if (val == NULL) {
+        return;
+    }
+
+    double rate, burst;
+    char action[16] = "";
+    int strikes = conf->strikes;
+    int n = sscanf(val, "%lf,%lf,%15[a-z],%d", &rate, &burst, action, &strikes);
+    if (n < 2) {
+        fprintf(stderr, "ignore bad %s='%s'\n", name, val);
+        return;
+    }
+
+    conf->rate = rate;
+    conf->burst = burst < 1 ? 1 : burst;
+    if (n >= 3) {
+        conf->action = strcmp(action, "disconnect") == 0 ? RL_DISCONNECT : RL_THROTTLE;
+    }
+    conf->strikes = strikes < 1 ? 1 : strikes;
+}
+
+// 默认值 + 环境变量覆盖
+static inline void rl_table_load(rl_table_t *t)
+{
+    t->chat  = (rl_conf_t){ 10,  20, RL_THROTTLE, 50 };
+    t->pm    = (rl_conf_t){  5,  10, RL_THROTTLE, 50 };
+    t->who   = (rl_conf_t){  1,   3, RL_THROTTLE, 20 };
+    t->login = (rl_conf_t){ 200, 400, RL_THROTTLE, 1 };
+
+    rl_conf_from_env(&t->chat,  "CHAT_RL_CHAT");
+    rl_conf_from_env(&t->pm,    "CHAT_RL_MSG");
+    rl_conf_from_env(&t->who,   "CHAT_RL_WHO");
+    rl_conf_from_env(&t->login, "CHAT_RL_LOGIN");
+}
+
+#endif
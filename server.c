@@ -10,20 +10,37 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/select.h>  // 可选：如果需要更完善的IO处理
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <time.h>
+#include "rate_limit.h"
+#include "work_pool.h"
+#include "chat_trace.h"
+#include "chat_history.h"
 
 typedef struct
 {
-    char type;      // 消息类型 L C Q W
+    char type;      // 消息类型 L C Q W P M R S
     char id[32];    // 用户id
     char text[128]; // 消息内容
 } msg_t;
 
+// 带编号的请求：'W' / 'P' 的 id 字段填 "#编号" 时，用 'R' 帧回复，id 原样带回，
+// 发送者按地址查出来（和 TCP 版的约定相同）。不带编号时照旧用 'C' 回复
+#define is_tagged(msg) (((msg)->type == 'W' || (msg)->type == 'P') && (msg)->id[0] == '#')
+
 // 链表节点：存储客户端地址
 typedef struct node_t
 {
     struct sockaddr_in caddr;
     struct node_t *next;
     char id[32];  //增加id
+    int mcast;    // 1 = 已加入组播组，群发不再单独发给它
+    // 令牌桶：只有主循环读写（查找时持有 list_mutex）
+    bucket_t chat_bucket;
+    bucket_t pm_bucket;
+    bucket_t who_bucket;
 } list;
 
 // <-- 修正 1: 创建一个新的结构体，用于向handler线程传递参数
@@ -33,9 +50,36 @@ typedef struct
     list *head; // 我们需要传递链表头指针
 } thread_args_t;
 
+// 交给线程池的一个请求
+typedef struct
+{
+    int sockfd;
+    list *head;
+    msg_t msg;
+    struct sockaddr_in caddr;
+} job_t;
+
+// 出站队列中的一个数据报：工作线程放进来，由主循环 sendto
+typedef struct out_node_t
+{
+    msg_t msg;
+    struct sockaddr_in addr;
+    struct out_node_t *next;
+} out_node_t;
+
+#define N_STRANDS 256 // 按客户端地址散列到固定个数的 strand，同一地址的消息保持顺序
+
 // 全局变量声明（供handler线程使用）
 struct sockaddr_in saddr, caddr;  // 注意：main中不要重复定义
 pthread_mutex_t list_mutex; // <-- 修正 2: 定义一个全局互斥锁
+rl_table_t rl;              // 限流配置（启动后只读）
+strand_t strands[N_STRANDS];
+pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER; // 保护出站队列
+out_node_t *out_head, *out_tail;
+int out_efd;                // eventfd：出站队列非空时唤醒主循环
+int mcast_on;               // 1 = 启用了组播群发（CHAT_MCAST）
+struct sockaddr_in mcast_addr; // 组播组地址和端口
+int mcast_members;          // 已加入组播组的在线用户数（受 list_mutex 保护）
 // 线程函数声明（必须在main前声明）
 void *handler(void *arg);
 
@@ -46,6 +90,16 @@ void chat(int sockfd, msg_t msg, list *p, struct sockaddr_in caddr);
 void quit(int sockfd, msg_t msg, list *p, struct sockaddr_in caddr);
 void who(int sockfd, msg_t msg, list *p, struct sockaddr_in caddr);
 void private_chat(int sockfd, msg_t msg, list *p, struct sockaddr_in caddr); // <-- 新增
+void search(int sockfd, msg_t msg, struct sockaddr_in caddr);
+int rate_check(int sockfd, msg_t *msg, list *head, struct sockaddr_in caddr);
+void send_notice(int sockfd, const char *text, struct sockaddr_in caddr);
+void send_reply(const char *tag, const char *text, struct sockaddr_in caddr);
+void udp_send(const msg_t *msg, const struct sockaddr_in *addr);
+void submit_job(int sockfd, const msg_t *msg, list *head, struct sockaddr_in caddr);
+void flush_out(int sockfd);
+int mcast_setup(int sockfd);
+void mcast_join(msg_t msg, list *head, struct sockaddr_in caddr);
+void broadcast(const msg_t *msg, list *head, const struct sockaddr_in *exclude);
 int main(int argc, char const *argv[])
 {
     if (argc != 2)
@@ -57,19 +111,10 @@ int main(int argc, char const *argv[])
     int sockfd;
     socklen_t len = sizeof(caddr);  // 客户端地址长度
     msg_t msg;
-    int listen_fd=socket(AF_INET,SOCK_STREAM,0);
     struct sockaddr_in saddr;
-    memset(&saddr,0,sizeof(saddr));
-    saddr.sin_family=AF_INET;
-    saddr.sin_addr.s_addr=htonl(INADDR_ANY);
-    saddr.sin_port=htons(8888);
-
-    bind(listen_fd,(struct sockaddr *)&saddr,sizeof(saddr));
-
-    listen(listen_fd,5);
     
     // 创建UDP socket
-    //sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0)
     {
         perror("socket error");
@@ -100,6 +145,17 @@ int main(int argc, char const *argv[])
     }
     printf("Server bind ok! Port: %s\n", argv[1]);
 
+    // 读取限流配置
+    rl_table_load(&rl);
+    if (trace_open(getenv("CHAT_TRACE"), TRACE_UDP) < 0 || mcast_setup(sockfd) < 0 ||
+        hist_open(getenv("CHAT_HISTORY")) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+    bucket_t login_bucket; // 全局登录准入，只有主循环使用
+    rl_bucket_init(&login_bucket, &rl.login);
+
     // 创建客户端链表（头节点）
     list *head = list_create();
     if (head == NULL)
@@ -136,45 +192,76 @@ int main(int argc, char const *argv[])
     }
     pthread_detach(tid);  // 分离线程，自动回收资源
 
-    // 主循环：接收客户端消息并处理
+    // 启动线程池：命令逻辑在工作线程里执行，主循环只收发数据报
+    for (int i = 0; i < N_STRANDS; i++)
+    {
+        strand_init(&strands[i]);
+    }
+    out_efd = eventfd(0, EFD_NONBLOCK);
+    if (out_efd < 0 || pool_start(0) < 0)
+    {
+        perror("pool start error");
+        close(sockfd);
+        return -1;
+    }
+
+    // 主循环：接收客户端消息，交给线程池；出站队列有数据时负责发送
+    struct pollfd pfds[2];
+    pfds[0].fd = sockfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = out_efd;
+    pfds[1].events = POLLIN;
     while (1)
     {
+        if (poll(pfds, 2, -1) < 0)
+        {
+            if (errno != EINTR) perror("poll error");
+            continue;
+        }
+        if (pfds[1].revents & POLLIN)
+        {
+            flush_out(sockfd);
+        }
+        if (!(pfds[0].revents & POLLIN))
+        {
+            continue;
+        }
+
         // 接收客户端消息
         memset(&msg, 0, sizeof(msg));  // 清空消息结构体
         memset(&caddr, 0, sizeof(caddr));  // 清空客户端地址
-        ssize_t recvbyte = recvfrom(sockfd, &msg, sizeof(msg), 0, 
+        len = sizeof(caddr);
+        ssize_t recvbyte = recvfrom(sockfd, &msg, sizeof(msg), MSG_DONTWAIT, 
                                    (struct sockaddr *)&caddr, &len);
         if (recvbyte < 0)
         {
-            perror("recvfrom error (可能是超时)");
-            continue;  // 超时不退出，继续循环
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("recvfrom error");
+            }
+            continue;
         }
+        trace_in(trace_udp_id(&caddr), &msg, recvbyte); // 录原始数据报，限流之前
 
-        // 根据消息类型处理
-        if (msg.type == 'L')  // 登录
-        {
-            login(sockfd, msg, head, caddr);
-        }
-        else if (msg.type == 'C')  // 聊天
-        {   
-            // <-- 修正：在这里添加服务器日志
-            printf("Chat Log [%s]: %s\n", msg.id, msg.text);
-            chat(sockfd, msg, head, caddr);
-        }
-        else if (msg.type == 'Q')  // 退出
-        {
-            printf("收到退出消息：IP=%s, Port=%d, ID=%s\n",
-                   inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port), msg.id);
-            quit(sockfd, msg, head, caddr);
-        }
-        else if(msg.type =='W')//\who
+        // 先过限流，再做任何群发/查表的工作
+        if (msg.type == 'L')
         {
-            who(sockfd, msg, head, caddr);
+            if (rl_take(&login_bucket, &rl.login, rl_now()) != RL_PASS)
+            {
+                send_notice(sockfd, "服务器繁忙，请稍后重试", caddr);
+                continue;
+            }
         }
-        else if(msg.type=='P')
+        else if (msg.type == 'C' || msg.type == 'P' || msg.type == 'W' || msg.type == 'S')
         {
-            private_chat(sockfd,msg,head,caddr);
+            if (rate_check(sockfd, &msg, head, caddr) != RL_PASS)
+            {
+                continue;
+            }
         }
+
+        // 交给线程池处理
+        submit_job(sockfd, &msg, head, caddr);
     }
 
     close(sockfd);
@@ -182,6 +269,131 @@ int main(int argc, char const *argv[])
     return 0;
 }
 
+// 工作线程执行的请求入口：根据消息类型处理
+static void run_job(void *arg)
+{
+    job_t *job = (job_t *)arg;
+    int sockfd = job->sockfd;
+    list *head = job->head;
+    msg_t msg = job->msg;
+    struct sockaddr_in caddr = job->caddr;
+    free(job);
+
+    if (msg.type == 'L')  // 登录
+    {
+        login(sockfd, msg, head, caddr);
+    }
+    else if (msg.type == 'C')  // 聊天
+    {   
+        // <-- 修正：在这里添加服务器日志
+        printf("Chat Log [%s]: %s\n", msg.id, msg.text);
+        chat(sockfd, msg, head, caddr);
+    }
+    else if (msg.type == 'Q')  // 退出
+    {
+        printf("收到退出消息：IP=%s, Port=%d, ID=%s\n",
+               inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port), msg.id);
+        quit(sockfd, msg, head, caddr);
+    }
+    else if(msg.type =='W')//\who
+    {
+        who(sockfd, msg, head, caddr);
+    }
+    else if(msg.type=='P')
+    {
+        private_chat(sockfd,msg,head,caddr);
+    }
+    else if (msg.type == 'S')  // 搜聊天记录
+    {
+        search(sockfd, msg, caddr);
+    }
+    else if (msg.type == 'M')  // 客户端已加入组播组
+    {
+        mcast_join(msg, head, caddr);
+    }
+}
+
+// 把请求挂到发送者地址对应的 strand 上，同一客户端的消息按顺序处理
+void submit_job(int sockfd, const msg_t *msg, list *head, struct sockaddr_in caddr)
+{
+    job_t *job = malloc(sizeof(job_t));
+    if (job == NULL)
+    {
+        perror("malloc job error");
+        return;
+    }
+    job->sockfd = sockfd;
+    job->head = head;
+    job->msg = *msg;
+    job->caddr = caddr;
+    unsigned int h = caddr.sin_addr.s_addr * 2654435761u ^ caddr.sin_port;
+    pool_submit(&strands[h % N_STRANDS], run_job, job);
+}
+
+// 任何线程都可以调用：把数据报放进出站队列，由主循环发送
+void udp_send(const msg_t *msg, const struct sockaddr_in *addr)
+{
+    out_node_t *node = malloc(sizeof(out_node_t));
+    if (node == NULL)
+    {
+        perror("malloc out error");
+        return;
+    }
+    node->msg = *msg;
+    node->addr = *addr;
+    node->next = NULL;
+    // 组播不属于任何一个客户端，不录制
+    if (!mcast_on || memcmp(addr, &mcast_addr, sizeof(*addr)) != 0)
+    {
+        trace_out(trace_udp_id(addr), msg, sizeof(*msg));
+    }
+
+    pthread_mutex_lock(&out_mutex);
+    int was_empty = out_head == NULL;
+    if (out_tail != NULL)
+    {
+        out_tail->next = node;
+    }
+    else
+    {
+        out_head = node;
+    }
+    out_tail = node;
+    pthread_mutex_unlock(&out_mutex);
+
+    if (was_empty)
+    {
+        uint64_t one = 1;
+        if (write(out_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            perror("eventfd write error");
+        }
+    }
+}
+
+// (主循环) 把出站队列整个取下来逐个 sendto
+void flush_out(int sockfd)
+{
+    uint64_t cnt;
+    if (read(out_efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+    {
+        perror("eventfd read error");
+    }
+    pthread_mutex_lock(&out_mutex);
+    out_node_t *node = out_head;
+    out_head = out_tail = NULL;
+    pthread_mutex_unlock(&out_mutex);
+
+    while (node != NULL)
+    {
+        out_node_t *next = node->next;
+        sendto(sockfd, &node->msg, sizeof(node->msg), 0,
+               (struct sockaddr *)&node->addr, sizeof(node->addr));
+        free(node);
+        node = next;
+    }
+}
+
 // 创建链表头节点
 list *list_create(void)
 {
@@ -209,41 +421,47 @@ void login(int sockfd, msg_t msg, list *head, struct sockaddr_in caddr)
     new_node->caddr = caddr;
     strcpy(new_node->id, msg.id);
     new_node->next = NULL;
+    rl_bucket_init(&new_node->chat_bucket, &rl.chat);
+    rl_bucket_init(&new_node->pm_bucket, &rl.pm);
+    rl_bucket_init(&new_node->who_bucket, &rl.who);
+    new_node->mcast = 0;
     // <-- 修正 7: 在访问链表前加锁
     pthread_mutex_lock(&list_mutex);
+    // 向已在线用户广播新用户登录消息
+    sprintf(msg.text, "%s 已上线", msg.id);
+    broadcast(&msg, head, NULL);
     // 尾插法加入链表
     list *p = head;
     while (p->next != NULL)
     {
         p = p->next;
-        // 向已在线用户广播新用户登录消息
-        sprintf(msg.text, "%s 已上线", msg.id);
-        sendto(sockfd, &msg, sizeof(msg), 0, 
-               (struct sockaddr *)&(p->caddr), sizeof(p->caddr));
     }
     p->next = new_node;
     // <-- 修正 8: 完成访问后解锁
     pthread_mutex_unlock(&list_mutex);
     printf("新用户登录：ID=%s, IP=%s, Port=%d\n",
            msg.id, inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port));
+
+    // 启用了组播：告诉新用户要加入的组，它回 'M' 之后群发才改走组播
+    if (mcast_on)
+    {
+        msg_t join_msg;
+        memset(&join_msg, 0, sizeof(join_msg));
+        join_msg.type = 'M';
+        strcpy(join_msg.id, "Server");
+        snprintf(join_msg.text, sizeof(join_msg.text), "%s %d",
+                 inet_ntoa(mcast_addr.sin_addr), ntohs(mcast_addr.sin_port));
+        udp_send(&join_msg, &caddr);
+    }
 }
 
 // 处理聊天消息（群发）
 void chat(int sockfd, msg_t msg, list *head, struct sockaddr_in caddr)
 {   
     // <-- 修正 9: 加锁
+    hist_append(HIST_PUBLIC, msg.id, NULL, msg.text);
     pthread_mutex_lock(&list_mutex);
-    list *p = head->next;  // 跳过头节点
-    while (p != NULL)
-    {
-        // 不向发送者本人转发
-        if (memcmp(&(p->caddr), &caddr, sizeof(caddr)) != 0)
-        {
-            sendto(sockfd, &msg, sizeof(msg), 0, 
-                   (struct sockaddr *)&(p->caddr), sizeof(p->caddr));
-        }
-        p = p->next;
-    }
+    broadcast(&msg, head, &caddr);  // 不向发送者本人转发
     // <-- 修正 10: 解锁
     pthread_mutex_unlock(&list_mutex);
 }
@@ -263,19 +481,22 @@ void quit(int sockfd, msg_t msg, list *head, struct sockaddr_in caddr)
         {
             dele = p->next;
             p->next = dele->next;  // 断开链表
+            if (dele->mcast)
+            {
+                mcast_members--;
+            }
             free(dele);  // 释放节点
             dele = NULL;
             printf("用户退出：ID=%s\n", msg.id);
         }
         else
         {
-            // 向其他用户广播退出消息
-            sprintf(msg.text, "%s 已下线", msg.id);
-            sendto(sockfd, &msg, sizeof(msg), 0, 
-                   (struct sockaddr *)&(p->next->caddr), sizeof(p->next->caddr));
             p = p->next;
         }
     }
+    // 向其他用户广播退出消息
+    sprintf(msg.text, "%s 已下线", msg.id);
+    broadcast(&msg, head, NULL);
     // <-- 修正 12: 解锁
     pthread_mutex_unlock(&list_mutex);
 }
@@ -289,6 +510,11 @@ void who(int sockfd, msg_t msg, list *head, struct sockaddr_in caddr)
     response_msg.type='C';
     strcpy(response_msg.id,"Server");
     strcpy(response_msg.text,"---Online Users ---\n");
+    if (is_tagged(&msg))
+    {
+        response_msg.type = 'R';
+        strcpy(response_msg.id, msg.id);
+    }
     
     list *p = head->next;  // 跳过头节点
     while(p!=NULL){
@@ -301,8 +527,7 @@ void who(int sockfd, msg_t msg, list *head, struct sockaddr_in caddr)
         p=p->next;
    }
     pthread_mutex_unlock(&list_mutex);
-    sendto(sockfd, &response_msg, sizeof(msg), 0, 
-                (const struct sockaddr *)&caddr, sizeof(p->caddr));
+    udp_send(&response_msg, &caddr);
     
     
 }
@@ -311,7 +536,6 @@ void *handler(void *arg)
 {   
     // <-- 修正 13: 接收参数
     thread_args_t *args = (thread_args_t *)arg;
-    int sockfd = args->sockfd;  // 从参数获取socket描述符
     list *head = args->head;     // 从参数获取 真正的链表头
     free(args); // 已经获取了参数，释放结构体内存
     args = NULL;
@@ -329,8 +553,7 @@ void *handler(void *arg)
         fflush(stdout);  // 刷新缓冲区，确保提示正常显示
         if (fgets(input_buf, sizeof(input_buf), stdin) == NULL)
         {
-            perror("fgets error");
-            continue; // 出错或EOF(Ctrl+D)
+            break; // 出错或EOF(Ctrl+D)：管理员线程退出，服务器照常运行
         }
         // 移除 fgets 带来的换行符
         input_buf[strcspn(input_buf, "\n")] = 0;
@@ -343,14 +566,7 @@ void *handler(void *arg)
         // <-- 修正 15: 在访问链表前加锁
         pthread_mutex_lock(&list_mutex);
         // 群发消息给所有在线用户
-      
-        list *p = head->next;
-        while (p != NULL)
-        {
-            sendto(sockfd, &msg_s, sizeof(msg_s), 0,
-                   (struct sockaddr *)&(p->caddr), sizeof(p->caddr));
-            p = p->next;
-        }
+        broadcast(&msg_s, head, NULL);
         // <-- 修正 16: 完成访问后解锁
         pthread_mutex_unlock(&list_mutex);
     }
@@ -364,15 +580,23 @@ void private_chat(int sockfd, msg_t msg, list *head, struct sockaddr_in caddr)
     list *target_node = NULL;
     if(sscanf(msg.text,"%31s %[^\n]",target_id,message_content)<2)
     {
+        if (is_tagged(&msg))
+        {
+            send_reply(msg.id, "usage: \\msg <user> <text>", caddr);
+        }
         return;
     }
     pthread_mutex_lock(&list_mutex);
+    const char *from = msg.id;
     list *p=head->next;
     while(p!=NULL){
         if(strcmp(p->id,target_id)==0)
         {
             target_node=p;//对应人
-            break;
+        }
+        if (is_tagged(&msg) && memcmp(&p->caddr, &caddr, sizeof(caddr)) == 0)
+        {
+            from = p->id; // 带编号的请求 id 字段是编号，发送者按地址找
         }
         p=p->next;
     }
@@ -382,9 +606,13 @@ void private_chat(int sockfd, msg_t msg, list *head, struct sockaddr_in caddr)
         memset(&private_msg,0,sizeof(private_msg));
         private_msg.type='C';
         strcpy(private_msg.text,message_content);
-        snprintf(private_msg.id, sizeof(private_msg.id), "%s (private)", msg.id);  
-        sendto(sockfd, &private_msg, sizeof(private_msg), 0,
-               (struct sockaddr *)&(target_node->caddr), sizeof(target_node->caddr));    
+        snprintf(private_msg.id, sizeof(private_msg.id), "%s (private)", from);
+        udp_send(&private_msg, &target_node->caddr);
+        hist_append(HIST_PRIVATE, from, target_id, message_content);
+        if (is_tagged(&msg))
+        {
+            send_reply(msg.id, "ok", caddr);
+        }
     }
     else{
         //没找到
@@ -392,8 +620,215 @@ void private_chat(int sockfd, msg_t msg, list *head, struct sockaddr_in caddr)
         memset(&error_msg,0,sizeof(error_msg));
         error_msg.type='C';
         strcpy(error_msg.id,"Server");
+        if (is_tagged(&msg))
+        {
+            error_msg.type = 'R';
+            strcpy(error_msg.id, msg.id);
+        }
         snprintf(error_msg.text,sizeof(error_msg.text),"User '%s' not found or offline",target_id);
-        sendto(sockfd,&error_msg,sizeof(error_msg),0,(struct sockaddr*)&caddr,sizeof(caddr));
+        udp_send(&error_msg, &caddr);
+    }
+    pthread_mutex_unlock(&list_mutex);
+}
+
+// 搜聊天记录：text 是查询词，id 是 rate_check 按地址填好的用户名。
+// 回一行统计，再从新到旧回最多 10 条
+void search(int sockfd, msg_t msg, struct sockaddr_in caddr)
+{
+    hist_msg_t hits[10];
+    if (!hist_on)
+    {
+        send_notice(sockfd, "服务器没有开启聊天记录", caddr);
+        return;
+    }
+    msg.text[sizeof(msg.text) - 1] = '\0';
+    int n = hist_search(msg.id, msg.text, hits, 10);
+    if (n < 0)
+    {
+        send_notice(sockfd, "usage: \\search <words> [from:user]", caddr);
+        return;
+    }
+
+    msg_t reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = 'C';
+    strcpy(reply.id, "Search");
+    snprintf(reply.text, sizeof(reply.text), "%d result(s) for '%.80s'", n, msg.text);
+    udp_send(&reply, &caddr);
+    for (int i = 0; i < n; i++)
+    {
+        hist_format(&hits[i], reply.text, sizeof(reply.text));
+        udp_send(&reply, &caddr);
+    }
+}
+
+// 限流检查：未登录的地址直接丢弃；超限时丢弃或踢下线
+int rate_check(int sockfd, msg_t *msg, list *head, struct sockaddr_in caddr)
+{
+    pthread_mutex_lock(&list_mutex);
+    list *p = head->next;
+    while (p != NULL)
+    {
+        if (memcmp(&(p->caddr), &caddr, sizeof(caddr)) == 0)
+        {
+            break;
+        }
+        p = p->next;
+    }
+    if (p == NULL)
+    {
+        pthread_mutex_unlock(&list_mutex);
+        return RL_DROP;
+    }
+
+    bucket_t *bucket = &p->chat_bucket;
+    const rl_conf_t *conf = &rl.chat;
+    if (msg->type == 'P')
+    {
+        bucket = &p->pm_bucket;
+        conf = &rl.pm;
+    }
+    else if (msg->type == 'W' || msg->type == 'S')  // 查询类请求共用一个桶
+    {
+        bucket = &p->who_bucket;
+        conf = &rl.who;
+    }
+    int verdict = rl_take(bucket, conf, rl_now());
+    int first_strike = bucket->strikes == 1;
+    if (msg->type == 'S')
+    {
+        strcpy(msg->id, p->id); // 按地址认人，只能搜到自己能看的私聊
+    }
+    if (verdict == RL_KICK)
+    {
+        strcpy(msg->id, p->id); // 带编号的请求 id 字段不是用户名
     }
     pthread_mutex_unlock(&list_mutex);
-}
\ No newline at end of file
+
+    if (verdict == RL_KICK)
+    {
+        printf("用户刷屏被踢出：ID=%s\n", msg->id);
+        send_notice(sockfd, "发送过快，已被踢下线", caddr);
+        msg->type = 'Q';  // 按退出处理，排在这个客户端之前的消息后面
+        submit_job(sockfd, msg, head, caddr);
+    }
+    else if (verdict == RL_DROP && is_tagged(msg))  // 客户端在等这个编号，必须回
+    {
+        send_reply(msg->id, "发送过快，消息已被丢弃", caddr);
+    }
+    else if (verdict == RL_DROP && first_strike)  // 每轮超限只提醒一次
+    {
+        send_notice(sockfd, "发送过快，消息已被丢弃", caddr);
+    }
+    return verdict;
+}
+
+// 只发给一个地址的服务器提示
+void send_notice(int sockfd, const char *text, struct sockaddr_in caddr)
+{
+    msg_t notice;
+    memset(&notice, 0, sizeof(notice));
+    notice.type = 'C';
+    strcpy(notice.id, "Server");
+    snprintf(notice.text, sizeof(notice.text), "%s", text);
+    udp_send(&notice, &caddr);
+}
+
+// 回复带编号的请求
+void send_reply(const char *tag, const char *text, struct sockaddr_in caddr)
+{
+    msg_t reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = 'R';
+    snprintf(reply.id, sizeof(reply.id), "%s", tag);
+    snprintf(reply.text, sizeof(reply.text), "%s", text);
+    udp_send(&reply, &caddr);
+}
+
+// 读取组播配置 CHAT_MCAST=组地址:端口，设置组播发送选项。没配置时返回 0，不启用
+int mcast_setup(int sockfd)
+{
+    const char *conf = getenv("CHAT_MCAST");
+    if (conf == NULL || conf[0] == '\0')
+    {
+        return 0;
+    }
+    char group[64];
+    int port;
+    memset(&mcast_addr, 0, sizeof(mcast_addr));
+    mcast_addr.sin_family = AF_INET;
+    if (sscanf(conf, "%63[^:]:%d", group, &port) != 2 ||
+        inet_pton(AF_INET, group, &mcast_addr.sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(mcast_addr.sin_addr.s_addr)))
+    {
+        printf("CHAT_MCAST should look like 239.0.0.1:9999\n");
+        return -1;
+    }
+    mcast_addr.sin_port = htons(port);
+
+    // 从哪块网卡发（CHAT_MCAST_IF=本机地址，本机测试用 127.0.0.1），默认由路由决定
+    struct in_addr ifaddr;
+    ifaddr.s_addr = htonl(INADDR_ANY);
+    const char *ifs = getenv("CHAT_MCAST_IF");
+    if (ifs != NULL && inet_pton(AF_INET, ifs, &ifaddr) != 1)
+    {
+        printf("bad CHAT_MCAST_IF\n");
+        return -1;
+    }
+    const char *ttl_s = getenv("CHAT_MCAST_TTL");
+    unsigned char ttl = ttl_s != NULL ? atoi(ttl_s) : 1;  // 默认不出本网段
+    unsigned char loop = 1;  // 同一台机器上的客户端也要收到
+    if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr)) < 0 ||
+        setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+        setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+    {
+        perror("multicast setsockopt error");
+        return -1;
+    }
+    mcast_on = 1;
+    printf("Multicast fan-out on %s:%d\n", group, port);
+    return 0;
+}
+
+// 客户端回了 'M'：已经加入组播组，之后的群发对它只走组播
+void mcast_join(msg_t msg, list *head, struct sockaddr_in caddr)
+{
+    if (!mcast_on)
+    {
+        return;
+    }
+    pthread_mutex_lock(&list_mutex);
+    for (list *p = head->next; p != NULL; p = p->next)
+    {
+        if (memcmp(&(p->caddr), &caddr, sizeof(caddr)) == 0 && !p->mcast)
+        {
+            p->mcast = 1;
+            mcast_members++;
+            printf("用户加入组播：ID=%s\n", p->id);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&list_mutex);
+}
+
+// 群发（调用者持有 list_mutex）：加入了组播组的用户共用一次组播，其余的逐个单播。
+// exclude 只对单播有效，组播会发回给发送者本人，由客户端按 id 过滤
+void broadcast(const msg_t *msg, list *head, const struct sockaddr_in *exclude)
+{
+    if (mcast_members > 0)
+    {
+        udp_send(msg, &mcast_addr);
+    }
+    for (list *p = head->next; p != NULL; p = p->next)
+    {
+        if (p->mcast)
+        {
+            continue;
+        }
+        if (exclude != NULL && memcmp(&(p->caddr), exclude, sizeof(*exclude)) == 0)
+        {
+            continue;
+        }
+        udp_send(msg, &p->caddr);
+    }
+}
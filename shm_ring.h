@@ -0,0 +1,230 @@
+/* --- shm_ring.h (本机共享内存传输) --- */
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+// 和服务器跑在同一台机器上的机器人 / 网关可以不走 TCP：
+//   1. 连上服务器的 Unix 域套接字（CHAT_LOCAL_SOCK）
+//   2. 服务器用 SCM_RIGHTS 发回三个 fd：memfd（两个环形队列）、两个 eventfd
+//   3. 之后帧直接写进共享内存；对方在睡觉时才用 eventfd 叫醒它
+//   4. 关闭 Unix 域套接字就是下线
+// 每个方向一个单生产者/单消费者环，每个槽放一整帧（msg_t 放得下）。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+#define SHM_MAGIC      0x4d485343u // "CSHM"
+#define SHM_RING_SLOTS 1024        // 必须是 2 的幂
+#define SHM_SLOT_SIZE  192
+
+typedef struct
+{
+    uint32_t len;
+    char data[SHM_SLOT_SIZE - sizeof(uint32_t)];
+} shm_slot_t;
+
+// 单向环。head 只有生产者写，tail 只有消费者写，分开放在不同的缓存行
+typedef struct
+{
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t consumer_waiting __attribute__((aligned(64))); // 消费者准备睡觉，生产者写完要叫醒它
+    uint32_t producer_waiting;                              // 生产者等空位，消费者取完要叫醒它
+    shm_slot_t slots[SHM_RING_SLOTS] __attribute__((aligned(64)));
+} shm_ring_t;
+
+// memfd 的内容
+typedef struct
+{
+    shm_ring_t up;   // 客户端 -> 服务器
+    shm_ring_t down; // 服务器 -> 客户端
+} shm_region_t;
+
+// 握手时服务器随 fd 一起发过去的说明
+typedef struct
+{
+    uint32_t magic;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t region_size;
+} shm_hello_t;
+
+// 一端看到的链路：tx 是自己写的环，rx 是自己读的环
+typedef struct
+{
+    int sock;     // Unix 域控制连接
+    int efd_in;   // 对方写了数据 / 腾出了空位时被唤醒（把它放进 epoll）
+    int efd_out;  // 用来叫醒对方
+    shm_region_t *region;
+    shm_ring_t *tx, *rx;
+} shm_link_t;
+
+static inline void shm_kick(int efd)
+{
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("eventfd write error");
+    }
+}
+
+// 发一帧：返回 0 成功，-1 表示环满了（等 efd_in 可读后重试）
+static inline int shm_link_send(shm_link_t *l, const void *data, size_t len)
+{
+    shm_ring_t *r = l->tx;
+    uint32_t head = r->head;
+    if (len > sizeof(r->slots[0].data)) {
+        return -1;
+    }
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == SHM_RING_SLOTS) {
+        // 满了：先登记“在等空位”，再看一次，避免和消费者擦肩而过
+        __atomic_store_n(&r->producer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == SHM_RING_SLOTS) {
+            return -1;
+        }
+        __atomic_store_n(&r->producer_waiting, 0, __ATOMIC_RELAXED);
+    }
+    shm_slot_t *s = &r->slots[head & (SHM_RING_SLOTS - 1)];
+    s->len = len;
+    memcpy(s->data, data, len);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->consumer_waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&r->consumer_waiting, 0, __ATOMIC_RELAXED)) {
+        shm_kick(l->efd_out);
+    }
+    return 0;
+}
+
+// 收一帧：返回帧长度，0 表示环是空的
+static inline size_t shm_link_recv(shm_link_t *l, void *buf, size_t cap)
+{
+    shm_ring_t *r = l->rx;
+    uint32_t tail = r->tail;
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    shm_slot_t *s = &r->slots[tail & (SHM_RING_SLOTS - 1)];
+    size_t len = s->len < cap ? s->len : cap;
+    memcpy(buf, s->data, len);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->producer_waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&r->producer_waiting, 0, __ATOMIC_RELAXED)) {
+        shm_kick(l->efd_out);
+    }
+    return len;
+}
+
+// 收空之后、睡觉之前调用：清掉 efd_in，登记“在睡觉”。
+// 返回 1 表示可以去 epoll_wait 了，0 表示这期间又来了数据，继续收
+static inline int shm_link_idle(shm_link_t *l)
+{
+    uint64_t cnt;
+    if (read(l->efd_in, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        perror("eventfd read error");
+    }
+    shm_ring_t *r = l->rx;
+    __atomic_store_n(&r->consumer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (r->tail != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+// 带 fd 发一段数据（SCM_RIGHTS）
+static inline int shm_send_fds(int sock, const void *data, size_t len, const int *fds, int nfds)
+{
+    struct iovec iov = { (void *)data, len };
+    char ctrl[CMSG_SPACE(sizeof(int) * 4)];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    memset(ctrl, 0, sizeof(ctrl));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    return sendmsg(sock, &mh, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+// 客户端：连上服务器的 Unix 域套接字，映射共享内存。成功返回 0
+static inline int shm_connect(const char *path, shm_link_t *l)
+{
+    struct sockaddr_un uaddr;
+    memset(l, 0, sizeof(*l));
+    l->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (l->sock < 0) {
+        perror("socket error"); return -1;
+    }
+    memset(&uaddr, 0, sizeof(uaddr));
+    uaddr.sun_family = AF_UNIX;
+    snprintf(uaddr.sun_path, sizeof(uaddr.sun_path), "%s", path);
+    if (connect(l->sock, (struct sockaddr *)&uaddr, sizeof(uaddr)) < 0) {
+        perror("connect error"); close(l->sock); return -1;
+    }
+
+    // 收握手：shm_hello_t + 3 个 fd（memfd、上行 eventfd、下行 eventfd）
+    shm_hello_t hello;
+    struct iovec iov = { &hello, sizeof(hello) };
+    char ctrl[CMSG_SPACE(sizeof(int) * 3)];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl;
+    mh.msg_controllen = sizeof(ctrl);
+    struct cmsghdr *cm;
+    if (recvmsg(l->sock, &mh, MSG_WAITALL) != sizeof(hello) ||
+        (cm = CMSG_FIRSTHDR(&mh)) == NULL || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(int) * 3)) {
+        printf("local handshake failed\n");
+        close(l->sock);
+        return -1;
+    }
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    if (hello.magic != SHM_MAGIC || hello.slots != SHM_RING_SLOTS ||
+        hello.slot_size != SHM_SLOT_SIZE || hello.region_size != sizeof(shm_region_t)) {
+        printf("local transport version mismatch\n");
+        close(fds[0]); close(fds[1]); close(fds[2]); close(l->sock);
+        return -1;
+    }
+    l->region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (l->region == MAP_FAILED) {
+        perror("mmap error");
+        close(fds[1]); close(fds[2]); close(l->sock);
+        return -1;
+    }
+    l->efd_out = fds[1];
+    l->efd_in = fds[2];
+    l->tx = &l->region->up;
+    l->rx = &l->region->down;
+    return 0;
+}
+
+static inline void shm_link_close(shm_link_t *l)
+{
+    if (l->region != NULL) munmap(l->region, sizeof(shm_region_t));
+    close(l->efd_in);
+    close(l->efd_out);
+    close(l->sock);
+    l->region = NULL;
+}
+
+#endif
@@ -0,0 +1,529 @@
+/* --- tcp_bench.c (TCP 压测工具) --- */
+// 用法: ./tcp_bench [-h ip] [-p port] [-c clients] [-a abusive_percent] [-t seconds]
+//                   [-r rate] [-w who_rate] [-P probe_rate] [-f file_bytes] [-U local_sock]
+// 开 clients 个连接，其中 abusive_percent% 的连接不停刷屏，
+// 其余连接每秒发 rate 条正常聊天，并每秒发 who_rate 次 \who。
+// 第 0 个连接只收不发，作为“观察者”，每秒打印它收到的正常消息数和刷屏消息数，
+// 用来看服务器在被刷屏时吞吐是否稳定。
+// -P：观察者每秒给自己发 probe_rate 条私聊（轻量请求），统计往返延迟分位数。
+//     这时观察者单独一个线程收发，不和其它连接挤一个循环，量到的才是服务器的延迟。
+// -f：另开两个用户 xa -> xb 循环传 file_bytes 大小的文件，统计传输速率，
+//     同时看聊天延迟受不受影响。
+// -U：聊天连接不走 TCP，改走服务器的本机共享内存传输（CHAT_LOCAL_SOCK），对比两者的吞吐和延迟。
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include "shm_ring.h"
+
+typedef struct
+{
+    char type;      // 消息类型 L C Q W P
+    char id[32];    // 用户id
+    char text[128]; // 消息内容
+} msg_t;
+
+// 每个压测连接的状态
+typedef struct
+{
+    int fd;
+    int local;        // 1 = 走共享内存环（link），fd 是 link.efd_in
+    shm_link_t link;
+    int abusive;      // 1 = 刷屏连接
+    double credit;    // 正常连接：当前可以发送的条数
+    double who_credit; // 当前可以发送的 \who 次数
+    char inbuf[sizeof(msg_t)];
+    size_t inlen;     // inbuf 中已收到的字节数
+} bench_conn_t;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bench_connect(const char *ip, int port, const char *id)
+{
+    struct sockaddr_in saddr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket error"); return -1;
+    }
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = inet_addr(ip);
+    saddr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+        perror("connect error"); close(fd); return -1;
+    }
+
+    msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 'L';
+    snprintf(msg.id, sizeof(msg.id), "%s", id);
+    if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg)) {
+        perror("send login error"); close(fd); return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// 走本机共享内存传输登录，返回 0 成功
+static int bench_connect_local(const char *path, const char *id, shm_link_t *link)
+{
+    if (shm_connect(path, link) < 0) {
+        return -1;
+    }
+    msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 'L';
+    snprintf(msg.id, sizeof(msg.id), "%s", id);
+    if (shm_link_send(link, &msg, sizeof(msg)) < 0) {
+        printf("send login error\n"); shm_link_close(link); return -1;
+    }
+    return 0;
+}
+
+// 不阻塞地收一帧到 c->inbuf：收齐返回 1，暂时没有返回 0，连接断开返回 -1
+static int bench_recv(bench_conn_t *c)
+{
+    if (c->local) {
+        while (shm_link_recv(&c->link, c->inbuf, sizeof(msg_t)) == 0) {
+            if (shm_link_idle(&c->link)) return 0;
+        }
+        return 1;
+    }
+    while (1) {
+        ssize_t r = recv(c->fd, c->inbuf + c->inlen, sizeof(msg_t) - c->inlen, 0);
+        if (r <= 0) {
+            return r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ? -1 : 0;
+        }
+        c->inlen += r;
+        if (c->inlen == sizeof(msg_t)) {
+            c->inlen = 0;
+            return 1;
+        }
+    }
+}
+
+// 不阻塞地发一帧，发不出去（缓冲区 / 环满了）返回 0
+static int bench_send(bench_conn_t *c, const msg_t *msg)
+{
+    if (c->local) {
+        return shm_link_send(&c->link, msg, sizeof(*msg)) == 0;
+    }
+    return send(c->fd, msg, sizeof(*msg), MSG_DONTWAIT) == sizeof(*msg);
+}
+
+// 观察者本秒收到的正常消息和刷屏消息（-P 时由观察者线程累加）
+long seen_normal, seen_abusive;
+
+// 观察者收到一帧
+static void observe(const msg_t *in, long long *lat, long *nlat, long max_lat)
+{
+    if (strncmp(in->id, "n0 (private)", 12) == 0) {
+        // 自己发给自己的探测私聊：text 里是发送时刻
+        if (*nlat < max_lat) lat[(*nlat)++] = now_ns() - atoll(in->text);
+    } else if (in->id[0] == 'n') {
+        __atomic_add_fetch(&seen_normal, 1, __ATOMIC_RELAXED);
+    } else if (in->id[0] == 'a') {
+        __atomic_add_fetch(&seen_abusive, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// -P：观察者线程的参数和结果
+typedef struct
+{
+    bench_conn_t *c;
+    double rate;
+    volatile int stop;
+    long long *lat;
+    long nlat, max_lat;
+} probe_t;
+
+// 观察者线程：只管 0 号连接，收完所有数据，按速率给自己发探测私聊
+static void *probe_thread(void *arg)
+{
+    probe_t *pr = (probe_t *)arg;
+    msg_t probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.type = 'P';
+    struct pollfd pfd = { pr->c->fd, POLLIN, 0 };
+    double credit = 0, last = now_sec();
+    while (!pr->stop) {
+        poll(&pfd, 1, 1);
+        int r;
+        while ((r = bench_recv(pr->c)) > 0) {
+            observe((msg_t *)pr->c->inbuf, pr->lat, &pr->nlat, pr->max_lat);
+        }
+        if (r < 0) {
+            break; // 被服务器断开
+        }
+        double now = now_sec();
+        credit += (now - last) * pr->rate;
+        last = now;
+        while (credit >= 1.0) {
+            credit -= 1.0;
+            snprintf(probe.text, sizeof(probe.text), "n0 %lld", now_ns());
+            bench_send(pr->c, &probe);
+        }
+    }
+    return NULL;
+}
+
+// 文件传输压测的参数和结果
+typedef struct
+{
+    const char *ip;
+    int port;
+    long long size;       // 每个文件的大小
+    volatile int stop;
+    long long bytes;      // 已完成的字节数
+    int files;            // 已完成的文件数
+} xfer_bench_t;
+
+// 在控制连接上一直读，直到收到一个 'F' 帧
+static int wait_file_msg(int fd, msg_t *msg)
+{
+    while (recv(fd, msg, sizeof(*msg), MSG_WAITALL) == sizeof(*msg)) {
+        if (msg->type == 'F') {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int data_connect(const char *ip, int port, const char *cmd)
+{
+    struct sockaddr_in saddr;
+    msg_t msg;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = inet_addr(ip);
+    saddr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+        close(fd); return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 'D';
+    snprintf(msg.text, sizeof(msg.text), "%s", cmd);
+    send(fd, &msg, sizeof(msg), 0);
+    return fd;
+}
+
+typedef struct
+{
+    xfer_bench_t *xb;
+    char token[32];
+} download_args_t;
+
+// 接收方：读完整个文件（丢弃内容）
+static void *download_thread(void *arg)
+{
+    download_args_t *d = (download_args_t *)arg;
+    char cmd[64], buf[65536];
+    msg_t hdr;
+    snprintf(cmd, sizeof(cmd), "GET %s", d->token);
+    int fd = data_connect(d->xb->ip, d->xb->port, cmd);
+    if (fd >= 0 && recv(fd, &hdr, sizeof(hdr), MSG_WAITALL) == sizeof(hdr)) {
+        long long got = 0;
+        ssize_t n;
+        while (got < d->xb->size && (n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+            got += n;
+        }
+        if (got == d->xb->size) {
+            __atomic_add_fetch(&d->xb->bytes, got, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&d->xb->files, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+// xa 不停地给 xb 发文件
+static void *xfer_bench_thread(void *arg)
+{
+    xfer_bench_t *xb = (xfer_bench_t *)arg;
+    const char *path = "/tmp/tcp_bench_file";
+    int file_fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (file_fd < 0 || ftruncate(file_fd, xb->size) < 0) {
+        perror("bench file error"); return NULL;
+    }
+    int a = bench_connect(xb->ip, xb->port, "xa");
+    int b = bench_connect(xb->ip, xb->port, "xb");
+    if (a < 0 || b < 0) return NULL;
+    fcntl(a, F_SETFL, fcntl(a, F_GETFL) & ~O_NONBLOCK);
+    fcntl(b, F_SETFL, fcntl(b, F_GETFL) & ~O_NONBLOCK);
+
+    msg_t msg;
+    while (!xb->stop) {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = 'F';
+        snprintf(msg.text, sizeof(msg.text), "xb %lld %s", xb->size, path);
+        send(a, &msg, sizeof(msg), 0);
+
+        char token[32];
+        download_args_t d;
+        d.xb = xb;
+        if (wait_file_msg(b, &msg) < 0 || sscanf(msg.text, "%31s", d.token) != 1) break;
+        if (wait_file_msg(a, &msg) < 0 || sscanf(msg.text, "UP %31s", token) != 1) break;
+
+        pthread_t tid;
+        pthread_create(&tid, NULL, download_thread, &d);
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "UP %s", token);
+        int fd = data_connect(xb->ip, xb->port, cmd);
+        off_t off = 0;
+        while (fd >= 0 && off < xb->size && sendfile(fd, file_fd, &off, xb->size - off) > 0) {
+        }
+        pthread_join(tid, NULL);
+        if (fd >= 0) close(fd);
+    }
+    close(a);
+    close(b);
+    close(file_fd);
+    unlink(path);
+    return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 打印延迟分位数（单位微秒）
+static void print_latency(long long *lat, long n)
+{
+    if (n == 0) {
+        printf("latency: no samples\n");
+        return;
+    }
+    qsort(lat, n, sizeof(long long), cmp_ll);
+    double pct[] = { 50, 90, 99, 99.9, 99.99 };
+    printf("latency (us, %ld samples):", n);
+    for (int i = 0; i < 5; i++) {
+        long idx = (long)(n * pct[i] / 100.0);
+        if (idx >= n) idx = n - 1;
+        printf("  p%g=%.1f", pct[i], lat[idx] / 1000.0);
+    }
+    printf("  max=%.1f\n", lat[n - 1] / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *ip = "127.0.0.1";
+    int port = 8888;
+    int nclients = 100;
+    double abusive_pct = 0;
+    int seconds = 10;
+    double rate = 1.0;
+    double who_rate = 0;
+    double probe_rate = 0;
+    long long file_bytes = 0;
+    const char *local_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:a:t:r:w:P:f:U:")) != -1) {
+        switch (opt) {
+        case 'h': ip = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': nclients = atoi(optarg); break;
+        case 'a': abusive_pct = atof(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'w': who_rate = atof(optarg); break;
+        case 'P': probe_rate = atof(optarg); break;
+        case 'f': file_bytes = atoll(optarg); break;
+        case 'U': local_path = optarg; break;
+        default:
+            printf("usage:./tcp_bench [-h ip] [-p port] [-c clients] [-a abusive_percent] "
+                   "[-t seconds] [-r rate] [-w who_rate] [-P probe_rate] [-f file_bytes] "
+                   "[-U local_sock]\n");
+            return -1;
+        }
+    }
+    if (nclients < 2) {
+        printf("need at least 2 clients\n");
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    int nabusive = (int)(nclients * abusive_pct / 100.0 + 0.5);
+    int epfd = epoll_create1(0);
+    bench_conn_t *conns = calloc(nclients, sizeof(bench_conn_t));
+
+    // 1. 建立所有连接：0 号是观察者，最后 nabusive 个是刷屏连接
+    for (int i = 0; i < nclients; i++) {
+        char id[32];
+        conns[i].abusive = i >= nclients - nabusive;
+        snprintf(id, sizeof(id), "%c%d", conns[i].abusive ? 'a' : 'n', i);
+        if (local_path != NULL) {
+            if (bench_connect_local(local_path, id, &conns[i].link) < 0) {
+                return -1;
+            }
+            conns[i].local = 1;
+            conns[i].fd = conns[i].link.efd_in;
+        } else {
+            conns[i].fd = bench_connect(ip, port, id);
+            if (conns[i].fd < 0) {
+                return -1;
+            }
+        }
+        if (i == 0 && probe_rate > 0) {
+            continue; // 观察者由观察者线程收
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+    }
+    printf("%d %s clients connected (%d abusive), normal rate %.1f msg/s each\n",
+           nclients, local_path != NULL ? "local" : "tcp", nabusive, rate);
+
+    // 2. 主循环：收所有连接的数据（否则服务器会被阻塞在 send 上），按速率发送
+    msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 'C';
+    strcpy(msg.text, "hello from tcp_bench");
+
+    long normal_sent = 0, abusive_sent = 0;
+    msg_t who;
+    memset(&who, 0, sizeof(who));
+    who.type = 'W';
+    probe_t pr;
+    memset(&pr, 0, sizeof(pr));
+    pr.c = &conns[0];
+    pr.rate = probe_rate;
+    pr.max_lat = (long)(probe_rate * seconds) + 16;
+    pr.lat = malloc(sizeof(long long) * pr.max_lat);
+    pthread_t probe_tid;
+    if (probe_rate > 0) {
+        pthread_create(&probe_tid, NULL, probe_thread, &pr);
+    }
+
+    // 文件传输压测在单独的线程里跑
+    xfer_bench_t xb;
+    memset(&xb, 0, sizeof(xb));
+    xb.ip = ip;
+    xb.port = port;
+    xb.size = file_bytes;
+    pthread_t xfer_tid;
+    if (file_bytes > 0) {
+        pthread_create(&xfer_tid, NULL, xfer_bench_thread, &xb);
+    }
+
+    long total_normal = 0, total_abusive = 0;   // 观察者一共收到的
+    double start = now_sec(), last_tick = start, last_report = start;
+    struct epoll_event events[256];
+
+    while (now_sec() - start < seconds) {
+        int n = epoll_wait(epfd, events, 256, 5);
+        for (int k = 0; k < n; k++) {
+            bench_conn_t *c = &conns[events[k].data.u32];
+            int r;
+            while ((r = bench_recv(c)) > 0) {
+                if (c == &conns[0]) {
+                    observe((msg_t *)c->inbuf, pr.lat, &pr.nlat, pr.max_lat);
+                }
+            }
+            if (r < 0 && !c->local) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL); // 被服务器断开
+            }
+        }
+
+        double now = now_sec();
+        double dt = now - last_tick;
+        last_tick = now;
+        for (int i = 1; i < nclients; i++) {
+            bench_conn_t *c = &conns[i];
+            if (c->abusive) {
+                // 刷屏：一直发到发送缓冲区写满为止
+                while (bench_send(c, &msg)) {
+                    abusive_sent++;
+                }
+                continue;
+            }
+            c->credit += dt * rate;
+            while (c->credit >= 1.0) {
+                if (!bench_send(c, &msg)) {
+                    break;
+                }
+                c->credit -= 1.0;
+                normal_sent++;
+            }
+            c->who_credit += dt * who_rate;
+            while (c->who_credit >= 1.0) {
+                if (!bench_send(c, &who)) {
+                    break;
+                }
+                c->who_credit -= 1.0;
+            }
+        }
+
+        if (now - last_report >= 1.0) {
+            long normal = __atomic_exchange_n(&seen_normal, 0, __ATOMIC_RELAXED);
+            long abusive = __atomic_exchange_n(&seen_abusive, 0, __ATOMIC_RELAXED);
+            printf("[%5.1fs] observer got normal %6ld/s  abusive %6ld/s\n", now - start, normal, abusive);
+            total_normal += normal;
+            total_abusive += abusive;
+            last_report = now;
+        }
+    }
+
+    double elapsed = now_sec() - start;
+    if (probe_rate > 0) {
+        pr.stop = 1;
+        pthread_join(probe_tid, NULL);
+    }
+    total_normal += seen_normal;
+    total_abusive += seen_abusive;
+    printf("--- summary (%.1fs) ---\n", elapsed);
+    printf("normal  sent %ld, observer got %ld (%.1f%%), %.0f msg/s\n",
+           normal_sent, total_normal,
+           normal_sent ? 100.0 * total_normal / normal_sent : 0.0,
+           total_normal / elapsed);
+    printf("abusive sent %ld, observer got %ld\n", abusive_sent, total_abusive);
+    if (probe_rate > 0) {
+        print_latency(pr.lat, pr.nlat);
+    }
+    if (file_bytes > 0) {
+        xb.stop = 1;
+        printf("file transfer: %d files, %.1f MB, %.1f MB/s\n",
+               xb.files, xb.bytes / 1e6, xb.bytes / 1e6 / elapsed);
+        pthread_join(xfer_tid, NULL);
+    }
+    free(pr.lat);
+
+    for (int i = 0; i < nclients; i++) {
+        if (conns[i].local) {
+            shm_link_close(&conns[i].link);
+        } else {
+            close(conns[i].fd);
+        }
+    }
+    free(conns);
+    close(epfd);
+    return 0;
+}
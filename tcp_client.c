@@ -10,130 +10,266 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "chat_client.h"
 
-typedef struct
+struct sockaddr_in saddr; // [TCP] 这是服务器地址（文件传输要另开连接，所以设为全局）
+
+// 新开一条文件数据连接，第一帧是 'D' + 命令（"UP <token>" 或 "GET <token>"）
+int data_connect(const char *cmd)
 {
-    char type;      // 消息类型 L C Q W P
-    char id[32];    // 用户id
-    char text[128]; // 消息内容
-} msg_t;
+    msg_t msg;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket error"); return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+        perror("connect error"); close(fd); return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 'D';
+    snprintf(msg.text, sizeof(msg.text), "%s", cmd);
+    if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg)) {
+        perror("send error"); close(fd); return -1;
+    }
+    return fd;
+}
 
-int main(int argc, char const *argv[])
+// 上传：服务器回了 "UP <token> <路径>" 之后，用 sendfile 把文件发过去
+void file_upload(const char *token, const char *path)
 {
-    if (argc != 3) {
-        printf("usage:./client <ip> <port> \n");
-        return -1;
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "UP %s", token);
+    int file_fd = open(path, O_RDONLY);
+    if (file_fd < 0) {
+        perror("open file error"); return;
+    }
+    int fd = data_connect(cmd);
+    if (fd < 0) {
+        close(file_fd); return;
     }
 
-    int sockfd;
-    msg_t msg;
-    struct sockaddr_in saddr; // [TCP] 这是服务器地址
+    struct stat st;
+    fstat(file_fd, &st);
+    off_t off = 0;
+    while (off < st.st_size) {
+        if (sendfile(fd, file_fd, &off, st.st_size - off) <= 0) {
+            perror("sendfile error");
+            break;
+        }
+    }
+    printf("文件 %s 已发送 %lld 字节\n", path, (long long)off);
+    close(fd);
+    close(file_fd);
+}
 
-    // 1. 创建 TCP 套接字
-    sockfd = socket(AF_INET, SOCK_STREAM, 0); // [TCP] SOCK_STREAM
-    if (sockfd < 0) {
-        perror("socket error"); return -1;
+// 下载：输入 /get <token>，文件保存为 recv_<文件名>
+void file_download(const char *token)
+{
+    char cmd[64];
+    msg_t hdr;
+    snprintf(cmd, sizeof(cmd), "GET %s", token);
+    int fd = data_connect(cmd);
+    if (fd < 0) {
+        return;
     }
 
-    // 2. 准备服务器地址
-    memset(&saddr, 0, sizeof(saddr));
-    saddr.sin_family = AF_INET;
-    saddr.sin_addr.s_addr = inet_addr(argv[1]);
-    saddr.sin_port = htons(atoi(argv[2]));
+    // 第一帧：'F' "<大小> <文件名>"
+    ssize_t n = recv(fd, &hdr, sizeof(hdr), MSG_WAITALL);
+    long long size;
+    char name[100], save[128];
+    if (n != sizeof(hdr) || sscanf(hdr.text, "%lld %99[^\n]", &size, name) < 2) {
+        printf("文件 %s 不存在或已过期\n", token);
+        close(fd); return;
+    }
+    for (char *p = name; *p; p++) {
+        if (*p == '/') *p = '_'; // 不允许写到别的目录
+    }
+    snprintf(save, sizeof(save), "recv_%s", name);
+    int file_fd = open(save, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (file_fd < 0) {
+        perror("open file error"); close(fd); return;
+    }
 
-    // 3. [TCP] 连接 (Connect)
-    if (connect(sockfd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
-        perror("connect error");
-        return -1;
+    char buf[65536];
+    long long got = 0;
+    while (got < size && (n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        if (write(file_fd, buf, n) != n) {
+            perror("write error"); break;
+        }
+        got += n;
     }
-    printf("Connected to server!\n");
+    printf("文件已保存为 %s (%lld/%lld 字节)\n", save, got, size);
+    close(file_fd);
+    close(fd);
+}
 
-    // 4. [TCP] 发送登录包
-    memset(&msg, 0, sizeof(msg));
-    msg.type = 'L';
-    printf("Please input your id: ");
-    scanf("%[^\n]", msg.id);
-    getchar();
+chat_loop_t *loop;
+chat_conn_t *conn; // 输入 id 之后才连接
+int done;
 
-    if (send(sockfd, &msg, sizeof(msg), 0) < 0) { // [TCP] 使用 send
-        perror("send login error");
-        return -1;
+// \who 和 /msg 的回复
+void on_reply(chat_conn_t *c, int status, const char *text, void *arg)
+{
+    (void)c; (void)arg;
+    if (status == CHAT_TIMEOUT) {
+        printf("请求超时\n");
+    } else if (status == CHAT_OK && strcmp(text, "ok") != 0) { // 私聊成功不用提示
+        printf("Server: %s\n", text);
     }
+}
 
-    // 5. fork() 分裂
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork error"); return -1;
+// 服务器推送的消息
+void on_msg(chat_conn_t *c, const msg_t *msg, void *ud)
+{
+    (void)c; (void)ud;
+    // 文件相关的通知
+    if (msg->type == 'F') {
+        char token[32], name[100];
+        long long size;
+        if (strcmp(msg->id, "Server") == 0 && sscanf(msg->text, "UP %31s %99[^\n]", token, name) == 2) {
+            if (fork() == 0) { // 服务器同意了，开始上传（阻塞的文件读写放到子进程里做）
+                file_upload(token, name);
+                exit(0);
+            }
+        } else if (sscanf(msg->text, "%31s %lld %99[^\n]", token, &size, name) == 3) {
+            printf("%s 发来文件 %s (%lld 字节)，输入 /get %s 接收\n", msg->id, name, size, token);
+        }
+        return;
     }
-    else if (pid == 0) // 子进程 (嘴巴) - 负责发送
-    {
-        char input_buf[160]; // 缓冲区
 
-        while (1)
-        {
-            memset(&msg, 0, sizeof(msg));
-            memset(input_buf, 0, sizeof(input_buf));
+    // 收到消息，打印
+    printf("%s: %s\n", msg->id, msg->text);
+}
 
-            scanf("%[^\n]", input_buf);
-            getchar(); // 吸收换行符
+void on_open(chat_conn_t *c, void *ud)
+{
+    (void)c; (void)ud;
+    printf("Connected to server!\n");
+}
 
-            // 检查是否为 "quit"
-            if (strncmp(input_buf, "quit", 4) == 0)
-            {
-                msg.type = 'Q'; // 虽然服务器不会处理'Q'，但客户端用它来退出
-                // [TCP] send()
-                send(sockfd, &msg, sizeof(msg), 0); // 发送一个空包，让服务器的recv>0
-                kill(getppid(), SIGKILL); // 杀死父进程
-                break; // 子进程退出
-            }
-            // 检查是否为 "\who"
-            else if(strncmp(input_buf, "\\who", 4) == 0) {
-                msg.type = 'W';
-            }
-            // 检查是否为 "/msg" (私聊)
-            else if(strncmp(input_buf, "/msg ", 5) == 0) {
-                msg.type = 'P';
-                strcpy(msg.text, input_buf + 5); 
-            }
-            // 否则，就是普通聊天
-            else {
-                msg.type = 'C';
-                strcpy(msg.text, input_buf);
-            }
-            
-            // [TCP] 统一使用 send()
-            if (send(sockfd, &msg, sizeof(msg), 0) < 0) {
-                perror("send error");
-                break; // 发送失败，退出
-            }
+void on_close(chat_conn_t *c, int err, void *ud)
+{
+    (void)c; (void)ud;
+    if (err == 0) {
+        printf("Server has closed the connection.\n");
+    } else {
+        printf("connection error: %s\n", strerror(err));
+    }
+    conn = NULL;
+    done = 1;
+}
+
+// 键盘输入的一行；line 为 NULL 表示 stdin 结束，按 quit 处理
+void on_line(const char *line, void *arg)
+{
+    char *ip_port = (char *)arg;
+    if (done) {
+        return;
+    }
+    if (line == NULL || strncmp(line, "quit", 4) == 0) {
+        if (conn != NULL) {
+            chat_close(conn); // 发 'Q' 之后关闭
         }
-        exit(0);
-    }
-    else // 父进程 (耳朵) - 负责接收
-    {
-        ssize_t n;
-        while (1)
-        {
-            memset(&msg, 0, sizeof(msg));
-            // [TCP] 使用 recv()
-            n = recv(sockfd, &msg, sizeof(msg), 0);
-
-            // 6. [TCP] 检查服务器是否断开
-            if (n <= 0) {
-                if (n == 0) {
-                    printf("Server has closed the connection.\n");
-                } else {
-                    perror("recv error");
-                }
-                kill(pid, SIGKILL); // 杀死子进程
-                break; // 退出循环
-            }
-            
-            // 收到消息，打印
-            printf("%s: %s\n", msg.id, msg.text);
+        done = 1;
+        return;
+    }
+
+    // 第一行是登录 id
+    if (conn == NULL) {
+        static const chat_handler_t h = { on_open, on_msg, on_close };
+        conn = chat_connect(loop, CHAT_TCP, ip_port, ntohs(saddr.sin_port), line, &h, NULL);
+        if (conn == NULL) {
+            done = 1;
+        }
+        return;
+    }
+
+    // 检查是否为 "\who"
+    if (strncmp(line, "\\who", 4) == 0) {
+        chat_who(conn, on_reply, NULL);
+    }
+    // 检查是否为 "/msg" (私聊)
+    else if (strncmp(line, "/msg ", 5) == 0) {
+        char target[32];
+        int skip = 0;
+        if (sscanf(line + 5, "%31s %n", target, &skip) < 1 || skip == 0) {
+            printf("usage: /msg <user> <text>\n");
+            return;
+        }
+        chat_private(conn, target, line + 5 + skip, on_reply, NULL);
+    }
+    // 检查是否为 "/file" (发文件，* 表示发给所有人)
+    else if (strncmp(line, "/file ", 6) == 0) {
+        char target[32], path[71];
+        struct stat st;
+        msg_t msg;
+        if (sscanf(line + 6, "%31s %70[^\n]", target, path) < 2 || stat(path, &st) < 0) {
+            printf("usage: /file <user|*> <path>\n");
+            return;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.type = 'F';
+        snprintf(msg.text, sizeof(msg.text), "%s %lld %s", target, (long long)st.st_size, path);
+        chat_send_frame(conn, &msg);
+    }
+    // 检查是否为 "/search" (搜聊天记录，结果由服务器以 Search 的名义发回)
+    else if (strncmp(line, "/search ", 8) == 0) {
+        msg_t msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = 'S';
+        snprintf(msg.text, sizeof(msg.text), "%s", line + 8);
+        chat_send_frame(conn, &msg);
+    }
+    // 检查是否为 "/get" (接收文件)
+    else if (strncmp(line, "/get ", 5) == 0) {
+        if (fork() == 0) {
+            file_download(line + 5);
+            exit(0);
+        }
+    }
+    // 否则，就是普通聊天
+    else {
+        chat_send_chat(conn, line);
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc != 3) {
+        printf("usage:./client <ip> <port> \n");
+        return -1;
+    }
+
+    // 1. 服务器地址（文件传输另开连接时也要用）
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = inet_addr(argv[1]);
+    saddr.sin_port = htons(atoi(argv[2]));
+
+    // 2. 事件循环：键盘输入和服务器消息都在这一个循环里处理，不再 fork 收发进程
+    signal(SIGCHLD, SIG_IGN); // 文件传输的子进程自动回收
+    loop = chat_loop_new();
+    if (loop == NULL) {
+        return -1;
+    }
+    // 登录时请求压缩（补发的聊天记录、在线名单比较大），CHAT_ZLIB=0 关掉
+    chat_loop_set_zlib(loop, getenv("CHAT_ZLIB") == NULL || atoi(getenv("CHAT_ZLIB")) != 0);
+    if (chat_loop_watch_lines(loop, STDIN_FILENO, on_line, (void *)argv[1]) < 0) {
+        return -1;
+    }
+    printf("Please input your id: ");
+    fflush(stdout);
+
+    // 3. 一直跑到 quit / stdin 结束 / 服务器断开
+    while (!done) {
+        if (chat_loop_run(loop, -1) < 0) {
+            break;
         }
-        wait(NULL);
     }
-    close(sockfd);
+    chat_loop_run(loop, 0); // 把 'Q' 发出去
+    chat_loop_free(loop);
     return 0;
-}
\ No newline at end of file
+}
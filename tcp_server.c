@@ -1,4 +1,15 @@
 /* --- tcp_server.c (TCP Version) --- */
+// 线程模型：
+//   主线程       只负责 accept，把新连接轮流分给 I/O 线程
+//   I/O 线程     epoll 读数据、切成 msg_t、过限流，然后把请求丢进线程池；
+//                另外负责把连接出站队列里的数据写回 socket
+//   工作线程池   执行登录 / 群聊 / who / 私聊等命令逻辑（work_pool.c），
+//                结果放进目标连接的出站队列，由该连接所属的 I/O 线程发送
+//   传输线程     文件走单独的数据连接（第一帧是 'D'），交给 file_xfer.c 零拷贝转发
+//   本机门卫线程 设置了 CHAT_LOCAL_SOCK 时接受本机客户端，帧走共享内存环（shm_ring.h），
+//                之后和 TCP 连接一样交给 I/O 线程
+// 每个连接固定映射到一个 strand，同一连接的请求按顺序执行。
+#define _GNU_SOURCE // memfd_create
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -10,49 +21,208 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <sys/select.h> 
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include "rate_limit.h"
+#include "work_pool.h"
+#include "file_xfer.h"
+#include "chat_trace.h"
+#include "shm_ring.h"
+#include "chat_history.h"
+#include "chat_zlib.h"
 
 typedef struct
 {
-    char type;      // 消息类型 L C Q W P
+    char type;      // 消息类型 L C Q W P F D R S（服务器还会发压缩帧 'Z'，见 chat_zlib.h）
     char id[32];    // 用户id
     char text[128]; // 消息内容
 } msg_t;
 
+// 带编号的请求：'W' / 'P' 的 id 字段填 "#编号" 时，服务器用 'R' 帧回复，
+// id 是同一个 "#编号"，text 是结果（\who 的列表、私聊的 "ok" 或错误）。
+// 这样客户端可以同时发出很多请求，再按编号对上回复。不带编号时照旧用 'C' 回复
+#define is_tagged(msg) (((msg)->type == 'W' || (msg)->type == 'P') && (msg)->id[0] == '#')
+
+// 出站优先级（数字小的先发）。每个连接每一级一个队列，同一级内保持顺序，
+// 不同级之间高优先级的帧可以插到还没发出去的群聊前面
+#define PRIO_CTRL    0 // 服务器提示、错误、请求的回复（\who、带编号请求、搜索结果）
+#define PRIO_PRIVATE 1 // 私聊、发给自己的文件通知
+#define PRIO_ADMIN   2 // 管理员广播
+#define PRIO_BULK    3 // 群聊、上下线通知
+#define N_PRIO       4
+
+// 出站队列里的一帧（变长，目前都是一个 msg_t）
+typedef struct frame_t
+{
+    struct frame_t *next;
+    int prio;
+    size_t len;
+    size_t off; // 已经发出去的字节数
+    char data[];
+} frame_t;
+
+// 连接状态
+#define CONN_LOGIN  0 // 已连接，等待 'L' 登录包
+#define CONN_ONLINE 1 // 已提交登录，之后的请求都交给线程池
+#define CONN_CLOSED 2 // 读方向已关闭，等待下线清理
+
+// 连接类型
+#define CONN_TCP   0
+#define CONN_LOCAL 1 // 本机共享内存连接：fd 是 Unix 域控制套接字，帧走 link 里的环
+
+// 一个客户端连接
+typedef struct conn_t
+{
+    int fd;
+    int kind;        // CONN_TCP / CONN_LOCAL
+    int io;          // 所属 I/O 线程编号，只有这个线程读写 fd
+    int state;       // CONN_LOGIN / CONN_ONLINE / CONN_CLOSED（只有 I/O 线程改）
+    int refs;        // 引用计数（原子访问）
+    char id[32];     // 登录后的用户 id
+    int zlib;        // 客户端能收 'Z' 帧（I/O 线程登录时设置，压缩出错时在 z_lock 里清零）
+    strand_t *strand; // 本连接的请求串行队列（多个连接可能共用一个）
+    uint32_t trace_id; // 录制用的连接编号
+
+    // 入方向：只有 I/O 线程访问
+    char inbuf[sizeof(msg_t)];
+    size_t inlen;
+    bucket_t chat_bucket, pm_bucket, who_bucket; // 令牌桶
+
+    // 出方向：任何线程都可以往 out_head 追加，I/O 线程把它们搬到 wq 后按优先级发送
+    pthread_mutex_t out_lock;
+    frame_t *out_head[N_PRIO], *out_tail[N_PRIO];
+    int closing;                 // 下线清理已完成，发完剩余数据就关闭
+    frame_t *wq_head[N_PRIO], *wq_tail[N_PRIO]; // I/O 线程私有的待发送队列
+    frame_t *wq_cur;             // 只写出去一半的帧，必须先把它写完（I/O 线程私有）
+    int credit[N_PRIO];          // 加权模式下这一轮每一级还能发几帧（I/O 线程私有）
+    pthread_mutex_t z_lock;      // 保护 zc：压缩和排队要一起做，'Z' 帧的顺序就是压缩的顺序
+    zc_t *zc;                    // 压缩流，第一次发大批数据时才建
+    int epoll_events;            // 当前注册的 epoll 事件，-1 表示已从 epoll 移除（I/O 线程私有）
+
+    shm_link_t link;             // CONN_LOCAL：共享内存环和 eventfd（I/O 线程私有）
+
+    int in_flush;                // 已挂在 I/O 线程的待刷新链表上（受 io->lock 保护）
+    struct conn_t *flush_next;
+    int in_urgent;               // 已挂在加急链表上（受 io->lock 保护）
+    struct conn_t *urgent_next;
+    struct conn_t *dead_next;    // 已关闭、等本轮事件处理完再释放（I/O 线程私有）
+} conn_t;
+
 // 链表节点：存储客户端的“连接”和ID
 typedef struct node_t
 {
-    int conn_fd; // [TCP] 不再是 caddr，而是连接文件描述符
-    char id[32]; 
+    conn_t *conn; // [TCP] 连接对象（链表持有一个引用）
+    char id[32];
     struct node_t *next;
 } list;
 
-// 用于向“管理员”线程传递的参数
+// I/O 线程
 typedef struct
 {
-    list *head; // 共享的客户端链表
-} admin_args_t;
+    pthread_t tid;
+    int epfd;
+    int efd;              // eventfd：有连接需要刷出站数据
+    pthread_mutex_t lock; // 保护 flush_head 和 urgent_head
+    conn_t *flush_head;   // 待刷新的连接
+    conn_t *urgent_head;  // 有高优先级帧要发的连接，每轮先刷
+    conn_t *dead_head;    // 本轮 epoll_wait 中关闭的连接（I/O 线程私有）
+} io_thread_t;
+
+// strand 数组：连接轮流映射到这里。strand 不随连接释放，
+// 这样最后一个任务释放连接时，线程池还能安全地访问 strand
+#define N_STRANDS 4096
+
+// 交给线程池的一个请求
+typedef struct
+{
+    conn_t *conn;
+    msg_t msg;
+} job_t;
 
-// 用于向“客户端”线程传递的参数
+// 用于向“管理员”线程传递的参数
 typedef struct
 {
-    int conn_fd;
-    list *head;
-    struct sockaddr_in caddr; // 仍然传递它，用于打印日志
-} client_args_t;
+    list *head; // 共享的客户端链表
+} admin_args_t;
 
 // --- 全局变量 ---
 pthread_mutex_t list_mutex; // 保护链表的互斥锁
 list *head;                 // [TCP] 将链表头设为全局，方便所有线程访问
+rl_table_t rl;              // 限流配置（启动后只读）
+io_thread_t *io_threads;    // I/O 线程数组
+int n_io;                   // I/O 线程个数
+strand_t strands[N_STRANDS];
+unsigned int n_conns;       // 累计连接数：轮流分配 I/O 线程、strand 和录制编号（原子访问）
+
+// 出站调度方式（CHAT_PRIO，启动后只读）
+#define OUTQ_STRICT   0 // 默认：总是先发最高一级
+#define OUTQ_WEIGHTED 1 // CHAT_PRIO=w0,w1,w2,w3：每轮每一级最多发 w 帧，低优先级不会饿死
+#define OUTQ_FIFO     2 // CHAT_PRIO=fifo：不分级，全部按进队顺序（对比用）
+int outq_mode;
+int prio_weight[N_PRIO];
+
+// 压缩（启动后只读）
+int zlib_min;               // CHAT_ZLIB：一批至少多少字节才压缩，0 表示不压缩
+int zlib_level;             // CHAT_ZLIB_LEVEL
+int replay_n;               // CHAT_REPLAY：登录时补发最近几条聊天记录
+#define REPLAY_MAX 200
 
 // --- 函数声明 ---
 list *list_create(void);
 void *admin_handler(void *arg);   // 管理员线程 (从stdin读)
-void *client_handler(void *arg);  // [TCP] 客户端服务线程 (从socket读)
-void broadcast_msg(msg_t msg, int exclude_fd); // [TCP] 新的广播函数
+void *io_main(void *arg);         // [TCP] I/O 线程 (epoll)
+void *local_accept_main(void *arg); // 本机门卫线程 (Unix 域套接字)
+void broadcast_msg(msg_t msg, conn_t *exclude, int prio); // [TCP] 广播函数
+void send_notice(conn_t *c, const char *text);  // 只发给一个人的服务器提示
+void send_reply(conn_t *c, const char *tag, const char *text); // 回复带编号的请求
+void conn_send(conn_t *c, const void *data, size_t len, int prio); // 放进出站队列
+void conn_send_burst(conn_t *c, const msg_t *frames, int n); // 一批回复，够大就压缩
+void conn_ref(conn_t *c);
+void conn_unref(conn_t *c);
+conn_t *conn_new(int fd, int kind);
+int conn_register(conn_t *c);
+
+// 线程池里执行的命令逻辑
+void do_login(conn_t *c, msg_t msg);
+void do_chat(conn_t *c, msg_t msg);
+void do_who(conn_t *c, msg_t msg);
+void do_private(conn_t *c, msg_t msg);
+void do_file(conn_t *c, msg_t msg);
+void do_search(conn_t *c, msg_t msg);
+void do_logout(conn_t *c);
+
+static int env_int(const char *name, int def)
+{
+    const char *val = getenv(name);
+    return val != NULL ? atoi(val) : def;
+}
 
-// (我们不再需要 login, chat, quit, who, private_chat 这些单独的函数,
-//  因为它们的逻辑将被合并到 client_handler 中)
+// 读 CHAT_PRIO：空或 strict / fifo / 四个正整数权重
+static int outq_load(void)
+{
+    const char *val = getenv("CHAT_PRIO");
+    if (val == NULL || val[0] == '\0' || strcmp(val, "strict") == 0) {
+        outq_mode = OUTQ_STRICT;
+    } else if (strcmp(val, "fifo") == 0) {
+        outq_mode = OUTQ_FIFO;
+    } else if (sscanf(val, "%d,%d,%d,%d", &prio_weight[0], &prio_weight[1],
+                      &prio_weight[2], &prio_weight[3]) == 4 &&
+               prio_weight[0] > 0 && prio_weight[1] > 0 && prio_weight[2] > 0 && prio_weight[3] > 0) {
+        outq_mode = OUTQ_WEIGHTED;
+    } else {
+        printf("CHAT_PRIO should be strict, fifo or four weights like 8,4,2,1\n");
+        return -1;
+    }
+    return 0;
+}
 
 int main(int argc, char const *argv[])
 {
@@ -76,6 +246,7 @@ int main(int argc, char const *argv[])
 
     // 2. 端口复用
     int opt = 1;
+    signal(SIGPIPE, SIG_IGN); // 对端已断开时 send 返回错误，而不是杀死整个进程
     setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     // 3. 绑定 (Bind)
@@ -83,7 +254,7 @@ int main(int argc, char const *argv[])
     saddr.sin_family = AF_INET;
     saddr.sin_addr.s_addr = htonl(INADDR_ANY);
     saddr.sin_port = htons(atoi(argv[1]));
-    
+
     if (bind(listen_fd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
         perror("bind error"); exit(1);
     }
@@ -94,15 +265,60 @@ int main(int argc, char const *argv[])
     }
     printf("Server is listening on port %s...\n", argv[1]);
 
-    // 5. 初始化全局链表和互斥锁
+    // 5. 初始化全局链表、互斥锁、限流配置和文件暂存目录
+    rl_table_load(&rl);
+    if (outq_load() < 0) exit(1);
+    if (xfer_init(getenv("CHAT_SPOOL_DIR")) < 0) exit(1);
+    if (trace_open(getenv("CHAT_TRACE"), TRACE_TCP) < 0) exit(1);
+    if (hist_open(getenv("CHAT_HISTORY")) < 0) exit(1);
+    zlib_min = env_int("CHAT_ZLIB", 1024);
+    zlib_level = env_int("CHAT_ZLIB_LEVEL", 6);
+    replay_n = env_int("CHAT_REPLAY", 0);
+    if (replay_n > REPLAY_MAX) replay_n = REPLAY_MAX;
     head = list_create();
     if (head == NULL) exit(1);
-    
+
     if (pthread_mutex_init(&list_mutex, NULL) != 0) {
         perror("mutex init error"); exit(1);
     }
 
-    // 6. 创建“管理员”线程
+    // 6. 启动线程池和 I/O 线程
+    if (pool_start(env_int("CHAT_WORKERS", 0)) < 0) exit(1);
+    for (int i = 0; i < N_STRANDS; i++) {
+        strand_init(&strands[i]);
+    }
+
+    n_io = env_int("CHAT_IO_THREADS", 2);
+    if (n_io < 1) n_io = 1;
+    io_threads = calloc(n_io, sizeof(io_thread_t));
+    for (int i = 0; i < n_io; i++) {
+        io_thread_t *io = &io_threads[i];
+        io->epfd = epoll_create1(0);
+        io->efd = eventfd(0, EFD_NONBLOCK);
+        if (io->epfd < 0 || io->efd < 0) {
+            perror("epoll/eventfd error"); exit(1);
+        }
+        pthread_mutex_init(&io->lock, NULL);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL; // NULL 表示 eventfd
+        epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->efd, &ev);
+        if (pthread_create(&io->tid, NULL, io_main, io) != 0) {
+            perror("pthread_create (io) error"); exit(1);
+        }
+        pthread_detach(io->tid);
+    }
+
+    // 本机客户端走 Unix 域套接字 + 共享内存，默认不开
+    const char *local_path = getenv("CHAT_LOCAL_SOCK");
+    if (local_path != NULL && local_path[0] != '\0') {
+        if (pthread_create(&tid, NULL, local_accept_main, (void *)local_path) != 0) {
+            perror("pthread_create (local) error"); exit(1);
+        }
+        pthread_detach(tid);
+    }
+
+    // 7. 创建“管理员”线程
     admin_args_t *admin_args = malloc(sizeof(admin_args_t));
     admin_args->head = head;
     if (pthread_create(&tid, NULL, admin_handler, admin_args) != 0) {
@@ -110,7 +326,10 @@ int main(int argc, char const *argv[])
     }
     pthread_detach(tid);
 
-    // 7. [TCP] 主线程的“门卫”循环 (Accept loop)
+    // 8. [TCP] 主线程的“门卫”循环 (Accept loop)
+    // 全局登录准入：只有主线程用这个桶，不用加锁
+    bucket_t login_bucket;
+    rl_bucket_init(&login_bucket, &rl.login);
     while (1)
     {
         // Accept() 会阻塞，直到一个新客户端连接进来
@@ -120,22 +339,28 @@ int main(int argc, char const *argv[])
             continue; // 继续等待下一个
         }
 
+        // 重连风暴时，超过准入速率的新连接直接拒绝
+        if (rl_take(&login_bucket, &rl.login, rl_now()) != RL_PASS) {
+            msg_t busy;
+            memset(&busy, 0, sizeof(busy));
+            busy.type = 'C';
+            strcpy(busy.id, "Server");
+            strcpy(busy.text, "服务器繁忙，请稍后重试");
+            send(conn_fd, &busy, sizeof(busy), MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(conn_fd);
+            continue;
+        }
+
         printf("New client connected: IP=%s, Port=%d\n",
                inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port));
 
-        // 准备参数，传递给新的“服务员”线程
-        client_args_t *args = malloc(sizeof(client_args_t));
-        args->conn_fd = conn_fd;
-        args->head = head;
-        args->caddr = caddr; // caddr 只是为了日志
-
-        // 8. [TCP] 为这个新客户端创建一个专属线程
-        if (pthread_create(&tid, NULL, client_handler, args) != 0) {
-            perror("pthread_create (client) error");
-            close(conn_fd); // 创建失败，关闭这个连接
-            free(args);
+        // 9. [TCP] 创建连接对象，交给下一个 I/O 线程
+        fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL) | O_NONBLOCK);
+        conn_t *c = conn_new(conn_fd, CONN_TCP);
+        if (conn_register(c) < 0) {
+            conn_unref(c);
+            close(conn_fd);
         }
-        pthread_detach(tid); // 自动回收线程
     }
 
     close(listen_fd);
@@ -155,185 +380,1157 @@ list *list_create(void)
     return p;
 }
 
-// [TCP] 新的“服务员”线程函数
-void *client_handler(void *arg)
+void conn_ref(conn_t *c)
 {
-    // 1. 解析参数
-    client_args_t *args = (client_args_t *)arg;
-    int conn_fd = args->conn_fd;
-    list *head = args->head;
-    free(args); // 立即释放 malloc 的内存
-    args = NULL;
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
 
-    msg_t msg;
-    char client_id[32];
-    ssize_t n;
+static void frame_list_free(frame_t *f)
+{
+    while (f != NULL) {
+        frame_t *next = f->next;
+        free(f);
+        f = next;
+    }
+}
+
+void conn_unref(conn_t *c)
+{
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    for (int k = 0; k < N_PRIO; k++) {
+        frame_list_free(c->out_head[k]);
+        frame_list_free(c->wq_head[k]);
+    }
+    free(c->wq_cur);
+    zc_free(c->zc);
+    pthread_mutex_destroy(&c->out_lock);
+    pthread_mutex_destroy(&c->z_lock);
+    free(c);
+}
+
+// 创建连接对象，轮流分配 I/O 线程和 strand（主线程和本机门卫线程都会调用）
+conn_t *conn_new(int fd, int kind)
+{
+    unsigned int n = __atomic_fetch_add(&n_conns, 1, __ATOMIC_RELAXED);
+    conn_t *c = calloc(1, sizeof(conn_t));
+    c->fd = fd;
+    c->kind = kind;
+    c->io = n % n_io;
+    c->state = CONN_LOGIN;
+    c->refs = 1; // I/O 线程持有的引用，关闭 fd 时释放
+    c->strand = &strands[n % N_STRANDS];
+    pthread_mutex_init(&c->out_lock, NULL);
+    pthread_mutex_init(&c->z_lock, NULL);
+    rl_bucket_init(&c->chat_bucket, &rl.chat);
+    rl_bucket_init(&c->pm_bucket, &rl.pm);
+    rl_bucket_init(&c->who_bucket, &rl.who);
+    c->epoll_events = EPOLLIN;
+    c->trace_id = n + 1;
+    trace_conn_open(c->trace_id);
+    return c;
+}
+
+// 把连接加进所属 I/O 线程的 epoll。本机连接还要关注它的 eventfd，
+// 用指针最低位区分（conn_t 是 malloc 出来的，至少 8 字节对齐）
+int conn_register(conn_t *c)
+{
+    // 加进 epoll 之后 I/O 线程可能马上处理完这个连接并释放它（比如文件数据连接读到 'D' 包就交出去了），
+    // 注册期间自己拿一个引用
+    conn_ref(c);
+    int ret = 0;
+    int epfd = io_threads[c->io].epfd;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl error");
+        ret = -1;
+    } else if (c->kind == CONN_LOCAL) {
+        ev.data.ptr = (void *)((uintptr_t)c | 1);
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->link.efd_in, &ev) < 0) {
+            perror("epoll_ctl error");
+            epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+            ret = -1;
+        }
+    }
+    conn_unref(c);
+    return ret;
+}
+
+// 把连接挂到所属 I/O 线程的待刷新链表上，必要时唤醒它。
+// urgent：有高优先级的帧，另外挂到加急链表上，I/O 线程先刷这些连接，不用等完一整轮群发
+static void io_wake(conn_t *c, int urgent)
+{
+    io_thread_t *io = &io_threads[c->io];
+    int need_wake = 0;
+
+    pthread_mutex_lock(&io->lock);
+    if (urgent && !c->in_urgent) {
+        c->in_urgent = 1;
+        conn_ref(c); // 加急链表持有一个引用
+        need_wake = io->flush_head == NULL && io->urgent_head == NULL;
+        c->urgent_next = io->urgent_head;
+        __atomic_store_n(&io->urgent_head, c, __ATOMIC_RELAXED); // io_flush_urgent 会不加锁先看一眼
+    } else if (!urgent && !c->in_flush) {
+        c->in_flush = 1;
+        conn_ref(c); // 待刷新链表持有一个引用
+        need_wake = io->flush_head == NULL && io->urgent_head == NULL;
+        c->flush_next = io->flush_head;
+        io->flush_head = c;
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    if (need_wake) {
+        uint64_t one = 1;
+        if (write(io->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write error");
+        }
+    }
+}
+
+// 放进连接 prio 这一级的出站队列，由 I/O 线程发送。
+// 录制的是 raw 里的 nraw 个原始帧（压缩帧录压缩前的内容），raw 为 NULL 时录 data 本身
+static void conn_queue(conn_t *c, const void *data, size_t len, int prio, const msg_t *raw, int nraw)
+{
+    if (outq_mode == OUTQ_FIFO) {
+        prio = PRIO_BULK;
+    }
+    frame_t *f = malloc(sizeof(frame_t) + len);
+    f->next = NULL;
+    f->prio = prio;
+    f->len = len;
+    f->off = 0;
+    memcpy(f->data, data, len);
+
+    pthread_mutex_lock(&c->out_lock);
+    if (c->fd < 0) { // 连接已关闭
+        pthread_mutex_unlock(&c->out_lock);
+        free(f);
+        return;
+    }
+    if (c->out_tail[prio] != NULL) {
+        c->out_tail[prio]->next = f;
+    } else {
+        c->out_head[prio] = f;
+    }
+    c->out_tail[prio] = f;
+    // 在锁内记录，保证同一级内和发送顺序一致
+    if (raw == NULL) {
+        trace_out(c->trace_id, data, len);
+    }
+    for (int i = 0; i < nraw; i++) {
+        trace_out(c->trace_id, &raw[i], sizeof(msg_t));
+    }
+    pthread_mutex_unlock(&c->out_lock);
+
+    io_wake(c, prio < PRIO_BULK);
+}
+
+// [TCP] 任何线程都可以调用：把一帧放进连接 prio 这一级的出站队列
+void conn_send(conn_t *c, const void *data, size_t len, int prio)
+{
+    conn_queue(c, data, len, prio, NULL, 0);
+}
+
+// (线程池) 发给一个人的一批回复（补发的聊天记录、在线名单、搜索结果），都是 PRIO_CTRL。
+// 对方支持压缩、这批又够大时压成一个 'Z' 帧，否则逐帧排队。压缩在工作线程里做，不占 I/O 线程
+void conn_send_burst(conn_t *c, const msg_t *frames, int n)
+{
+    size_t len = n * sizeof(msg_t);
+    if (c->zlib && len >= (size_t)zlib_min) {
+        pthread_mutex_lock(&c->z_lock);
+        if (c->zc == NULL) {
+            c->zc = zc_new(zlib_level);
+        }
+        size_t zlen = 0;
+        unsigned char *buf = c->zc != NULL ? malloc(zc_bound(c->zc, len)) : NULL;
+        if (buf != NULL) {
+            zlen = zc_frame(c->zc, frames, len, buf);
+        }
+        if (zlen > 0) {
+            // 'Z' 帧只走 PRIO_CTRL 一级，不会互相插队，对方按压缩的顺序解压
+            conn_queue(c, buf, zlen, PRIO_CTRL, frames, n);
+        } else if (c->zc != NULL) {
+            printf("User '%s': compression failed, sending uncompressed.\n", c->id);
+            zc_free(c->zc); // 流已经坏了，这个连接以后都不压缩
+            c->zc = NULL;
+            c->zlib = 0;
+        }
+        pthread_mutex_unlock(&c->z_lock);
+        free(buf);
+        if (zlen > 0) {
+            return;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        conn_send(c, &frames[i], sizeof(msg_t), PRIO_CTRL);
+    }
+}
+
+// 只发给一个人的服务器提示（限流、错误等）
+void send_notice(conn_t *c, const char *text)
+{
+    msg_t notice;
+    memset(&notice, 0, sizeof(notice));
+    notice.type = 'C';
+    strcpy(notice.id, "Server");
+    snprintf(notice.text, sizeof(notice.text), "%s", text);
+    conn_send(c, &notice, sizeof(notice), PRIO_CTRL);
+}
+
+// 回复带编号的请求：'R' 帧，id 原样带回请求的编号
+void send_reply(conn_t *c, const char *tag, const char *text)
+{
+    msg_t reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = 'R';
+    snprintf(reply.id, sizeof(reply.id), "%s", tag);
+    snprintf(reply.text, sizeof(reply.text), "%s", text);
+    conn_send(c, &reply, sizeof(reply), PRIO_CTRL);
+}
 
-    // 2. [TCP] 处理登录：等待客户端发送的第一个包
-    // ！！！警告：这是一个简化的实现，见文末说明
-    n = recv(conn_fd, &msg, sizeof(msg), 0);
-    if (n <= 0 || msg.type != 'L') {
+// (I/O 线程) 修改 epoll 关注的事件
+static void io_set_events(io_thread_t *io, conn_t *c, int events)
+{
+    if (c->epoll_events < 0 || c->epoll_events == events) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(io->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->epoll_events = events;
+}
+
+// (I/O 线程) 从 epoll 中移除
+static void io_forget(io_thread_t *io, conn_t *c)
+{
+    if (c->epoll_events >= 0) {
+        epoll_ctl(io->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        if (c->kind == CONN_LOCAL) {
+            epoll_ctl(io->epfd, EPOLL_CTL_DEL, c->link.efd_in, NULL);
+        }
+        c->epoll_events = -1;
+    }
+}
+
+// (I/O 线程) 关闭 fd。I/O 线程持有的引用等本轮事件处理完再释放，
+// 因为同一批 events 里后面可能还有这个连接
+static void io_close(io_thread_t *io, conn_t *c)
+{
+    io_forget(io, c);
+    pthread_mutex_lock(&c->out_lock);
+    if (c->kind == CONN_LOCAL) {
+        shm_link_close(&c->link); // 也关掉了控制套接字 c->fd
+    } else {
+        close(c->fd);
+    }
+    c->fd = -1; // 之后 conn_send 直接丢弃
+    pthread_mutex_unlock(&c->out_lock);
+    trace_conn_close(c->trace_id);
+    c->dead_next = io->dead_head;
+    io->dead_head = c;
+}
+
+#define FLUSH_BUDGET 4 // 一个连接一次最多连续 writev 几次
+
+// (I/O 线程) 按优先级取下一帧。严格模式取最高的非空一级；
+// 加权模式每一级每轮最多取 weight 帧，所有有数据的级都用完额度后开始新一轮
+static frame_t *wq_pop(conn_t *c)
+{
+    for (int round = 0; round < 2; round++) {
+        for (int k = 0; k < N_PRIO; k++) {
+            frame_t *f = c->wq_head[k];
+            if (f == NULL || (outq_mode == OUTQ_WEIGHTED && c->credit[k] == 0)) {
+                continue;
+            }
+            c->wq_head[k] = f->next;
+            if (c->wq_head[k] == NULL) {
+                c->wq_tail[k] = NULL;
+            }
+            if (outq_mode == OUTQ_WEIGHTED) {
+                c->credit[k]--;
+            }
+            return f;
+        }
+        if (outq_mode != OUTQ_WEIGHTED) {
+            return NULL;
+        }
+        memcpy(c->credit, prio_weight, sizeof(c->credit));
+    }
+    return NULL;
+}
+
+// (I/O 线程) 没发出去的帧放回它那一级的队头，额度也还回去
+static void wq_unpop(conn_t *c, frame_t *f)
+{
+    f->next = c->wq_head[f->prio];
+    c->wq_head[f->prio] = f;
+    if (c->wq_tail[f->prio] == NULL) {
+        c->wq_tail[f->prio] = f;
+    }
+    if (outq_mode == OUTQ_WEIGHTED) {
+        c->credit[f->prio]++;
+    }
+}
+
+static int wq_empty(const conn_t *c)
+{
+    for (int k = 0; k < N_PRIO; k++) {
+        if (c->wq_head[k] != NULL) return 0;
+    }
+    return c->wq_cur == NULL;
+}
+
+// (I/O 线程) 丢掉所有待发送的数据
+static void wq_drop(conn_t *c)
+{
+    for (int k = 0; k < N_PRIO; k++) {
+        frame_list_free(c->wq_head[k]);
+        c->wq_head[k] = c->wq_tail[k] = NULL;
+    }
+    free(c->wq_cur);
+    c->wq_cur = NULL;
+}
+
+// (I/O 线程) 尽量把出站数据写进 socket，写不动就关注 EPOLLOUT
+static void io_flush(io_thread_t *io, conn_t *c)
+{
+    if (c->fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->out_lock);
+    for (int k = 0; k < N_PRIO; k++) {
+        if (c->out_head[k] == NULL) {
+            continue;
+        }
+        if (c->wq_tail[k] != NULL) {
+            c->wq_tail[k]->next = c->out_head[k];
+        } else {
+            c->wq_head[k] = c->out_head[k];
+        }
+        c->wq_tail[k] = c->out_tail[k];
+        c->out_head[k] = c->out_tail[k] = NULL;
+    }
+    int closing = c->closing;
+    pthread_mutex_unlock(&c->out_lock);
+
+    if (c->kind == CONN_LOCAL) {
+        // 本机连接：一帧一槽写进环；环满了就留着，客户端腾出空位时会叫醒我们
+        frame_t *f;
+        while ((f = wq_pop(c)) != NULL) {
+            if (shm_link_send(&c->link, f->data, f->len) != 0) {
+                wq_unpop(c, f);
+                break;
+            }
+            free(f);
+        }
+        if (closing) {
+            io_close(io, c);
+        }
+        return;
+    }
+
+    // 每次最多取 64 帧拼成一次 writev；写不完的放回原来的队列，下次可能有更高优先级的帧插到前面。
+    // 一次最多写 FLUSH_BUDGET 次，剩下的等 EPOLLOUT：群发积压很多时也能回去收别人的请求
+    for (int round = 0; round < FLUSH_BUDGET; round++) {
+        frame_t *batch[64];
+        struct iovec iov[64];
+        int cnt = 0;
+        if (c->wq_cur != NULL) {
+            batch[cnt++] = c->wq_cur;
+            c->wq_cur = NULL;
+        }
+        while (cnt < 64 && (batch[cnt] = wq_pop(c)) != NULL) {
+            cnt++;
+        }
+        if (cnt == 0) {
+            break;
+        }
+        for (int i = 0; i < cnt; i++) {
+            iov[i].iov_base = batch[i]->data + batch[i]->off;
+            iov[i].iov_len = batch[i]->len - batch[i]->off;
+        }
+        ssize_t n = writev(c->fd, iov, cnt);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // 对端已经断开：丢掉剩余数据，读方向会收到 EOF 并走下线流程
+                for (int i = 0; i < cnt; i++) free(batch[i]);
+                wq_drop(c);
+                break;
+            }
+            n = 0;
+        }
+        int i = 0;
+        while (i < cnt && (size_t)n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            free(batch[i++]);
+        }
+        if (i < cnt && (n > 0 || batch[i]->off > 0)) {
+            batch[i]->off += n;
+            c->wq_cur = batch[i++]; // 帧不能拆开插队，剩下的一半下次先写
+        }
+        int stalled = i < cnt || c->wq_cur != NULL;
+        for (int j = cnt - 1; j >= i; j--) {
+            wq_unpop(c, batch[j]);
+        }
+        if (stalled) {
+            break;
+        }
+    }
+
+    if (closing) {
+        // 下线清理已完成：剩下的数据尽力而为，直接关闭
+        io_close(io, c);
+        return;
+    }
+    io_set_events(io, c, !wq_empty(c) ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+// 工作线程执行的请求入口
+static void run_job(void *arg)
+{
+    job_t *job = (job_t *)arg;
+    conn_t *c = job->conn;
+
+    switch (job->msg.type) {
+    case 'L': do_login(c, job->msg); break;
+    case 'C': do_chat(c, job->msg); break;
+    case 'W': do_who(c, job->msg); break;
+    case 'P': do_private(c, job->msg); break;
+    case 'F': do_file(c, job->msg); break;
+    case 'S': do_search(c, job->msg); break;
+    case 'Q': do_logout(c); break; // 内部使用：读方向已关闭
+    }
+
+    conn_unref(c);
+    free(job);
+}
+
+// (I/O 线程) 把一个请求交给线程池，挂在这个连接的 strand 上保证顺序。
+// 私聊、\who、搜索、发文件请求走加急队列，不用排在一大堆群发任务后面
+static void submit_job(conn_t *c, const msg_t *msg)
+{
+    job_t *job = malloc(sizeof(job_t));
+    conn_ref(c); // 任务持有一个引用
+    job->conn = c;
+    job->msg = *msg;
+    if (outq_mode != OUTQ_FIFO &&
+        (msg->type == 'P' || msg->type == 'W' || msg->type == 'S' || msg->type == 'F')) {
+        pool_submit_urgent(c->strand, run_job, job);
+    } else {
+        pool_submit(c->strand, run_job, job);
+    }
+}
+
+// (I/O 线程) 读方向结束：没登录的直接关，登录过的交给线程池做下线清理
+static void io_shutdown_read(io_thread_t *io, conn_t *c)
+{
+    if (c->state == CONN_LOGIN) {
         printf("Client login failed or disconnected.\n");
-        close(conn_fd);
-        pthread_exit(NULL);
+        io_close(io, c);
+        return;
+    }
+    // 读方向已结束，不再关注任何事件；剩余出站数据在关闭前尽力发一次
+    c->state = CONN_CLOSED;
+    io_forget(io, c);
+
+    msg_t quit_msg;
+    memset(&quit_msg, 0, sizeof(quit_msg));
+    quit_msg.type = 'Q';
+    submit_job(c, &quit_msg);
+}
+
+// (I/O 线程) 数据连接：从 epoll 里摘下来，fd 交给文件传输线程
+static void io_handoff(io_thread_t *io, conn_t *c, const char *cmd)
+{
+    io_forget(io, c);
+    pthread_mutex_lock(&c->out_lock);
+    int fd = c->fd;
+    c->fd = -1;
+    pthread_mutex_unlock(&c->out_lock);
+    trace_conn_close(c->trace_id);
+    c->dead_next = io->dead_head;
+    io->dead_head = c;
+    xfer_attach(fd, cmd);
+}
+
+// (I/O 线程) 处理切好的一帧，返回 -1 表示要断开这个连接，1 表示是文件数据连接
+static int io_on_frame(conn_t *c, msg_t *msg)
+{
+    // 1. 第一个包必须是登录包，或者文件数据连接的 'D' 包
+    if (c->state == CONN_LOGIN) {
+        if (msg->type == 'D') {
+            return 1;
+        }
+        if (msg->type != 'L') {
+            return -1;
+        }
+        msg->id[sizeof(msg->id) - 1] = '\0';
+        strcpy(c->id, msg->id);
+        // 压缩：客户端的字典和我们的一样才开（本机连接不经过网络，不压缩）
+        unsigned int dict;
+        if (zlib_min > 0 && c->kind == CONN_TCP &&
+            sscanf(msg->text, "zlib %x", &dict) == 1 && dict == zdict_id()) {
+            c->zlib = 1;
+        }
+        c->state = CONN_ONLINE;
+        submit_job(c, msg);
+        return 0;
+    }
+
+    // 2. 先过限流，再把任何广播/查表的工作交给线程池
+    bucket_t *bucket = NULL;
+    const rl_conf_t *conf = NULL;
+    if (msg->type == 'C') {
+        bucket = &c->chat_bucket; conf = &rl.chat;
+    } else if (msg->type == 'P' || msg->type == 'F') {
+        bucket = &c->pm_bucket; conf = &rl.pm; // 发文件请求和私聊共用一个桶
+    } else if (msg->type == 'W' || msg->type == 'S') {
+        bucket = &c->who_bucket; conf = &rl.who; // 查询类请求共用一个桶
+    } else {
+        return 0; // 'Q' 等其它类型：忽略，等 EOF
+    }
+
+    int verdict = rl_take(bucket, conf, rl_now());
+    if (verdict == RL_KICK) {
+        printf("User '%s' kicked for flooding.\n", c->id);
+        send_notice(c, "发送过快，连接已被断开");
+        return -1;
+    }
+    if (verdict == RL_DROP) {
+        if (is_tagged(msg)) {
+            send_reply(c, msg->id, "发送过快，消息已被丢弃"); // 客户端在等这个编号，必须回
+        } else if (bucket->strikes == 1) { // 每轮超限只提醒一次
+            send_notice(c, "发送过快，消息已被丢弃");
+        }
+        return 0;
+    }
+
+    if (!is_tagged(msg)) {
+        strcpy(msg->id, c->id); // 确保 ID 是正确的；带编号的请求由 do_* 用 c->id
+    }
+    submit_job(c, msg);
+    return 0;
+}
+
+// (I/O 线程) 读数据并切帧
+// (I/O 线程) 处理收齐的一帧原始数据，返回 -1 表示这个连接不用再读了
+static int io_dispatch(io_thread_t *io, conn_t *c, const char *frame)
+{
+    trace_in(c->trace_id, frame, sizeof(msg_t)); // 录原始帧，限流之前
+
+    msg_t msg;
+    memcpy(&msg, frame, sizeof(msg));
+    msg.text[sizeof(msg.text) - 1] = '\0';
+    int ret = io_on_frame(c, &msg);
+    if (ret > 0 && c->kind == CONN_LOCAL) {
+        ret = -1; // 文件数据只走 TCP
+    }
+    if (ret < 0) {
+        io_shutdown_read(io, c);
+        return -1;
+    }
+    if (ret > 0) {
+        io_handoff(io, c, msg.text);
+        return -1;
+    }
+    return 0;
+}
+
+// (I/O 线程) 本机连接的 eventfd 可读：收环里的帧，再把出站数据写进环
+static void io_on_local(io_thread_t *io, conn_t *c)
+{
+    char frame[SHM_SLOT_SIZE];
+    int budget = 256; // 一次最多收这么多，别让一个连接霸占 I/O 线程
+    while (c->state != CONN_CLOSED) {
+        size_t n = shm_link_recv(&c->link, frame, sizeof(frame));
+        if (n == 0) {
+            if (shm_link_idle(&c->link)) {
+                break;
+            }
+            continue;
+        }
+        if (n != sizeof(msg_t)) { // 一槽一帧，长度不对就是协议错误
+            io_shutdown_read(io, c);
+            return;
+        }
+        if (io_dispatch(io, c, frame) < 0) {
+            return;
+        }
+        if (--budget == 0) {
+            shm_kick(c->link.efd_in); // 剩下的下一轮再收
+            break;
+        }
+    }
+    io_flush(io, c);
+}
+
+// (I/O 线程) 读数据并切帧
+static void io_on_readable(io_thread_t *io, conn_t *c)
+{
+    char buf[16384];
+    if (c->kind == CONN_LOCAL) {
+        // 本机连接的控制套接字上没有数据，只用来发现对端关闭
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            printf("Local user '%s' disconnected.\n", c->id);
+            io_shutdown_read(io, c);
+        }
+        return;
+    }
+    while (c->state != CONN_CLOSED) {
+        // 登录前每次只读一帧：如果这是文件数据连接，后面的文件内容要留在内核里给 splice
+        size_t want = c->state == CONN_LOGIN ? sizeof(msg_t) - c->inlen : sizeof(buf);
+        ssize_t n = recv(c->fd, buf, want, 0);
+        if (n == 0) {
+            printf("User '%s' disconnected gracefully.\n", c->id);
+            io_shutdown_read(io, c);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            perror("recv error");
+            io_shutdown_read(io, c);
+            return;
+        }
+
+        // [TCP] 字节流：可能一次收到半帧或好几帧
+        size_t pos = 0;
+        while (pos < (size_t)n) {
+            size_t take = sizeof(msg_t) - c->inlen;
+            if (take > (size_t)n - pos) {
+                take = n - pos;
+            }
+            memcpy(c->inbuf + c->inlen, buf + pos, take);
+            c->inlen += take;
+            pos += take;
+            if (c->inlen < sizeof(msg_t)) {
+                break;
+            }
+            c->inlen = 0;
+            if (io_dispatch(io, c, c->inbuf) < 0) {
+                return;
+            }
+        }
+    }
+}
+
+// [TCP] I/O 线程主循环
+// (I/O 线程) 刷加急链表上的连接：它们有高优先级的帧在等
+static void io_flush_urgent(io_thread_t *io)
+{
+    if (__atomic_load_n(&io->urgent_head, __ATOMIC_RELAXED) == NULL) {
+        return; // 不加锁先看一眼，群发的时候这里每个连接都会走一次
+    }
+    pthread_mutex_lock(&io->lock);
+    conn_t *list_c = io->urgent_head;
+    __atomic_store_n(&io->urgent_head, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&io->lock);
+
+    while (list_c != NULL) {
+        pthread_mutex_lock(&io->lock);
+        conn_t *next = list_c->urgent_next;
+        list_c->in_urgent = 0;
+        pthread_mutex_unlock(&io->lock);
+        io_flush(io, list_c);
+        conn_unref(list_c);
+        list_c = next;
+    }
+}
+
+void *io_main(void *arg)
+{
+    io_thread_t *io = (io_thread_t *)arg;
+    struct epoll_event events[256];
+
+    while (1)
+    {
+        int n = epoll_wait(io->epfd, events, 256, -1);
+        if (n < 0) {
+            if (errno != EINTR) perror("epoll_wait error");
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uintptr_t tag = (uintptr_t)events[i].data.ptr;
+            conn_t *c = (conn_t *)(tag & ~(uintptr_t)1);
+            if (c == NULL) {
+                // eventfd：把待刷新链表整个取下来逐个刷
+                uint64_t cnt;
+                if (read(io->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+                    perror("eventfd read error");
+                }
+                pthread_mutex_lock(&io->lock);
+                conn_t *list_c = io->flush_head;
+                io->flush_head = NULL;
+                pthread_mutex_unlock(&io->lock);
+
+                io_flush_urgent(io);
+                while (list_c != NULL) {
+                    // 先取 next 再清 in_flush：清掉之后别的线程可能把它重新挂上去，改写 flush_next
+                    pthread_mutex_lock(&io->lock);
+                    conn_t *next = list_c->flush_next;
+                    list_c->in_flush = 0;
+                    pthread_mutex_unlock(&io->lock);
+                    io_flush(io, list_c);
+                    conn_unref(list_c);
+                    list_c = next;
+                    io_flush_urgent(io); // 一大轮群发期间新来的私聊/回复不用排到这一轮后面
+                }
+                continue;
+            }
+
+            // 注意：同一轮里 c 可能已经被关闭，fd < 0 时跳过
+            if (tag & 1) { // 本机连接的 eventfd：对方写了帧或者腾出了空位
+                if (c->fd >= 0 && c->state != CONN_CLOSED) {
+                    io_on_local(io, c);
+                }
+                continue;
+            }
+            if (c->fd >= 0 && (events[i].events & EPOLLOUT)) {
+                io_flush(io, c);
+            }
+            if (c->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                io_on_readable(io, c);
+            }
+        }
+
+        while (io->dead_head != NULL) {
+            conn_t *c = io->dead_head;
+            io->dead_head = c->dead_next;
+            conn_unref(c);
+        }
+    }
+    return NULL;
+}
+
+// [本机] 给新连上的本机客户端建共享内存环和 eventfd，把 fd 发过去
+static int local_setup(int fd, shm_link_t *l)
+{
+    int memfd = memfd_create("chat_local", MFD_CLOEXEC);
+    if (memfd < 0) {
+        perror("memfd_create error"); return -1;
+    }
+    if (ftruncate(memfd, sizeof(shm_region_t)) < 0) {
+        perror("ftruncate error"); close(memfd); return -1;
+    }
+    l->region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (l->region == MAP_FAILED) {
+        perror("mmap error"); close(memfd); return -1;
+    }
+    // 两边一开始都算“在睡觉”，第一帧一定会叫醒对方
+    l->region->up.consumer_waiting = 1;
+    l->region->down.consumer_waiting = 1;
+
+    l->sock = fd;
+    l->efd_in = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);  // 客户端 -> 服务器
+    l->efd_out = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); // 服务器 -> 客户端
+    l->tx = &l->region->down;
+    l->rx = &l->region->up;
+
+    shm_hello_t hello = { SHM_MAGIC, SHM_RING_SLOTS, SHM_SLOT_SIZE, sizeof(shm_region_t) };
+    int fds[3] = { memfd, l->efd_in, l->efd_out };
+    int ret = 0;
+    if (l->efd_in < 0 || l->efd_out < 0 || shm_send_fds(fd, &hello, sizeof(hello), fds, 3) < 0) {
+        perror("local handshake error");
+        ret = -1;
+    }
+    close(memfd); // 映射还在，客户端有自己的一份 fd
+    if (ret < 0) {
+        munmap(l->region, sizeof(shm_region_t));
+        if (l->efd_in >= 0) close(l->efd_in);
+        if (l->efd_out >= 0) close(l->efd_out);
+    }
+    return ret;
+}
+
+// [本机] 门卫线程：Unix 域套接字上 accept，建好共享内存后当作普通连接交给 I/O 线程
+void *local_accept_main(void *arg)
+{
+    const char *path = (const char *)arg;
+    struct sockaddr_un uaddr;
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("local socket error"); exit(1);
+    }
+    memset(&uaddr, 0, sizeof(uaddr));
+    uaddr.sun_family = AF_UNIX;
+    snprintf(uaddr.sun_path, sizeof(uaddr.sun_path), "%s", path);
+    unlink(path); // 上次没删掉的套接字文件
+    if (bind(lfd, (struct sockaddr *)&uaddr, sizeof(uaddr)) < 0) {
+        perror("local bind error"); exit(1);
+    }
+    if (listen(lfd, 64) < 0) {
+        perror("local listen error"); exit(1);
+    }
+    printf("Local clients can connect on %s\n", path);
+
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            perror("local accept error");
+            continue;
+        }
+        shm_link_t link;
+        if (local_setup(fd, &link) < 0) {
+            close(fd);
+            continue;
+        }
+        printf("New local client connected.\n");
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        conn_t *c = conn_new(fd, CONN_LOCAL);
+        c->link = link;
+        if (conn_register(c) < 0) {
+            conn_unref(c);
+            shm_link_close(&link);
+        }
+    }
+    return NULL;
+}
+
+// 通知接收方有文件可取：'F' "<token> <大小> <文件名>"，发送方 id 放在 id 字段
+static void notify_file(void *arg, unsigned long long token, const char *from,
+                        long long size, const char *name)
+{
+    conn_t *c = (conn_t *)arg;
+    msg_t note;
+    memset(&note, 0, sizeof(note));
+    note.type = 'F';
+    snprintf(note.id, sizeof(note.id), "%s", from);
+    snprintf(note.text, sizeof(note.text), "%016llx %lld %.80s", token, size, name);
+    conn_send(c, &note, sizeof(note), PRIO_PRIVATE);
+}
+
+// (线程池) 登录时补发最近的聊天记录：一批 'C' 帧，id 是 "History"，从旧到新
+static void send_replay(conn_t *c)
+{
+    hist_msg_t *hits = malloc(sizeof(hist_msg_t) * replay_n);
+    msg_t *frames = malloc(sizeof(msg_t) * replay_n);
+    if (hits == NULL || frames == NULL) {
+        perror("malloc replay error");
+        free(hits);
+        free(frames);
+        return;
     }
-    
-    // 登录成功，保存 ID
-    strcpy(client_id, msg.id);
+    int n = hist_recent(c->id, hits, replay_n);
+    for (int i = 0; i < n; i++) {
+        msg_t *f = &frames[i];
+        memset(f, 0, sizeof(*f));
+        f->type = 'C';
+        strcpy(f->id, "History");
+        hist_format(&hits[n - 1 - i], f->text, sizeof(f->text));
+    }
+    if (n > 0) {
+        conn_send_burst(c, frames, n);
+    }
+    free(hits);
+    free(frames);
+}
 
-    // 3. 将新用户添加到全局链表，并广播“上线”消息
+// (线程池) 登录：加入全局链表，并广播“上线”消息
+void do_login(conn_t *c, msg_t msg)
+{
     list *new_node = (list *)malloc(sizeof(list));
-    new_node->conn_fd = conn_fd;
-    strcpy(new_node->id, client_id);
+    conn_ref(c); // 链表持有一个引用
+    new_node->conn = c;
+    strcpy(new_node->id, c->id);
     new_node->next = NULL;
 
-    sprintf(msg.text, "%s 已上线", client_id);
+    sprintf(msg.text, "%s 已上线", c->id);
     // (我们把 "上线" 消息和 "添加自己" 合并到一次加锁中)
 
+    // 先补发最近的聊天记录，再加进链表：之后的新消息都排在记录后面
+    if (replay_n > 0 && hist_on) {
+        send_replay(c);
+    }
+
     pthread_mutex_lock(&list_mutex);
     list *p = head;
     while (p->next != NULL) {
         p = p->next;
         // 广播“上线”消息给其他已在线的人
-        send(p->conn_fd, &msg, sizeof(msg), 0);
+        conn_send(p->conn, &msg, sizeof(msg), PRIO_BULK);
     }
     p->next = new_node; // 尾插法
     pthread_mutex_unlock(&list_mutex);
-    
-    printf("User '%s' logged in.\n", client_id);
 
-    // 4. [TCP] 消息循环：等待这个客户端的后续消息
-    while(1)
-    {
-        memset(&msg, 0, sizeof(msg));
-        // recv() 会阻塞，直到这个客户端发来消息
-        // ！！！警告：这仍然是简化的实现
-        n = recv(conn_fd, &msg, sizeof(msg), 0);
-        
-        // 5. [TCP] 检查客户端是否断开
-        if (n <= 0) {
-            if (n == 0) {
-                printf("User '%s' disconnected gracefully.\n", client_id);
-            } else {
-                perror("recv error");
-            }
-            break; // 退出循环，准备清理
-        }
-
-        // 6. 处理收到的消息
-        strcpy(msg.id, client_id); // 确保 ID 是正确的
-
-        if (msg.type == 'C') {
-            printf("Chat Log [%s]: %s\n", msg.id, msg.text);
-            broadcast_msg(msg, conn_fd); // 广播给除自己外的所有人
-        } 
-        else if (msg.type == 'W') {
-            // --- 'who' 逻辑 ---
-            msg_t response_msg;
-            memset(&response_msg, 0, sizeof(response_msg));
-            response_msg.type = 'C';
-            strcpy(response_msg.id, "Server");
-            strcpy(response_msg.text, "--- Online Users ---\n");
-
-            pthread_mutex_lock(&list_mutex);
-            list *p_who = head->next;
-            while(p_who != NULL) {
-                if (strlen(response_msg.text) + strlen(p_who->id) + 2 < sizeof(response_msg.text)) {
-                    strcat(response_msg.text, p_who->id);
-                    strcat(response_msg.text, "\n");
-                }
-                p_who = p_who->next;
-            }
-            pthread_mutex_unlock(&list_mutex);
-            
-            // 只发回给请求者
-            send(conn_fd, &response_msg, sizeof(response_msg), 0);
-        }
-        else if (msg.type == 'P') {
-            // --- 'private_chat' 逻辑 ---
-            char target_id[32];
-            char message_content[128];
-            list *target_node = NULL;
-            
-            if (sscanf(msg.text, "%31s %[^\n]", target_id, message_content) < 2) {
-                continue; // 格式错误，忽略
-            }
+    printf("User '%s' logged in.\n", c->id);
 
-            pthread_mutex_lock(&list_mutex);
-            list *p_pm = head->next;
-            while(p_pm != NULL) {
-                if(strcmp(p_pm->id, target_id) == 0) {
-                    target_node = p_pm; // 找到了
-                    break;
-                }
-                p_pm = p_pm->next;
+    // 离线期间别人发来的文件：补发通知
+    xfer_pending(c->id, notify_file, c);
+}
+
+// (线程池) 群聊
+void do_chat(conn_t *c, msg_t msg)
+{
+    printf("Chat Log [%s]: %s\n", msg.id, msg.text);
+    hist_append(HIST_PUBLIC, msg.id, NULL, msg.text);
+    broadcast_msg(msg, c, PRIO_BULK); // 广播给除自己外的所有人
+}
+
+// (线程池) 'who' 逻辑：带编号的请求只回一个 'R' 帧（放不下的截掉）；
+// 不带编号的回完整的名单，一帧放不下就接着用下一帧，整批一起发（够大会压缩）
+void do_who(conn_t *c, msg_t msg)
+{
+    int tagged = is_tagged(&msg);
+    int n = 0, cap = 8;
+    msg_t *frames = malloc(sizeof(msg_t) * cap);
+    if (frames == NULL) {
+        perror("malloc who error");
+        return;
+    }
+    memset(&frames[0], 0, sizeof(msg_t));
+    frames[0].type = 'C';
+    strcpy(frames[0].id, "Server");
+    if (tagged) {
+        frames[0].type = 'R';
+        strcpy(frames[0].id, msg.id);
+    }
+    strcpy(frames[0].text, "--- Online Users ---\n");
+    size_t len = strlen(frames[0].text);
+
+    pthread_mutex_lock(&list_mutex);
+    list *p_who = head->next;
+    while(p_who != NULL) {
+        size_t idlen = strlen(p_who->id);
+        if (len + idlen + 2 > sizeof(frames[n].text) && !tagged) {
+            // 这一帧满了，换下一帧
+            if (n + 1 == cap) {
+                msg_t *bigger = realloc(frames, sizeof(msg_t) * cap * 2);
+                if (bigger == NULL) break;
+                frames = bigger;
+                cap *= 2;
             }
-            pthread_mutex_unlock(&list_mutex); // 查找完毕，先解锁
-
-            if (target_node != NULL) {
-                // 准备私聊消息
-                msg_t private_msg;
-                memset(&private_msg, 0, sizeof(private_msg));
-                private_msg.type = 'C';
-                strcpy(private_msg.text, message_content);
-                snprintf(private_msg.id, sizeof(private_msg.id), "%s (private)", client_id); 
-                // 只发给目标
-                send(target_node->conn_fd, &private_msg, sizeof(private_msg), 0);
-            } else {
-                // 没找到，发回错误
-                msg_t error_msg;
-                memset(&error_msg, 0, sizeof(error_msg));
-                error_msg.type = 'C';
-                strcpy(error_msg.id, "Server");
-                snprintf(error_msg.text, sizeof(error_msg.text), "User '%s' not found.", target_id);
-                send(conn_fd, &error_msg, sizeof(error_msg), 0);
+            n++;
+            memset(&frames[n], 0, sizeof(msg_t));
+            frames[n].type = 'C';
+            strcpy(frames[n].id, "Server");
+            len = 0;
+        }
+        if (len + idlen + 2 <= sizeof(frames[n].text)) {
+            memcpy(frames[n].text + len, p_who->id, idlen);
+            frames[n].text[len + idlen] = '\n';
+            len += idlen + 1;
+        }
+        p_who = p_who->next;
+    }
+    pthread_mutex_unlock(&list_mutex);
+
+    // 只发回给请求者
+    if (tagged) {
+        conn_send(c, &frames[0], sizeof(msg_t), PRIO_CTRL);
+    } else {
+        conn_send_burst(c, frames, n + 1);
+    }
+    free(frames);
+}
+
+// (线程池) 'private_chat' 逻辑
+void do_private(conn_t *c, msg_t msg)
+{
+    char target_id[32];
+    char message_content[128];
+    conn_t *target = NULL;
+
+    if (sscanf(msg.text, "%31s %[^\n]", target_id, message_content) < 2) {
+        if (is_tagged(&msg)) {
+            send_reply(c, msg.id, "usage: /msg <user> <text>");
+        }
+        return; // 格式错误，忽略
+    }
+
+    pthread_mutex_lock(&list_mutex);
+    list *p_pm = head->next;
+    while(p_pm != NULL) {
+        if(strcmp(p_pm->id, target_id) == 0) {
+            target = p_pm->conn; // 找到了
+            conn_ref(target);
+            break;
+        }
+        p_pm = p_pm->next;
+    }
+    pthread_mutex_unlock(&list_mutex); // 查找完毕，先解锁
+
+    if (target != NULL) {
+        // 准备私聊消息
+        msg_t private_msg;
+        memset(&private_msg, 0, sizeof(private_msg));
+        private_msg.type = 'C';
+        strcpy(private_msg.text, message_content);
+        snprintf(private_msg.id, sizeof(private_msg.id), "%.20s (private)", c->id);
+        // 只发给目标
+        conn_send(target, &private_msg, sizeof(private_msg), PRIO_PRIVATE);
+        conn_unref(target);
+        hist_append(HIST_PRIVATE, c->id, target_id, message_content);
+        if (is_tagged(&msg)) {
+            send_reply(c, msg.id, "ok");
+        }
+    } else {
+        // 没找到，发回错误
+        msg_t error_msg;
+        memset(&error_msg, 0, sizeof(error_msg));
+        error_msg.type = 'C';
+        strcpy(error_msg.id, "Server");
+        if (is_tagged(&msg)) {
+            error_msg.type = 'R';
+            strcpy(error_msg.id, msg.id);
+        }
+        snprintf(error_msg.text, sizeof(error_msg.text), "User '%s' not found.", target_id);
+        conn_send(c, &error_msg, sizeof(error_msg), PRIO_CTRL);
+    }
+}
+
+// (线程池) 搜聊天记录：'S' 的 text 是查询词。回一行统计，再从新到旧回最多 10 条，都是 'C' 帧
+void do_search(conn_t *c, msg_t msg)
+{
+    hist_msg_t hits[10];
+    msg_t frames[11];
+
+    if (!hist_on) {
+        send_notice(c, "服务器没有开启聊天记录");
+        return;
+    }
+    msg.text[sizeof(msg.text) - 1] = '\0';
+    int n = hist_search(c->id, msg.text, hits, 10);
+    if (n < 0) {
+        send_notice(c, "usage: /search <words> [from:user]");
+        return;
+    }
+
+    memset(frames, 0, sizeof(frames));
+    for (int i = 0; i <= n; i++) {
+        frames[i].type = 'C';
+        strcpy(frames[i].id, "Search");
+    }
+    snprintf(frames[0].text, sizeof(frames[0].text), "%d result(s) for '%.80s'", n, msg.text);
+    for (int i = 0; i < n; i++) {
+        hist_format(&hits[i], frames[i + 1].text, sizeof(frames[i + 1].text));
+    }
+    conn_send_burst(c, frames, n + 1);
+}
+
+// (线程池) 发文件请求：'F' "<对方id|*> <大小> <路径>"
+void do_file(conn_t *c, msg_t msg)
+{
+    char target_id[32];
+    char path[101];
+    long long size;
+    conn_t *target = NULL;
+
+    if (sscanf(msg.text, "%31s %lld %100[^\n]", target_id, &size, path) < 3 || size <= 0) {
+        send_notice(c, "usage: /file <user|*> <path>");
+        return;
+    }
+    const char *name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    int everyone = strcmp(target_id, "*") == 0;
+
+    if (!everyone) {
+        pthread_mutex_lock(&list_mutex);
+        for (list *p = head->next; p != NULL; p = p->next) {
+            if (strcmp(p->id, target_id) == 0) {
+                target = p->conn;
+                conn_ref(target);
+                break;
             }
         }
-    } // end while(1)
+        pthread_mutex_unlock(&list_mutex);
+    }
 
-    // 7. [TCP] 清理：客户端已断开
-    close(conn_fd); // 关闭这个客户端的连接
+    // 在线的单个用户：直传；群发或对方不在线：需要暂存目录
+    if (target == NULL && !xfer_spool_enabled()) {
+        char err[128];
+        snprintf(err, sizeof(err), everyone ? "群发文件需要服务器开启暂存目录" :
+                 "User '%s' not found.", target_id);
+        send_notice(c, err);
+        return;
+    }
+    unsigned long long token = xfer_offer(c->id, target_id, name, size, target != NULL);
+    if (token == 0) {
+        send_notice(c, "文件传输登记失败");
+        if (target != NULL) conn_unref(target);
+        return;
+    }
+
+    // 告诉发送方去哪里上传
+    msg_t up;
+    memset(&up, 0, sizeof(up));
+    up.type = 'F';
+    strcpy(up.id, "Server");
+    snprintf(up.text, sizeof(up.text), "UP %016llx %s", token, path);
+    conn_send(c, &up, sizeof(up), PRIO_CTRL);
+
+    // 通知接收方（离线的人下次登录时由 xfer_pending 补发）
+    if (target != NULL) {
+        notify_file(target, token, c->id, size, name);
+        conn_unref(target);
+    } else if (everyone) {
+        msg_t note;
+        memset(&note, 0, sizeof(note));
+        note.type = 'F';
+        strcpy(note.id, c->id);
+        snprintf(note.text, sizeof(note.text), "%016llx %lld %.80s", token, size, name);
+        broadcast_msg(note, c, PRIO_BULK);
+    }
+    printf("File offer [%s -> %s]: %s (%lld bytes)\n", c->id, target_id, name, size);
+}
 
-    // 准备“下线”广播消息
+// (线程池) 下线清理：从全局链表中移除自己，广播“下线”，然后通知 I/O 线程关闭
+void do_logout(conn_t *c)
+{
+    msg_t msg;
     memset(&msg, 0, sizeof(msg));
     msg.type = 'C';
     strcpy(msg.id, "Server");
-    sprintf(msg.text, "%s 已下线", client_id);
-    
-    // 从全局链表中移除自己，并广播“下线”
+    sprintf(msg.text, "%s 已下线", c->id);
+
+    list *dele = NULL;
     pthread_mutex_lock(&list_mutex);
     list *p_del = head;
     while(p_del->next != NULL) {
-        if (p_del->next->conn_fd == conn_fd) {
-            list *dele = p_del->next;
+        if (p_del->next->conn == c) {
+            dele = p_del->next;
             p_del->next = dele->next; // 断开链表
-            free(dele); // 释放节点
-            break; // 找到并删除后就退出
+            continue;
         }
         // 向其他人广播下线消息
-        send(p_del->next->conn_fd, &msg, sizeof(msg), 0);
+        conn_send(p_del->next->conn, &msg, sizeof(msg), PRIO_BULK);
         p_del = p_del->next;
     }
     pthread_mutex_unlock(&list_mutex);
 
-    printf("User '%s' cleaned up.\n", client_id);
-    pthread_exit(NULL); // 结束这个“服务员”线程
+    if (dele != NULL) {
+        conn_unref(dele->conn);
+        free(dele); // 释放节点
+    }
+
+    pthread_mutex_lock(&c->out_lock);
+    c->closing = 1;
+    pthread_mutex_unlock(&c->out_lock);
+    io_wake(c, 0);
+
+    printf("User '%s' cleaned up.\n", c->id);
 }
 
-// [TCP] 管理员线程函数 (修改为使用 send)
+// [TCP] 管理员线程函数
 void *admin_handler(void *arg)
 {
     admin_args_t *args = (admin_args_t *)arg;
-    list *head = args->head;
     free(args);
     args = NULL;
-    
+
     msg_t msg_s;
-    char input_buf[128]; 
+    char input_buf[128];
 
     memset(&msg_s, 0, sizeof(msg_s));
     strcpy(msg_s.id, "Server (Admin)");
-    msg_s.type = 'C'; 
+    msg_s.type = 'C';
 
     printf("服务器消息发送线程启动...\n");
     while (1)
@@ -341,9 +1538,9 @@ void *admin_handler(void *arg)
         printf("server-admin: ");
         fflush(stdout);
         if (fgets(input_buf, sizeof(input_buf), stdin) == NULL) {
-            continue;
+            break; // stdin 已关闭（例如后台运行），管理员线程退出，服务器照常运行
         }
-        
+
         input_buf[strcspn(input_buf, "\n")] = 0;
         if (strlen(input_buf) == 0) {
             continue;
@@ -351,24 +1548,23 @@ void *admin_handler(void *arg)
         strcpy(msg_s.text, input_buf);
 
         // 广播给所有在线用户
-        broadcast_msg(msg_s, -1); // -1 表示不排除任何人
+        broadcast_msg(msg_s, NULL, PRIO_ADMIN); // NULL 表示不排除任何人
     }
     return NULL;
 }
 
-// [TCP] 新的广播工具函数
-void broadcast_msg(msg_t msg, int exclude_fd)
+// [TCP] 广播工具函数：只是放进每个人的出站队列，真正的 send 由 I/O 线程做
+void broadcast_msg(msg_t msg, conn_t *exclude, int prio)
 {
     pthread_mutex_lock(&list_mutex);
     list *p = head->next;
     while (p != NULL)
     {
-        if (p->conn_fd != exclude_fd) // 排除掉发送者自己
+        if (p->conn != exclude) // 排除掉发送者自己
         {
-            // [TCP] 使用 send
-            send(p->conn_fd, &msg, sizeof(msg), 0);
+            conn_send(p->conn, &msg, sizeof(msg), prio);
         }
         p = p->next;
     }
     pthread_mutex_unlock(&list_mutex);
-}
\ No newline at end of file
+}
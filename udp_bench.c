@@ -0,0 +1,297 @@
+/* --- udp_bench.c (UDP 群发压测工具) --- */
+// 用法: ./udp_bench [-h ip] [-p port] [-c clients] [-t seconds] [-r rate] [-m] [-S server_pid]
+// 开 clients 个 UDP 客户端登录服务器，1 号客户端每秒发 rate 条群聊（text 里是发送时刻），
+// 0 号客户端统计收到多少条、延迟多少。
+// -m：客户端按服务器发来的 'M' 加入组播组并回 'M'，群聊改走组播（服务器要设置 CHAT_MCAST）；
+//     这时 0 号客户端从组播 socket 收。
+// -S：统计压测期间服务器进程用掉的 CPU 时间，用来比较单播和组播的发送开销。
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+
+typedef struct
+{
+    char type;      // 消息类型 L C Q W P M
+    char id[32];    // 用户id
+    char text[128]; // 消息内容
+} msg_t;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 服务器进程用掉的 CPU 时间（毫秒），读不到返回 -1
+static long server_cpu_ms(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    unsigned long utime = 0, stime = 0;
+    // 第 2 个字段是带括号的进程名，跳过它后面是第 3 个字段
+    int ok = fscanf(fp, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                    &utime, &stime) == 2;
+    fclose(fp);
+    return ok ? (long)((utime + stime) * 1000 / sysconf(_SC_CLK_TCK)) : -1;
+}
+
+// 加入组播组，返回 socket
+static int mcast_open(const char *group, int port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    int rcvbuf = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_in maddr;
+    memset(&maddr, 0, sizeof(maddr));
+    maddr.sin_family = AF_INET;
+    maddr.sin_addr.s_addr = inet_addr(group);
+    maddr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&maddr, sizeof(maddr)) < 0) {
+        perror("bind mcast error"); close(fd); return -1;
+    }
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(group);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (getenv("CHAT_MCAST_IF") != NULL) {
+        mreq.imr_interface.s_addr = inet_addr(getenv("CHAT_MCAST_IF"));
+    }
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("join mcast error"); close(fd); return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *ip = "127.0.0.1";
+    int port = 8888;
+    int nclients = 1000;
+    int seconds = 5;
+    double rate = 100;
+    int use_mcast = 0;
+    int server_pid = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:t:r:mS:")) != -1) {
+        switch (opt) {
+        case 'h': ip = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': nclients = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'm': use_mcast = 1; break;
+        case 'S': server_pid = atoi(optarg); break;
+        default:
+            printf("usage:./udp_bench [-h ip] [-p port] [-c clients] [-t seconds] [-r rate] "
+                   "[-m] [-S server_pid]\n");
+            return -1;
+        }
+    }
+    if (nclients < 2) {
+        printf("need at least 2 clients\n");
+        return -1;
+    }
+
+    struct sockaddr_in saddr;
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_addr.s_addr = inet_addr(ip);
+    saddr.sin_port = htons(port);
+
+    // 1. 所有客户端登录，分批发，别把服务器的接收缓冲区一下子灌满。
+    //    UDP 登录包可能被丢：0 号客户端先登录，看它收到了谁的“已上线”，没收到的重发
+    int *fds = malloc(sizeof(int) * nclients);
+    char *online = calloc(nclients, 1);
+    msg_t msg;
+    for (int i = 0; i < nclients; i++) {
+        fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fds[i] < 0) {
+            perror("socket error"); return -1;
+        }
+        connect(fds[i], (struct sockaddr *)&saddr, sizeof(saddr));
+    }
+    int rcvbuf = 4 << 20;
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    online[0] = 1;
+    int nonline = 1;
+    msg_t join0;      // 0 号客户端在登录阶段收到的 'M'
+    int have_join0 = 0;
+    for (int round = 0; round < 10 && nonline < nclients; round++) {
+        int batch = 0;
+        for (int i = round == 0 ? 0 : 1; i < nclients; i++) {
+            if (online[i] && i != 0) {
+                continue;
+            }
+            if (i == 0 && round > 0) {
+                continue;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.type = 'L';
+            snprintf(msg.id, sizeof(msg.id), "u%d", i);
+            send(fds[i], &msg, sizeof(msg), 0);
+            if (++batch % 50 == 0) {
+                usleep(20000);
+            }
+        }
+        long long deadline = now_ns() + 1000000000LL;
+        while (now_ns() < deadline) {
+            struct pollfd pfd = { fds[0], POLLIN, 0 };
+            if (poll(&pfd, 1, 100) <= 0) {
+                continue;
+            }
+            while (recv(fds[0], &msg, sizeof(msg), MSG_DONTWAIT) > 0) {
+                int id;
+                if (msg.type == 'M') {
+                    join0 = msg;
+                    have_join0 = 1;
+                }
+                if (msg.type == 'L' && sscanf(msg.id, "u%d", &id) == 1 &&
+                    id > 0 && id < nclients && !online[id]) {
+                    online[id] = 1;
+                    nonline++;
+                }
+            }
+        }
+    }
+    free(online);
+    if (nonline < nclients) {
+        printf("only %d of %d clients logged in\n", nonline, nclients);
+        return -1;
+    }
+
+    // 2. -m：每个客户端等服务器的 'M'，收到后回 'M'；压测进程自己只需要加入一次组
+    int rfd = fds[0]; // 0 号客户端收群聊的 socket
+    if (use_mcast) {
+        int joined = 0;
+        long long deadline = now_ns() + 5000000000LL;
+        char *got = calloc(nclients, 1);
+        while (joined < nclients && now_ns() < deadline) {
+            for (int i = 0; i < nclients; i++) {
+                while (!got[i] && ((i == 0 && have_join0 && (msg = join0, 1)) ||
+                                   recv(fds[i], &msg, sizeof(msg), MSG_DONTWAIT) > 0)) {
+                    if (msg.type != 'M') {
+                        continue;
+                    }
+                    if (rfd == fds[0]) {
+                        char group[64];
+                        int mport;
+                        if (sscanf(msg.text, "%63s %d", group, &mport) != 2 ||
+                            (rfd = mcast_open(group, mport)) < 0) {
+                            return -1;
+                        }
+                    }
+                    msg_t ack;
+                    memset(&ack, 0, sizeof(ack));
+                    ack.type = 'M';
+                    snprintf(ack.id, sizeof(ack.id), "u%d", i);
+                    send(fds[i], &ack, sizeof(ack), 0);
+                    got[i] = 1;
+                    joined++;
+                }
+            }
+            usleep(10000);
+        }
+        free(got);
+        if (joined < nclients) {
+            printf("only %d of %d clients got the multicast group (is CHAT_MCAST set?)\n",
+                   joined, nclients);
+            return -1;
+        }
+        sleep(1);
+    }
+    // 等服务器把登录阶段积压的上线通知发完（CPU 不再涨），别算进压测
+    if (server_pid > 0) {
+        long prev = server_cpu_ms(server_pid), cur;
+        while (usleep(300000), (cur = server_cpu_ms(server_pid)) - prev > 30) {
+            prev = cur;
+        }
+    }
+    // 把登录阶段的上线通知都扔掉
+    while (recv(rfd, &msg, sizeof(msg), MSG_DONTWAIT) > 0) {
+    }
+    printf("%d clients logged in (%s), sender rate %.0f msg/s\n",
+           nclients, use_mcast ? "multicast" : "unicast", rate);
+
+    // 3. 1 号客户端按速率发群聊，0 号客户端收
+    long max_lat = (long)(rate * seconds) + 16;
+    long long *lat = malloc(sizeof(long long) * max_lat);
+    long nlat = 0, sent = 0;
+    long cpu0 = server_pid > 0 ? server_cpu_ms(server_pid) : -1;
+    long long start = now_ns(), end = start + seconds * 1000000000LL;
+    long long next_send = start;
+    msg_t chat;
+    memset(&chat, 0, sizeof(chat));
+    chat.type = 'C';
+    strcpy(chat.id, "u1");
+    while (1) {
+        long long now = now_ns();
+        if (now >= end + 500000000LL) {
+            break; // 停止发送后再收半秒
+        }
+        while (now < end && now >= next_send) {
+            snprintf(chat.text, sizeof(chat.text), "%lld", now);
+            send(fds[1], &chat, sizeof(chat), 0);
+            sent++;
+            next_send += (long long)(1e9 / rate);
+        }
+        struct pollfd pfd = { rfd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1) <= 0) {
+            continue;
+        }
+        while (recv(rfd, &msg, sizeof(msg), MSG_DONTWAIT) > 0) {
+            if (msg.type == 'C' && strcmp(msg.id, "u1") == 0 && nlat < max_lat) {
+                lat[nlat++] = now_ns() - atoll(msg.text);
+            }
+        }
+    }
+    long cpu1 = server_pid > 0 ? server_cpu_ms(server_pid) : -1;
+
+    // 4. 报告
+    printf("sent %ld, client 0 got %ld (%.1f%%)\n", sent, nlat, sent ? 100.0 * nlat / sent : 0.0);
+    if (nlat > 0) {
+        qsort(lat, nlat, sizeof(long long), cmp_ll);
+        printf("latency (us): p50=%.1f p99=%.1f max=%.1f\n",
+               lat[nlat / 2] / 1e3, lat[(long)(nlat * 0.99)] / 1e3, lat[nlat - 1] / 1e3);
+    }
+    if (cpu0 >= 0 && cpu1 >= 0) {
+        printf("server cpu: %ld ms over %ds (%.1f%%), %.1f us per chat\n",
+               cpu1 - cpu0, seconds, (cpu1 - cpu0) / (seconds * 10.0),
+               sent ? (cpu1 - cpu0) * 1000.0 / sent : 0.0);
+    }
+
+    // 5. 下线
+    for (int i = 0; i < nclients; i++) {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = 'Q';
+        snprintf(msg.id, sizeof(msg.id), "u%d", i);
+        send(fds[i], &msg, sizeof(msg), 0);
+        close(fds[i]);
+        if (i % 50 == 49) {
+            usleep(20000);
+        }
+    }
+    free(fds);
+    free(lat);
+    return 0;
+}
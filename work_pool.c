@@ -0,0 +1,248 @@
+/* --- work_pool.c (工作窃取线程池) --- */
+// 每个工作线程有自己的队列，里面放的是“有活要干的 strand”。
+// 工作线程先从自己队列头部取，取不到就去别的线程队列尾部偷一个；
+// 都没有就睡在条件变量上，直到有人提交新任务。
+// 另有一个全局的加急队列（pool_submit_urgent），工作线程每次先看它。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "work_pool.h"
+
+#define STRAND_BUDGET 16 // 一个 strand 一次最多连续执行多少个任务，防止饿死别的连接
+
+// 一个工作线程的队列（环形数组，满了就扩容）
+typedef struct
+{
+    pthread_mutex_t lock;
+    strand_t **ring;
+    int cap;
+    int head;
+    int count;
+} deque_t;
+
+static deque_t *deques;
+static deque_t urgent;  // 加急队列：所有工作线程共用
+static int nworkers;
+static int pending;     // 所有队列里 strand 的总数（原子访问）
+static int idle_count;  // 正在睡眠的工作线程数（原子访问）
+static unsigned int rr; // 非工作线程提交时轮流选队列
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static __thread int self = -1; // 当前线程的工作线程编号，-1 表示不是工作线程
+
+void strand_init(strand_t *s)
+{
+    pthread_mutex_init(&s->lock, NULL);
+    s->head = NULL;
+    s->tail = NULL;
+    s->scheduled = 0;
+    s->urgent = 0;
+}
+
+void strand_destroy(strand_t *s)
+{
+    pthread_mutex_destroy(&s->lock);
+}
+
+static void deque_push_back(deque_t *d, strand_t *s)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->cap) {
+        int cap = d->cap * 2;
+        strand_t **ring = malloc(sizeof(strand_t *) * cap);
+        for (int i = 0; i < d->count; i++) {
+            ring[i] = d->ring[(d->head + i) % d->cap];
+        }
+        free(d->ring);
+        d->ring = ring;
+        d->cap = cap;
+        d->head = 0;
+    }
+    d->ring[(d->head + d->count) % d->cap] = s;
+    d->count++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+// 自己的队列：从头部取（先来先服务）
+static strand_t *deque_pop_front(deque_t *d)
+{
+    strand_t *s = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        s = d->ring[d->head];
+        d->head = (d->head + 1) % d->cap;
+        d->count--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return s;
+}
+
+// 偷别人的：从尾部取，和队列主人错开
+static strand_t *deque_steal(deque_t *d)
+{
+    strand_t *s = NULL;
+    if (__atomic_load_n(&d->count, __ATOMIC_RELAXED) == 0) {
+        return NULL; // 不加锁先看一眼，空队列不去抢锁
+    }
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        d->count--;
+        s = d->ring[(d->head + d->count) % d->cap];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return s;
+}
+
+// 把 strand 放进某个队列（或加急队列），并在有空闲线程时叫醒一个
+static void schedule(strand_t *s, int is_urgent)
+{
+    if (is_urgent) {
+        deque_push_back(&urgent, s);
+    } else {
+        int target = self;
+        if (target < 0) {
+            target = __atomic_fetch_add(&rr, 1, __ATOMIC_RELAXED) % nworkers;
+        }
+        deque_push_back(&deques[target], s);
+    }
+
+    __atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&idle_count, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static void submit(strand_t *s, void (*fn)(void *arg), void *arg, int is_urgent)
+{
+    task_t *t = malloc(sizeof(task_t));
+    t->fn = fn;
+    t->arg = arg;
+    t->urgent = is_urgent;
+    t->next = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->tail != NULL) {
+        s->tail->next = t;
+    } else {
+        s->head = t;
+    }
+    s->tail = t;
+    s->urgent += is_urgent;
+    int need_schedule = !s->scheduled;
+    s->scheduled = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    if (need_schedule) {
+        schedule(s, is_urgent);
+    }
+}
+
+void pool_submit(strand_t *s, void (*fn)(void *arg), void *arg)
+{
+    submit(s, fn, arg, 0);
+}
+
+void pool_submit_urgent(strand_t *s, void (*fn)(void *arg), void *arg)
+{
+    submit(s, fn, arg, 1);
+}
+
+// 执行一个 strand 上的任务，最多 STRAND_BUDGET 个
+static void run_strand(strand_t *s)
+{
+    for (int i = 0; i < STRAND_BUDGET; i++) {
+        pthread_mutex_lock(&s->lock);
+        task_t *t = s->head;
+        if (t == NULL) {
+            s->scheduled = 0; // 干完了，下次提交时重新调度
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+        s->head = t->next;
+        if (s->head == NULL) {
+            s->tail = NULL;
+        }
+        s->urgent -= t->urgent;
+        pthread_mutex_unlock(&s->lock);
+
+        t->fn(t->arg);
+        free(t);
+    }
+    // 还有剩余任务：放回队尾，让别的 strand 先跑（scheduled 保持为 1）；
+    // 剩下的里面有加急任务就放回加急队列
+    pthread_mutex_lock(&s->lock);
+    int is_urgent = s->urgent > 0;
+    pthread_mutex_unlock(&s->lock);
+    schedule(s, is_urgent);
+}
+
+static strand_t *find_work(void)
+{
+    strand_t *s = NULL;
+    if (__atomic_load_n(&urgent.count, __ATOMIC_RELAXED) > 0) { // 先看加急队列，空的时候不加锁
+        s = deque_pop_front(&urgent);
+    }
+    if (s == NULL) {
+        s = deque_pop_front(&deques[self]);
+    }
+    for (int i = 1; s == NULL && i < nworkers; i++) {
+        s = deque_steal(&deques[(self + i) % nworkers]);
+    }
+    return s;
+}
+
+static void *worker_main(void *arg)
+{
+    self = (int)(long)arg;
+    while (1)
+    {
+        strand_t *s = find_work();
+        if (s != NULL) {
+            __atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+            run_strand(s);
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_lock);
+        __atomic_add_fetch(&idle_count, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+        __atomic_sub_fetch(&idle_count, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return NULL;
+}
+
+int pool_start(int n)
+{
+    if (n <= 0) {
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (n <= 0) n = 1;
+    }
+    nworkers = n;
+    pthread_mutex_init(&urgent.lock, NULL);
+    urgent.cap = 64;
+    urgent.ring = malloc(sizeof(strand_t *) * urgent.cap);
+    deques = calloc(n, sizeof(deque_t));
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].cap = 64;
+        deques[i].ring = malloc(sizeof(strand_t *) * deques[i].cap);
+    }
+
+    for (int i = 0; i < n; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, (void *)(long)i) != 0) {
+            perror("pthread_create (worker) error");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    printf("work pool started with %d workers\n", n);
+    return 0;
+}
@@ -0,0 +1,41 @@
+/* --- work_pool.h (工作窃取线程池) --- */
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <pthread.h>
+
+// 一个待执行的任务
+typedef struct task_t
+{
+    void (*fn)(void *arg);
+    void *arg;
+    int urgent;    // 1 = pool_submit_urgent 提交的
+    struct task_t *next;
+} task_t;
+
+// 串行队列：同一个 strand 上的任务按提交顺序执行，同一时刻只在一个工作线程上跑。
+// 每个连接一个 strand，这样同一连接的消息顺序不会被线程池打乱。
+typedef struct strand_t
+{
+    pthread_mutex_t lock;
+    task_t *head;
+    task_t *tail;
+    int scheduled; // 1 = 已经挂在某个工作线程的队列里或正在执行
+    int urgent;    // 还没执行的加急任务个数
+} strand_t;
+
+void strand_init(strand_t *s);
+void strand_destroy(strand_t *s);
+
+// 启动 nworkers 个工作线程 (<= 0 表示按 CPU 个数)
+int pool_start(int nworkers);
+
+// 把任务挂到 strand 上；strand 空闲时会被调度到某个工作线程
+void pool_submit(strand_t *s, void (*fn)(void *arg), void *arg);
+
+// 同上，但 strand 空闲时放进加急队列，排在所有普通 strand 前面（私聊、查询这类轻量请求用）。
+// strand 已经在普通队列里时照旧排着，轮到它之后只要还有加急任务就一直走加急队列。
+// 同一个 strand 上的任务顺序不变
+void pool_submit_urgent(strand_t *s, void (*fn)(void *arg), void *arg);
+
+#endif